@@ -12,6 +12,7 @@
 #include <utility>
 #include <limits>
 #include <algorithm>
+#include <cmath>
 
 
 namespace IceHalo {
@@ -22,9 +23,27 @@ RayPathFilterContext::RayPathFilterContext()
     : type(RayPathFilterContext::kTypeNone), symmetry(RayPathFilterContext::kSymmetryNone), hit_num(-1) {}
 
 
-CrystalContext::CrystalContext(CrystalPtrU&& g, const AxisDistribution& axis,
+CrystalContext::CrystalContext(CrystalPtr g, const AxisDistribution& axis,
                                const RayPathFilterContext& filter, float population)
-    : crystal_(std::move(g)), axis_(axis), ray_path_filter_(filter), population_(population) {}
+    : crystal_(std::move(g)), axis_(axis), ray_path_filter_(filter), population_(population),
+      roll_period_(360.0f), symmetry_period_(360.0f), mirror_symmetric_(false) {
+  if (!IsFilterSymmetric()) {
+    return;
+  }
+
+  // Crystal axes always have uniform longitude, so a vertical mirror only changes roll, as roll' = -2a - roll,
+  // where a is the angle of the mirror plane normal in crystal frame. A uniform roll takes any mirror, and
+  // other rolls take the one at -mean.
+  symmetry_period_ = 360.0f / crystal_->GetRotationalSymmetry();
+  if (axis_.roll_dist == Math::Distribution::UNIFORM) {
+    roll_period_ = symmetry_period_;
+    for (int k = 0; k < 12 && !mirror_symmetric_; k++) {
+      mirror_symmetric_ = crystal_->HasMirrorPlane(k * Math::kPi / 12);
+    }
+  } else {
+    mirror_symmetric_ = crystal_->HasMirrorPlane(-axis_.roll_mean * Math::kDegreeToRad);
+  }
+}
 
 
 CrystalPtr CrystalContext::GetCrystal() {
@@ -62,6 +81,59 @@ float CrystalContext::GetRollStd() const {
 }
 
 
+float CrystalContext::GetRollPeriod() const {
+  return roll_period_;
+}
+
+
+bool CrystalContext::IsMirrorSymmetric() const {
+  return mirror_symmetric_;
+}
+
+
+// Latitude is sampled from the axis distribution and reflected at the poles, and rays repeat themselves every
+// symmetry period of roll, so densities of all values giving the same latitude, or the same rays, are summed.
+float CrystalContext::GetOrientationPdf(float lat, float roll) const {
+  auto gauss = [](float x, float std) {
+    return std::exp(-x * x / (2 * std * std)) / (std * std::sqrt(2 * Math::kPi));
+  };
+
+  float lat_pdf = 0;
+  if (axis_.axis_dist == Math::Distribution::UNIFORM) {
+    lat_pdf = std::cos(lat) / 2;
+  } else {
+    float mean = axis_.axis_mean * Math::kDegreeToRad;
+    float std = axis_.axis_std * Math::kDegreeToRad;
+    if (std <= 0) {
+      return 0;
+    }
+    lat_pdf = gauss(lat - mean, std) + gauss(Math::kPi - lat - mean, std) + gauss(-Math::kPi - lat - mean, std);
+  }
+
+  float period = symmetry_period_ * Math::kDegreeToRad;
+  float roll_pdf = 0;
+  if (axis_.roll_dist == Math::Distribution::UNIFORM) {
+    roll_pdf = 1.0f / period;
+  } else {
+    float std = axis_.roll_std * Math::kDegreeToRad;
+    if (std <= 0) {
+      return 0;
+    }
+    float x = std::fmod(roll - axis_.roll_mean * Math::kDegreeToRad, period);
+    auto k_max = static_cast<int>(std::ceil(6 * std / period)) + 1;
+    for (int k = -k_max; k <= k_max; k++) {
+      roll_pdf += gauss(x + k * period, std);
+    }
+  }
+  return lat_pdf * roll_pdf;
+}
+
+
+bool CrystalContext::HasRayPathFilter() const {
+  return ray_path_filter_.type != RayPathFilterContext::kTypeNone;
+}
+
+
 float CrystalContext::GetPopulation() const {
   return population_;
 }
@@ -88,6 +160,21 @@ bool CrystalContext::FilterRay(RaySegment* last_r) {
 }
 
 
+// Specific filters already accept mirrored paths, and accept rotated paths with prism symmetry.
+// General filters tell faces apart.
+bool CrystalContext::IsFilterSymmetric() const {
+  switch (ray_path_filter_.type) {
+    case RayPathFilterContext::kTypeNone:
+    case RayPathFilterContext::kTypeHit:
+      return true;
+    case RayPathFilterContext::kTypeSpecific:
+      return ray_path_filter_.ray_path.empty() || (ray_path_filter_.symmetry & RayPathFilterContext::kSymmetryPrism);
+    default:
+      return false;
+  }
+}
+
+
 bool CrystalContext::FilterRaySpecific(IceHalo::RaySegment* last_r) {
   if (ray_path_filter_.ray_path.empty()) {
     return true;
@@ -228,10 +315,83 @@ bool CrystalContext::FilterRayHit(IceHalo::RaySegment* last_r) {
 }
 
 
+constexpr int LightSpectrum::kMinWavelength;
+constexpr int LightSpectrum::kMaxWavelength;
+constexpr float LightSpectrum::kSpectralDataTag;
+constexpr int LightSpectrum::kBinNum;
+
+LightSpectrum::LightSpectrum(const std::vector<float>& wavelengths, const std::vector<float>& values,
+                             Sampling sampling) {
+  float illuminant[kBinNum];
+  float pdf[kBinNum];
+  float illuminant_sum = 0;
+  float pdf_sum = 0;
+  for (int k = 0; k < kBinNum; k++) {
+    float wl = kMinWavelength + k + 0.5f;
+    auto it = std::lower_bound(wavelengths.begin(), wavelengths.end(), wl);
+    auto idx = it - wavelengths.begin();
+    float v = 0;
+    if (it != wavelengths.end() && *it == wl) {
+      v = values[idx];
+    } else if (it != wavelengths.end() && it != wavelengths.begin()) {
+      float t = (wl - wavelengths[idx - 1]) / (wavelengths[idx] - wavelengths[idx - 1]);
+      v = values[idx - 1] + t * (values[idx] - values[idx - 1]);
+    }
+    illuminant[k] = std::max(v, 0.0f);
+
+    float cmf[3];
+    ColorMatchingFunction::Get(kMinWavelength + k, cmf);
+    switch (sampling) {
+      case Sampling::kIlluminant:
+        pdf[k] = illuminant[k];
+        break;
+      case Sampling::kLuminance:
+        pdf[k] = illuminant[k] * cmf[1];
+        break;
+      case Sampling::kXyz:
+        pdf[k] = illuminant[k] * (cmf[0] + cmf[1] + cmf[2]);
+        break;
+    }
+    illuminant_sum += illuminant[k];
+    pdf_sum += pdf[k];
+  }
+  if (pdf_sum <= 0) {
+    throw std::invalid_argument("Light spectrum is zero in visible range. Parsing fail!");
+  }
+
+  cdf_[0] = 0;
+  for (int k = 0; k < kBinNum; k++) {
+    cdf_[k + 1] = cdf_[k] + pdf[k] / pdf_sum;
+    weight_[k] = pdf[k] > 0 ? (illuminant[k] / illuminant_sum) / (pdf[k] / pdf_sum) : 0.0f;
+  }
+}
+
+
+float LightSpectrum::Sample(float u) const {
+  int k = static_cast<int>(std::upper_bound(cdf_, cdf_ + kBinNum + 1, u) - cdf_) - 1;
+  k = std::min(std::max(k, 0), kBinNum - 1);
+  float width = cdf_[k + 1] - cdf_[k];
+  float t = width > 0 ? std::min((u - cdf_[k]) / width, 1.0f) : 0.5f;
+  return kMinWavelength + k + t;
+}
+
+
+float LightSpectrum::GetWeight(float wavelength) const {
+  auto k = static_cast<int>(std::floor(wavelength - kMinWavelength));
+  return k >= 0 && k < kBinNum ? weight_[k] : 0.0f;
+}
+
+
+constexpr int SimulationContext::kMaxHeroLanes;
+constexpr int SimulationContext::kDefaultParameterBuckets;
+
 SimulationContext::SimulationContext(const char* filename, rapidjson::Document& d)
-    : total_ray_num_(0), max_recursion_num_(9),
+    : total_ray_num_(0), max_recursion_num_(9), concurrent_wavelengths_(1), max_memory_(0),
       multi_scatter_times_(1), multi_scatter_prob_(1.0f),
-      current_wavelength_(550.0f), sun_diameter_(0.5f),
+      current_wavelength_(550.0f), hero_lanes_(1), correlated_sampling_(false),
+      quasi_random_sampling_(false), mirror_copies_(false), record_orientations_(false),
+      transfer_table_resolution_(1.0f), transfer_table_sample_num_(16),
+      sun_diameter_(0.5f),
       config_file_name_(filename), data_directory_("./") {
   constexpr size_t kTmpBufferSize = 65536;
   char buffer[kTmpBufferSize];
@@ -296,6 +456,26 @@ void SimulationContext::ParseBasicSettings(rapidjson::Document& d) {
     maxRecursion = std::min(std::max(p->GetInt(), 1), 10);
   }
   max_recursion_num_ = maxRecursion;
+
+  concurrent_wavelengths_ = 1;
+  p = Pointer("/concurrent_wavelengths").Get(d);
+  if (p == nullptr) {
+    fprintf(stderr, "\nWARNING! Config missing <concurrent_wavelengths>, using default 1!\n");
+  } else if (!p->IsInt()) {
+    fprintf(stderr, "\nWARNING! Config <concurrent_wavelengths> is not an integer, using default 1!\n");
+  } else {
+    concurrent_wavelengths_ = std::max(p->GetInt(), 1);
+  }
+
+  max_memory_ = 0;
+  p = Pointer("/max_memory").Get(d);
+  if (p == nullptr) {
+    fprintf(stderr, "\nWARNING! Config missing <max_memory>, using default 0 (no limit)!\n");
+  } else if (!p->IsUint64()) {
+    fprintf(stderr, "\nWARNING! Config <max_memory> is not unsigned int, using default 0 (no limit)!\n");
+  } else {
+    max_memory_ = p->GetUint64();
+  }
 }
 
 
@@ -327,6 +507,170 @@ void SimulationContext::ParseRaySettings(rapidjson::Document& d) {
       wavelengths_.push_back(static_cast<float &&>(pi.GetDouble()));
     }
   }
+
+  /* Parsing hero-wavelength lanes */
+  hero_lanes_ = 1;
+  p = Pointer("/ray/hero_lanes").Get(d);
+  if (p == nullptr) {
+    fprintf(stderr, "\nWARNING! Config missing <ray.hero_lanes>, using default 1!\n");
+  } else if (!p->IsInt()) {
+    fprintf(stderr, "\nWARNING! Config <ray.hero_lanes> is not an integer, using default 1!\n");
+  } else {
+    hero_lanes_ = std::min(std::max(p->GetInt(), 1), kMaxHeroLanes);
+  }
+
+  /* Parsing correlated sampling */
+  correlated_sampling_ = false;
+  p = Pointer("/ray/correlated_sampling").Get(d);
+  if (p == nullptr) {
+    fprintf(stderr, "\nWARNING! Config missing <ray.correlated_sampling>, using default false!\n");
+  } else if (!p->IsBool()) {
+    fprintf(stderr, "\nWARNING! Config <ray.correlated_sampling> is not a boolean, using default false!\n");
+  } else {
+    correlated_sampling_ = p->GetBool();
+  }
+
+  /* Parsing quasi-random sampling */
+  quasi_random_sampling_ = false;
+  p = Pointer("/ray/quasi_random").Get(d);
+  if (p == nullptr) {
+    fprintf(stderr, "\nWARNING! Config missing <ray.quasi_random>, using default false!\n");
+  } else if (!p->IsBool()) {
+    fprintf(stderr, "\nWARNING! Config <ray.quasi_random> is not a boolean, using default false!\n");
+  } else {
+    quasi_random_sampling_ = p->GetBool();
+  }
+
+  /* Parsing mirror copies */
+  mirror_copies_ = false;
+  p = Pointer("/ray/mirror_copies").Get(d);
+  if (p == nullptr) {
+    fprintf(stderr, "\nWARNING! Config missing <ray.mirror_copies>, using default false!\n");
+  } else if (!p->IsBool()) {
+    fprintf(stderr, "\nWARNING! Config <ray.mirror_copies> is not a boolean, using default false!\n");
+  } else {
+    mirror_copies_ = p->GetBool();
+  }
+
+  /* Parsing orientation records */
+  record_orientations_ = false;
+  p = Pointer("/ray/record_orientations").Get(d);
+  if (p == nullptr) {
+    fprintf(stderr, "\nWARNING! Config missing <ray.record_orientations>, using default false!\n");
+  } else if (!p->IsBool()) {
+    fprintf(stderr, "\nWARNING! Config <ray.record_orientations> is not a boolean, using default false!\n");
+  } else {
+    record_orientations_ = p->GetBool();
+  }
+
+  ParseSpectrumSettings(d);
+  ParseTransferTableSettings(d);
+}
+
+
+void SimulationContext::ParseTransferTableSettings(rapidjson::Document& d) {
+  transfer_table_path_.clear();
+  transfer_table_resolution_ = 1.0f;
+  transfer_table_sample_num_ = 16;
+  auto* p = Pointer("/ray/transfer_table").Get(d);
+  if (p == nullptr) {
+    fprintf(stderr, "\nWARNING! Config missing <ray.transfer_table>, tracing every ray!\n");
+    return;
+  } else if (!p->IsObject()) {
+    fprintf(stderr, "\nWARNING! Config <ray.transfer_table> is not an object, tracing every ray!\n");
+    return;
+  }
+
+  p = Pointer("/ray/transfer_table/path").Get(d);
+  if (p == nullptr || !p->IsString()) {
+    fprintf(stderr, "\nWARNING! Config <ray.transfer_table.path> is missing or not a string, tracing every ray!\n");
+    return;
+  }
+  transfer_table_path_ = p->GetString();
+
+  p = Pointer("/ray/transfer_table/resolution").Get(d);
+  if (p == nullptr) {
+    fprintf(stderr, "\nWARNING! Config missing <ray.transfer_table.resolution>, using default 1.0!\n");
+  } else if (!p->IsNumber() || p->GetDouble() <= 0) {
+    fprintf(stderr, "\nWARNING! Config <ray.transfer_table.resolution> is not a positive number, "
+                    "using default 1.0!\n");
+  } else {
+    transfer_table_resolution_ = static_cast<float>(p->GetDouble());
+  }
+
+  p = Pointer("/ray/transfer_table/samples").Get(d);
+  if (p == nullptr) {
+    fprintf(stderr, "\nWARNING! Config missing <ray.transfer_table.samples>, using default 16!\n");
+  } else if (!p->IsInt() || p->GetInt() <= 0) {
+    fprintf(stderr, "\nWARNING! Config <ray.transfer_table.samples> is not a positive integer, using default 16!\n");
+  } else {
+    transfer_table_sample_num_ = p->GetInt();
+  }
+}
+
+
+void SimulationContext::ParseSpectrumSettings(rapidjson::Document& d) {
+  /* Wavelengths are sampled per ray only if a spectrum is given */
+  spectrum_.reset();
+  auto* p = Pointer("/ray/spectrum").Get(d);
+  if (p == nullptr) {
+    fprintf(stderr, "\nWARNING! Config missing <ray.spectrum>, using fixed wavelengths!\n");
+    return;
+  } else if (!p->IsObject()) {
+    fprintf(stderr, "\nWARNING! Config <ray.spectrum> is not an object, using fixed wavelengths!\n");
+    return;
+  }
+
+  /* Parsing illuminant */
+  std::vector<float> wavelengths{ LightSpectrum::kMinWavelength, LightSpectrum::kMaxWavelength };
+  std::vector<float> values{ 1.0f, 1.0f };
+  p = Pointer("/ray/spectrum/illuminant").Get(d);
+  if (p == nullptr) {
+    fprintf(stderr, "\nWARNING! Config missing <ray.spectrum.illuminant>, using default flat!\n");
+  } else if (p->IsString() && *p == "sun") {
+    // Black body of 5778K
+    constexpr double kC2 = 1.4388e7;    // Second radiation constant, nm * K
+    constexpr double kSunTemperature = 5778;
+    wavelengths.clear();
+    values.clear();
+    for (int wl = LightSpectrum::kMinWavelength; wl <= LightSpectrum::kMaxWavelength; wl++) {
+      wavelengths.push_back(wl);
+      values.push_back(static_cast<float>(1e15 / std::pow(wl, 5) / (std::exp(kC2 / wl / kSunTemperature) - 1)));
+    }
+  } else if (p->IsString() && *p == "flat") {
+    // Default values
+  } else if (p->IsArray()) {
+    wavelengths.clear();
+    values.clear();
+    for (const auto& pi : p->GetArray()) {
+      if (!pi.IsArray() || pi.Size() != 2 || !pi[0].IsNumber() || !pi[1].IsNumber() ||
+          (!wavelengths.empty() && pi[0].GetDouble() <= wavelengths.back())) {
+        fprintf(stderr, "\nWARNING! Config <ray.spectrum.illuminant> cannot be recognized, using default flat!\n");
+        wavelengths = { LightSpectrum::kMinWavelength, LightSpectrum::kMaxWavelength };
+        values = { 1.0f, 1.0f };
+        break;
+      }
+      wavelengths.push_back(static_cast<float>(pi[0].GetDouble()));
+      values.push_back(static_cast<float>(pi[1].GetDouble()));
+    }
+  } else {
+    fprintf(stderr, "\nWARNING! Config <ray.spectrum.illuminant> cannot be recognized, using default flat!\n");
+  }
+
+  /* Parsing sampling pdf */
+  auto sampling = LightSpectrum::Sampling::kXyz;
+  p = Pointer("/ray/spectrum/sampling").Get(d);
+  if (p == nullptr) {
+    fprintf(stderr, "\nWARNING! Config missing <ray.spectrum.sampling>, using default xyz!\n");
+  } else if (p->IsString() && *p == "illuminant") {
+    sampling = LightSpectrum::Sampling::kIlluminant;
+  } else if (p->IsString() && *p == "luminance") {
+    sampling = LightSpectrum::Sampling::kLuminance;
+  } else if (!p->IsString() || *p != "xyz") {
+    fprintf(stderr, "\nWARNING! Config <ray.spectrum.sampling> cannot be recognized, using default xyz!\n");
+  }
+
+  spectrum_.reset(new LightSpectrum(wavelengths, values, sampling));
 }
 
 
@@ -440,8 +784,127 @@ void SimulationContext::ParseCrystalSettings(const rapidjson::Value& c, int ci)
     snprintf(msgBuffer, kMsgBufferSize, "<crystal[%d].type> cannot recognize!", ci);
     throw std::invalid_argument(msgBuffer);
   }
-  crystal_ctx_.emplace_back(std::make_shared<CrystalContext>(
-    crystal_parser_[type](this, c, ci), ParseCrystalAxis(c, ci), ParseCrystalRayPathFilter(c, ci), population));
+
+  auto axis = ParseCrystalAxis(c, ci);
+  auto filter = ParseCrystalRayPathFilter(c, ci);
+  auto parameter_buckets = ParseCrystalParameterBuckets(c, ci);
+  size_t shape_num = 1;
+  for (const auto& b : parameter_buckets) {
+    shape_num *= b.second.size();
+  }
+
+  // Shape parameter distributions make a family of crystals, one for every combination of parameter buckets,
+  // which share the population. Crystals of the same geometry share one, so that the simulator traces them
+  // together.
+  for (size_t k = 0; k < shape_num; k++) {
+    rapidjson::Document shape;
+    shape.CopyFrom(c, shape.GetAllocator());
+    auto idx = k;
+    for (const auto& b : parameter_buckets) {
+      Pointer(b.first.c_str()).Set(shape, b.second[idx % b.second.size()]);
+      idx /= b.second.size();
+    }
+
+    CrystalPtr crystal = crystal_parser_[type](this, shape, ci);
+    for (const auto& ctx : crystal_ctx_) {
+      if (ctx->GetCrystal()->HasSameGeometry(*crystal)) {
+        crystal = ctx->GetCrystal();
+        break;
+      }
+    }
+    crystal_ctx_.emplace_back(std::make_shared<CrystalContext>(crystal, axis, filter, population / shape_num));
+  }
+}
+
+
+namespace {
+
+// Miller indices of pyramidal faces are integers in the parameter array, so they cannot be distributions.
+bool IsMillerIndexParameter(const std::string& type, rapidjson::SizeType param_num, rapidjson::SizeType i) {
+  if (type == "HexPyramid") {
+    return (param_num == 5 && i < 2) || (param_num == 7 && i < 4);
+  } else if (type == "HexPyramidStackHalf") {
+    return param_num == 7 && i < 4;
+  } else if (type == "IrregularHexPyramid") {
+    return param_num == 13 && i >= 6 && i < 10;
+  }
+  return false;
+}
+
+}  // namespace
+
+
+// Find shape parameters given as distributions, and quantize every one into buckets of equal probability.
+// A bucket takes the median value of the distribution in it.
+std::vector<std::pair<std::string, std::vector<double> > > SimulationContext::ParseCrystalParameterBuckets(
+    const rapidjson::Value& c, int ci) {
+  using Math::Distribution;
+
+  constexpr size_t kMsgBufferSize = 256;
+  char msg_buffer[kMsgBufferSize];
+
+  std::vector<std::pair<std::string, std::vector<double> > > parameter_buckets;
+  std::vector<std::pair<std::string, const rapidjson::Value*> > distributions;
+  const auto* p = Pointer("/parameter").Get(c);
+  if (p != nullptr && p->IsObject()) {
+    distributions.emplace_back("/parameter", p);
+  } else if (p != nullptr && p->IsArray()) {
+    const auto* type = Pointer("/type").Get(c);
+    for (rapidjson::SizeType i = 0; i < p->Size(); i++) {
+      if (!(*p)[i].IsObject()) {
+        continue;
+      }
+      if (type != nullptr && type->IsString() && IsMillerIndexParameter(type->GetString(), p->Size(), i)) {
+        snprintf(msg_buffer, kMsgBufferSize, "<crystal[%d].parameter[%u]> is a Miller index, "
+                 "it cannot be a distribution!", ci, static_cast<unsigned>(i));
+        throw std::invalid_argument(msg_buffer);
+      }
+      distributions.emplace_back("/parameter/" + std::to_string(i), &(*p)[i]);
+    }
+  }
+
+  for (const auto& d : distributions) {
+    const auto* type = Pointer("/type").Get(*d.second);
+    const auto* mean = Pointer("/mean").Get(*d.second);
+    const auto* stddev = Pointer("/std").Get(*d.second);
+    if (type == nullptr || !type->IsString() || mean == nullptr || !mean->IsNumber() ||
+        stddev == nullptr || !stddev->IsNumber()) {
+      snprintf(msg_buffer, kMsgBufferSize, "<crystal[%d].parameter> cannot recognize!", ci);
+      throw std::invalid_argument(msg_buffer);
+    }
+    bool lognormal = *type == "lognormal";
+    if (!lognormal && *type != "gauss" && *type != "uniform") {
+      snprintf(msg_buffer, kMsgBufferSize, "<crystal[%d].parameter> distribution type cannot recognize!", ci);
+      throw std::invalid_argument(msg_buffer);
+    }
+    auto dist = *type == "uniform" ? Distribution::UNIFORM : Distribution::GAUSS;
+
+    int bucket_num = kDefaultParameterBuckets;
+    const auto* b = Pointer("/buckets").Get(*d.second);
+    if (b == nullptr || !b->IsInt() || b->GetInt() < 1) {
+      fprintf(stderr, "\nWARNING! <crystal[%d].parameter> buckets cannot recognize, using default %d!\n",
+              ci, kDefaultParameterBuckets);
+    } else {
+      bucket_num = b->GetInt();
+    }
+
+    // Lognormal takes mean as the median, and std as the standard deviation of its logarithm.
+    auto m = static_cast<float>(mean->GetDouble());
+    auto s = static_cast<float>(stddev->GetDouble());
+    std::vector<double> values;
+    for (int k = 0; k < bucket_num; k++) {
+      auto u = (k + 0.5f) / bucket_num;
+      double v = lognormal ? mean->GetDouble() * std::exp(Math::Quantile(dist, 0.0f, s, u)) :
+                             Math::Quantile(dist, m, s, u);
+      if (v <= 0) {
+        snprintf(msg_buffer, kMsgBufferSize, "<crystal[%d].parameter> distribution gives non-positive values!", ci);
+        throw std::invalid_argument(msg_buffer);
+      }
+      values.emplace_back(v);
+    }
+    parameter_buckets.emplace_back(d.first, std::move(values));
+  }
+  return parameter_buckets;
 }
 
 
@@ -808,6 +1271,61 @@ int SimulationContext::GetMaxRecursionNum() const {
 }
 
 
+int SimulationContext::GetHeroLanes() const {
+  return hero_lanes_;
+}
+
+
+bool SimulationContext::IsCorrelatedSampling() const {
+  return correlated_sampling_;
+}
+
+
+bool SimulationContext::IsQuasiRandomSampling() const {
+  return quasi_random_sampling_;
+}
+
+
+bool SimulationContext::IsMirrorCopies() const {
+  return mirror_copies_;
+}
+
+
+bool SimulationContext::IsRecordingOrientations() const {
+  return record_orientations_;
+}
+
+
+std::string SimulationContext::GetTransferTablePath() const {
+  return transfer_table_path_;
+}
+
+
+float SimulationContext::GetTransferTableResolution() const {
+  return transfer_table_resolution_;
+}
+
+
+int SimulationContext::GetTransferTableSampleNum() const {
+  return transfer_table_sample_num_;
+}
+
+
+const LightSpectrum* SimulationContext::GetSpectrum() const {
+  return spectrum_.get();
+}
+
+
+int SimulationContext::GetConcurrentWavelengths() const {
+  return concurrent_wavelengths_;
+}
+
+
+uint64_t SimulationContext::GetMaxMemory() const {
+  return max_memory_;
+}
+
+
 void SimulationContext::FillActiveCrystal(std::vector<CrystalContextPtr>* crystal_ctxs) const {
   crystal_ctxs->clear();
   for (const auto& ctx : crystal_ctx_) {
@@ -895,46 +1413,81 @@ void SimulationContext::PrintCrystalInfo() {
 
 
 
-RenderContext::RenderContext(rapidjson::Document& d) :
-    img_hei_(0), img_wid_(0), offset_y_(0), offset_x_(0),
+RenderContext::RenderContext(rapidjson::Document& d, int view_index) :
+    img_hei_(0), img_wid_(0), offset_y_(0), offset_x_(0), view_index_(view_index),
     visible_semi_sphere_(VisibleSemiSphere::kUpper),
     projection_type_(ProjectionType::kEqualArea),
     total_ray_num_(0), intensity_factor_(1.0), show_horizontal_(true),
     data_directory_("./") {
-  ParseCameraSettings(d);
+  const rapidjson::Value null_camera;
+  const auto* c = Pointer("/camera").Get(d);
+  if (c != nullptr && view_index >= 0) {
+    c = &(*c)[static_cast<rapidjson::SizeType>(view_index)];
+  }
+  ParseCameraSettings(c != nullptr ? *c : null_camera);
   ParseRenderSettings(d);
   ParseDataSettings(d);
 }
 
 
-std::unique_ptr<RenderContext> RenderContext::CreateFromFile(const char* filename) {
+bool RenderContext::ReadConfigFile(const char* filename, rapidjson::Document* d) {
   printf("Reading config from: %s\n", filename);
 
   FILE* fp = fopen(filename, "rb");
   if (!fp) {
     printf("ERROR: file %s cannot be open!\n", filename);
-    return nullptr;
+    return false;
   }
 
   constexpr size_t kTmpBufferSize = 65536;
   char buffer[kTmpBufferSize];
   rapidjson::FileReadStream is(fp, buffer, sizeof(buffer));
 
-  rapidjson::Document d;
-  if (d.ParseStream(is).HasParseError()) {
-    fprintf(stderr, "\nError(offset %u): %s\n", (unsigned)d.GetErrorOffset(),
-            GetParseError_En(d.GetParseError()));
+  if (d->ParseStream(is).HasParseError()) {
+    fprintf(stderr, "\nError(offset %u): %s\n", (unsigned)d->GetErrorOffset(),
+            GetParseError_En(d->GetParseError()));
     fclose(fp);
-    return nullptr;
+    return false;
   }
 
   fclose(fp);
+  return true;
+}
+
+
+std::unique_ptr<RenderContext> RenderContext::CreateFromFile(const char* filename) {
+  rapidjson::Document d;
+  if (!ReadConfigFile(filename, &d)) {
+    return nullptr;
+  }
+
+  /* If there are multiple views, only the first one is used */
+  const auto* p = Pointer("/camera").Get(d);
+  int view_index = p != nullptr && p->IsArray() && p->Size() > 0 ? 0 : -1;
+  return std::unique_ptr<RenderContext>(new RenderContext(d, view_index));
+}
+
 
-  return std::unique_ptr<RenderContext>(new RenderContext(d));
+std::vector<std::shared_ptr<RenderContext> > RenderContext::CreateViewsFromFile(const char* filename) {
+  std::vector<std::shared_ptr<RenderContext> > views;
+  rapidjson::Document d;
+  if (!ReadConfigFile(filename, &d)) {
+    return views;
+  }
+
+  const auto* p = Pointer("/camera").Get(d);
+  if (p != nullptr && p->IsArray() && p->Size() > 0) {
+    for (rapidjson::SizeType i = 0; i < p->Size(); i++) {
+      views.emplace_back(new RenderContext(d, static_cast<int>(i)));
+    }
+  } else {
+    views.emplace_back(new RenderContext(d, -1));
+  }
+  return views;
 }
 
 
-void RenderContext::ParseCameraSettings(rapidjson::Document& d) {
+void RenderContext::ParseCameraSettings(const rapidjson::Value& c) {
   cam_rot_[0] = 90.0f;
   cam_rot_[1] = 89.9f;
   cam_rot_[2] = 0.0f;
@@ -943,7 +1496,7 @@ void RenderContext::ParseCameraSettings(rapidjson::Document& d) {
   img_hei_ = 800;
   projection_type_ = ProjectionType::kEqualArea;
 
-  auto* p = Pointer("/camera/azimuth").Get(d);
+  auto* p = Pointer("/azimuth").Get(c);
   if (p == nullptr) {
     fprintf(stderr, "\nWARNING! Config missing <camera.azimuth>, using default 90.0!\n");
   } else if (!p->IsNumber()) {
@@ -954,7 +1507,7 @@ void RenderContext::ParseCameraSettings(rapidjson::Document& d) {
     cam_rot_[0] = 90.0f - az;
   }
 
-  p = Pointer("/camera/elevation").Get(d);
+  p = Pointer("/elevation").Get(c);
   if (p == nullptr) {
     fprintf(stderr, "\nWARNING! Config missing <camera.elevation>, using default 90.0!\n");
   } else if (!p->IsNumber()) {
@@ -965,7 +1518,7 @@ void RenderContext::ParseCameraSettings(rapidjson::Document& d) {
     cam_rot_[1] = el;
   }
 
-  p = Pointer("/camera/rotation").Get(d);
+  p = Pointer("/rotation").Get(c);
   if (p == nullptr) {
     fprintf(stderr, "\nWARNING! Config missing <camera.rotation>, using default 0.0!\n");
   } else if (!p->IsNumber()) {
@@ -976,7 +1529,7 @@ void RenderContext::ParseCameraSettings(rapidjson::Document& d) {
     cam_rot_[2] = rot;
   }
 
-  p = Pointer("/camera/fov").Get(d);
+  p = Pointer("/fov").Get(c);
   if (p == nullptr) {
     fprintf(stderr, "\nWARNING! Config missing <camera.fov>, using default 120.0!\n");
   } else if (!p->IsNumber()) {
@@ -986,7 +1539,7 @@ void RenderContext::ParseCameraSettings(rapidjson::Document& d) {
     fov_ = std::max(std::min(fov_, 140.0f), 0.0f);
   }
 
-  p = Pointer("/camera/width").Get(d);
+  p = Pointer("/width").Get(c);
   if (p == nullptr) {
     fprintf(stderr, "\nWARNING! Config missing <camera.width>, using default 800!\n");
   } else if (!p->IsInt()) {
@@ -997,7 +1550,7 @@ void RenderContext::ParseCameraSettings(rapidjson::Document& d) {
     img_wid_ = static_cast<uint32_t>(width);
   }
 
-  p = Pointer("/camera/height").Get(d);
+  p = Pointer("/height").Get(c);
   if (p == nullptr) {
     fprintf(stderr, "\nWARNING! Config missing <camera.height>, using default 800!\n");
   } else if (!p->IsInt()) {
@@ -1008,7 +1561,7 @@ void RenderContext::ParseCameraSettings(rapidjson::Document& d) {
     img_hei_ = static_cast<uint32_t>(height);
   }
 
-  p = Pointer("/camera/lens").Get(d);
+  p = Pointer("/lens").Get(c);
   if (p == nullptr) {
     fprintf(stderr, "\nWARNING! Config missing <camera.lens>, using default equi-area fisheye!\n");
   } else if (!p->IsString()) {
@@ -1041,6 +1594,10 @@ void RenderContext::ParseRenderSettings(rapidjson::Document& d) {
   ray_color_[1] = -1;
   ray_color_[2] = -1;
   show_horizontal_ = true;
+  accumulation_mode_ = AccumulationMode::kSpectrum;
+  spectrum_interpolation_ = SpectrumInterpolation::kNone;
+  mirror_fold_ = MirrorFold::kAuto;
+  cache_enabled_ = false;
 
   auto* p = Pointer("/render/visible_semi_sphere").Get(d);
   if (p == nullptr) {
@@ -1133,6 +1690,62 @@ void RenderContext::ParseRenderSettings(rapidjson::Document& d) {
   } else {
     show_horizontal_ = p->GetBool();
   }
+
+  p = Pointer("/render/accumulation").Get(d);
+  if (p == nullptr) {
+    fprintf(stderr, "\nWARNING! Config missing <render.accumulation>, using default kSpectrum!\n");
+  } else if (!p->IsString()) {
+    fprintf(stderr, "\nWARNING! Config <render.accumulation> is not a string, using default kSpectrum!\n");
+  } else if (*p == "spectrum") {
+    accumulation_mode_ = AccumulationMode::kSpectrum;
+  } else if (*p == "xyz") {
+    accumulation_mode_ = AccumulationMode::kXyz;
+  } else {
+    fprintf(stderr, "\nWARNING! Config <render.accumulation> cannot be recognized, using default kSpectrum!\n");
+  }
+
+  p = Pointer("/render/spectrum_interpolation").Get(d);
+  if (p == nullptr) {
+    fprintf(stderr, "\nWARNING! Config missing <render.spectrum_interpolation>, using default none!\n");
+  } else if (!p->IsString()) {
+    fprintf(stderr, "\nWARNING! Config <render.spectrum_interpolation> is not a string, using default none!\n");
+  } else if (*p == "none") {
+    spectrum_interpolation_ = SpectrumInterpolation::kNone;
+  } else if (*p == "linear") {
+    spectrum_interpolation_ = SpectrumInterpolation::kLinear;
+  } else if (*p == "dispersion") {
+    spectrum_interpolation_ = SpectrumInterpolation::kDispersion;
+  } else {
+    fprintf(stderr, "\nWARNING! Config <render.spectrum_interpolation> cannot be recognized, using default none!\n");
+  }
+  if (accumulation_mode_ == AccumulationMode::kXyz && spectrum_interpolation_ != SpectrumInterpolation::kNone) {
+    fprintf(stderr, "\nWARNING! <render.spectrum_interpolation> needs spectrum accumulation, disabled!\n");
+    spectrum_interpolation_ = SpectrumInterpolation::kNone;
+  }
+
+  p = Pointer("/render/mirror_fold").Get(d);
+  if (p == nullptr) {
+    fprintf(stderr, "\nWARNING! Config missing <render.mirror_fold>, using default auto!\n");
+  } else if (!p->IsString()) {
+    fprintf(stderr, "\nWARNING! Config <render.mirror_fold> is not a string, using default auto!\n");
+  } else if (*p == "auto") {
+    mirror_fold_ = MirrorFold::kAuto;
+  } else if (*p == "always") {
+    mirror_fold_ = MirrorFold::kAlways;
+  } else if (*p == "never") {
+    mirror_fold_ = MirrorFold::kNever;
+  } else {
+    fprintf(stderr, "\nWARNING! Config <render.mirror_fold> cannot be recognized, using default auto!\n");
+  }
+
+  p = Pointer("/render/cache").Get(d);
+  if (p == nullptr) {
+    fprintf(stderr, "\nWARNING! Config missing <render.cache>, using default false!\n");
+  } else if (!p->IsBool()) {
+    fprintf(stderr, "\nWARNING! Config <render.cache> is not a boolean, using default false!\n");
+  } else {
+    cache_enabled_ = p->GetBool();
+  }
 }
 
 
@@ -1160,7 +1773,35 @@ uint32_t RenderContext::GetImageHeight() const {
 
 
 std::string RenderContext::GetImagePath() const {
-  return PathJoin(data_directory_, "img.jpg");
+  return PathJoin(data_directory_, GetViewFileName("img", "jpg"));
+}
+
+
+std::string RenderContext::GetHdrImagePath() const {
+  return PathJoin(data_directory_, GetViewFileName("img", "pfm"));
+}
+
+
+std::string RenderContext::GetCachePath() const {
+  return PathJoin(data_directory_, GetViewFileName("render_cache", "dat"));
+}
+
+
+// Output files of view i are named as <name>_<i>.<ext>, or <name>.<ext> if there is only a single camera.
+std::string RenderContext::GetViewFileName(const char* name, const char* ext) const {
+  constexpr size_t kBufferSize = 256;
+  char buffer[kBufferSize];
+  if (view_index_ < 0) {
+    snprintf(buffer, kBufferSize, "%s.%s", name, ext);
+  } else {
+    snprintf(buffer, kBufferSize, "%s_%d.%s", name, view_index_, ext);
+  }
+  return std::string(buffer);
+}
+
+
+bool RenderContext::IsCacheEnabled() const {
+  return cache_enabled_;
 }
 
 
@@ -1189,6 +1830,21 @@ VisibleSemiSphere RenderContext::GetVisibleSemiSphere() const {
 }
 
 
+AccumulationMode RenderContext::GetAccumulationMode() const {
+  return accumulation_mode_;
+}
+
+
+SpectrumInterpolation RenderContext::GetSpectrumInterpolation() const {
+  return spectrum_interpolation_;
+}
+
+
+MirrorFold RenderContext::GetMirrorFold() const {
+  return mirror_fold_;
+}
+
+
 int RenderContext::GetOffsetX() const {
   return offset_x_;
 }
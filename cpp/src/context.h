@@ -24,6 +24,9 @@ class CrystalContext;
 
 enum class ProjectionType;
 enum class VisibleSemiSphere;
+enum class AccumulationMode;
+enum class SpectrumInterpolation;
+enum class MirrorFold;
 
 struct AxisDistribution {
   Math::Distribution axis_dist;
@@ -61,10 +64,46 @@ struct RayPathFilterContext {
 };
 
 
+/* Light source spectrum for spectral Monte Carlo tracing, where every ray samples its own wavelength.
+ * The illuminant and the sampling pdf are tabulated in 1nm bins over [kMinWavelength, kMaxWavelength).
+ * A ray of wavelength wl carries weight illuminant(wl) / pdf(wl), so weights average to 1. */
+class LightSpectrum {
+public:
+  enum class Sampling {
+    kIlluminant,    // pdf proportional to illuminant
+    kLuminance,     // pdf proportional to illuminant * CIE Y
+    kXyz,           // pdf proportional to illuminant * (CIE X + Y + Z)
+  };
+
+  /*! @brief Create a spectrum from illuminant samples.
+   *
+   * @param wavelengths wavelengths of illuminant samples, in ascending order, in nm.
+   * @param values illuminant values. They are linearly interpolated, and zero out of the samples.
+   * @param sampling how wavelengths are sampled.
+   */
+  LightSpectrum(const std::vector<float>& wavelengths, const std::vector<float>& values, Sampling sampling);
+
+  float Sample(float u) const;                  // Map a uniform number in [0, 1) to a wavelength
+  float GetWeight(float wavelength) const;      // illuminant / pdf
+
+  static constexpr int kMinWavelength = 360;
+  static constexpr int kMaxWavelength = 830;
+  static constexpr float kSpectralDataTag = 0.0f;   // Wavelength in header of data files whose rays carry their own
+
+private:
+  static constexpr int kBinNum = kMaxWavelength - kMinWavelength;
+
+  float cdf_[kBinNum + 1];
+  float weight_[kBinNum];
+};
+
+
 class SimulationContext {
 public:
   uint64_t GetTotalInitRays() const;
   int GetMaxRecursionNum() const;
+  int GetConcurrentWavelengths() const;
+  uint64_t GetMaxMemory() const;      // In MB, 0 for no limit
 
   int GetMultiScatterTimes() const;
   float GetMultiScatterProb() const;
@@ -75,6 +114,15 @@ public:
   void SetCurrentWavelength(float wavelength);
   float GetCurrentWavelength() const;
   std::vector<float> GetWavelengths() const;
+  int GetHeroLanes() const;
+  bool IsCorrelatedSampling() const;
+  bool IsQuasiRandomSampling() const;
+  bool IsMirrorCopies() const;
+  bool IsRecordingOrientations() const;
+  std::string GetTransferTablePath() const;     // Empty if transfer tables are not used
+  float GetTransferTableResolution() const;     // In degree
+  int GetTransferTableSampleNum() const;        // Entry rays traced in every bin
+  const LightSpectrum* GetSpectrum() const;     // nullptr if wavelengths are fixed
 
   const float* GetSunRayDir() const;
   float GetSunDiameter() const;
@@ -90,6 +138,8 @@ public:
 
   static constexpr float kPropMinW = 1e-6;
   static constexpr float kScatMinW = 1e-3;
+  static constexpr int kMaxHeroLanes = 8;
+  static constexpr int kDefaultParameterBuckets = 8;     // Crystals of a shape parameter distribution
 
 private:
   SimulationContext(const char* filename, rapidjson::Document& d);
@@ -99,12 +149,16 @@ private:
 
   void ParseBasicSettings(rapidjson::Document& d);
   void ParseRaySettings(rapidjson::Document& d);
+  void ParseSpectrumSettings(rapidjson::Document& d);
+  void ParseTransferTableSettings(rapidjson::Document& d);
   void ParseSunSettings(rapidjson::Document& d);
   void ParseDataSettings(rapidjson::Document& d);
   void ParseMultiScatterSettings(rapidjson::Document& d);
 
   void ParseCrystalSettings(const rapidjson::Value& c, int ci);
   AxisDistribution ParseCrystalAxis(const rapidjson::Value& c, int ci);
+  std::vector<std::pair<std::string, std::vector<double> > > ParseCrystalParameterBuckets(const rapidjson::Value& c,
+                                                                                          int ci);
   RayPathFilterContext ParseCrystalRayPathFilter(const rapidjson::Value& c, int ci);
   CrystalPtrU ParseCrystalHexPrism(const rapidjson::Value& c, int ci);
   CrystalPtrU ParseCrystalHexPyramid(const rapidjson::Value& c, int ci);
@@ -121,12 +175,23 @@ private:
 
   uint64_t total_ray_num_;
   int max_recursion_num_;
+  int concurrent_wavelengths_;
+  uint64_t max_memory_;
 
   int multi_scatter_times_;
   float multi_scatter_prob_;
 
   float current_wavelength_;
   std::vector<float> wavelengths_;
+  int hero_lanes_;
+  bool correlated_sampling_;
+  bool quasi_random_sampling_;
+  bool mirror_copies_;
+  bool record_orientations_;
+  std::string transfer_table_path_;
+  float transfer_table_resolution_;
+  int transfer_table_sample_num_;
+  std::unique_ptr<LightSpectrum> spectrum_;
 
   float sun_ray_dir_[3];
   float sun_diameter_;
@@ -138,7 +203,7 @@ private:
 
 class CrystalContext {
 public:
-  CrystalContext(CrystalPtrU&& g, const AxisDistribution& axis, const RayPathFilterContext& filter, float population);
+  CrystalContext(CrystalPtr g, const AxisDistribution& axis, const RayPathFilterContext& filter, float population);
 
   CrystalPtr GetCrystal();
   Math::Distribution GetAxisDist() const;
@@ -148,6 +213,30 @@ public:
   float GetAxisStd() const;
   float GetRollStd() const;
 
+  /*! @brief Period of roll in degree. Rolls sampled in [0, period) give the same rays as the full circle.
+   *
+   * It is less than 360 only if roll is uniform, the crystal has rotational symmetry, and the ray path filter
+   * does not tell rotated faces apart.
+   */
+  float GetRollPeriod() const;
+
+  /*! @brief Test if crystals are as likely as their mirror images by any vertical plane, together with their
+   * ray paths. Then the mirror image of a ray is as likely as the ray itself.
+   */
+  bool IsMirrorSymmetric() const;
+
+  /*! @brief Probability density of a crystal orientation, as sampled from the axis and roll distributions.
+   *
+   * Longitude of the main axis is always uniform, and left out. Zero if a distribution has zero width.
+   *
+   * @param lat latitude of the main axis, in rad, in [-pi/2, pi/2].
+   * @param roll roll, in rad. Rolls a symmetry period apart give the same rays, and are counted together.
+   * @return density over latitude and roll, in 1/rad^2.
+   */
+  float GetOrientationPdf(float lat, float roll) const;
+
+  bool HasRayPathFilter() const;
+
   float GetPopulation() const;
   void SetPopulation(float population);
 
@@ -158,11 +247,15 @@ private:
   bool FilterRaySpecific(RaySegment* last_r);
   bool FilterRayDirectionalSymm(RaySegment* last_r, bool original);
   bool FilterRayHit(RaySegment* last_r);
+  bool IsFilterSymmetric() const;
 
   CrystalPtr crystal_;
   const AxisDistribution axis_;
   const RayPathFilterContext ray_path_filter_;
   float population_;
+  float roll_period_;
+  float symmetry_period_;     // Roll period of the crystal and its ray path filter, in degree
+  bool mirror_symmetric_;
 };
 
 
@@ -173,6 +266,9 @@ public:
   uint32_t GetImageWidth() const;
   uint32_t GetImageHeight() const;
   std::string GetImagePath() const;
+  std::string GetHdrImagePath() const;
+  std::string GetCachePath() const;
+  bool IsCacheEnabled() const;
 
   std::string GetDataDirectory() const;
 
@@ -180,6 +276,9 @@ public:
   float GetFov() const;
   ProjectionType GetProjectionType() const;
   VisibleSemiSphere GetVisibleSemiSphere() const;
+  AccumulationMode GetAccumulationMode() const;
+  SpectrumInterpolation GetSpectrumInterpolation() const;
+  MirrorFold GetMirrorFold() const;
 
   int GetOffsetX() const;
   int GetOffsetY() const;
@@ -191,12 +290,16 @@ public:
   double GetIntensityFactor() const;
 
   static std::unique_ptr<RenderContext> CreateFromFile(const char* filename);
+  static std::vector<std::shared_ptr<RenderContext> > CreateViewsFromFile(const char* filename);   // One context for each camera
 
 private:
-  explicit RenderContext(rapidjson::Document& d);
+  RenderContext(rapidjson::Document& d, int view_index);
+
+  static bool ReadConfigFile(const char* filename, rapidjson::Document* d);
+  std::string GetViewFileName(const char* name, const char* ext) const;
 
   /* Parse rendering settings */
-  void ParseCameraSettings(rapidjson::Document& d);
+  void ParseCameraSettings(const rapidjson::Value& c);
   void ParseRenderSettings(rapidjson::Document& d);
   void ParseDataSettings(rapidjson::Document& d);
 
@@ -210,13 +313,18 @@ private:
   uint32_t img_wid_;
   int offset_y_;
   int offset_x_;
+  int view_index_;                  // Index in camera list, or -1 if camera is a single object
   VisibleSemiSphere visible_semi_sphere_;
   ProjectionType projection_type_;
+  AccumulationMode accumulation_mode_;
+  SpectrumInterpolation spectrum_interpolation_;
+  MirrorFold mirror_fold_;
 
   uint32_t total_ray_num_;
   double intensity_factor_;
 
   bool show_horizontal_;
+  bool cache_enabled_;
 
   std::string data_directory_;
 };
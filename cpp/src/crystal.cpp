@@ -3,6 +3,7 @@
 #include <algorithm>
 #include <cstring>
 #include <cassert>
+#include <limits>
 
 namespace IceHalo {
 
@@ -83,6 +84,95 @@ int Crystal::GetFaceNumberPeriod() const {
 }
 
 
+// A crystal is convex if no vertex lies outside of any face plane. Face normals point outwards.
+bool Crystal::IsConvex() const {
+  for (decltype(faces_.size()) i = 0; i < faces_.size(); i++) {
+    for (const auto& v : vertexes_) {
+      float d[3];
+      Math::Vec3FromTo(face_vertexes_ + i * 9, v.val(), d);
+      if (Math::Dot3(d, face_norm_ + i * 3) > Math::kFloatEps * 10) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+
+int Crystal::GetRotationalSymmetry() const {
+  for (int n : { 6, 4, 3, 2 }) {
+    float c = std::cos(2 * Math::kPi / n);
+    float s = std::sin(2 * Math::kPi / n);
+    float m[9] = { c, -s, 0, s, c, 0, 0, 0, 1 };
+    if (IsInvariant(m)) {
+      return n;
+    }
+  }
+  return 1;
+}
+
+
+bool Crystal::HasMirrorPlane(float angle) const {
+  float nx = std::cos(angle);
+  float ny = std::sin(angle);
+  float m[9] = { 1 - 2 * nx * nx, -2 * nx * ny, 0, -2 * nx * ny, 1 - 2 * ny * ny, 0, 0, 0, 1 };
+  return IsInvariant(m);
+}
+
+
+bool Crystal::HasSameGeometry(const Crystal& other) const {
+  return faces_.size() == other.faces_.size() &&
+         face_number_map_ == other.face_number_map_ &&
+         face_number_period_ == other.face_number_period_ &&
+         std::memcmp(face_vertexes_, other.face_vertexes_, sizeof(float) * faces_.size() * 9) == 0;
+}
+
+
+// Test if the vertex set is mapped to itself by a linear transform m around the vertical axis through the vertex
+// centroid. A translated crystal traces the same directions, so the center does not matter.
+// For a convex crystal, the vertex set decides the shape.
+bool Crystal::IsInvariant(const float* m) const {
+  if (vertexes_.empty() || !IsConvex()) {
+    return false;
+  }
+
+  float center[3] = { 0, 0, 0 };
+  for (const auto& v : vertexes_) {
+    center[0] += v.x();
+    center[1] += v.y();
+  }
+  center[0] /= vertexes_.size();
+  center[1] /= vertexes_.size();
+
+  float size = 0;
+  for (const auto& v : vertexes_) {
+    float d[3];
+    Math::Vec3FromTo(center, v.val(), d);
+    size = std::max(size, Math::Norm3(d));
+  }
+  float tol = size * 1e-4f;
+
+  for (const auto& v : vertexes_) {
+    float d[3];
+    Math::Vec3FromTo(center, v.val(), d);
+    float p[3] = { Math::Dot3(m, d), Math::Dot3(m + 3, d), Math::Dot3(m + 6, d) };
+    bool matched = false;
+    for (const auto& w : vertexes_) {
+      float q[3];
+      Math::Vec3FromTo(center, w.val(), q);
+      if (std::abs(p[0] - q[0]) < tol && std::abs(p[1] - q[1]) < tol && std::abs(p[2] - q[2]) < tol) {
+        matched = true;
+        break;
+      }
+    }
+    if (!matched) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
 int Crystal::TotalVertexes() const {
   return static_cast<int>(vertexes_.size());
 }
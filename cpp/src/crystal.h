@@ -34,6 +34,24 @@ public:
   const float* GetFaceBaseVector() const;
   const float* GetFaceNorm() const;
   int GetFaceNumberPeriod() const;
+  bool IsConvex() const;
+
+  /*! @brief Order n of rotational symmetry about z axis (the c-axis). The crystal is unchanged when rotated by
+   * 360 / n degrees. 1 if there is no symmetry, or if the crystal is not convex.
+   */
+  int GetRotationalSymmetry() const;
+
+  /*! @brief Test if the crystal is unchanged when reflected by a plane containing z axis.
+   *
+   * @param angle the angle from x axis to the normal of the plane, in radian.
+   * @return false also if the crystal is not convex.
+   */
+  bool HasMirrorPlane(float angle) const;
+
+  /*! @brief Test if the other crystal has exactly the same faces and face numbers, so that it traces the same rays
+   * and ray paths as this one.
+   */
+  bool HasSameGeometry(const Crystal& other) const;
 
   void CopyFaceAreaData(float* data) const;
 
@@ -146,6 +164,7 @@ protected:
   void InitFaceNumberHex();
   void InitFaceNumberCubic();
   void InitFaceNumberStack();
+  bool IsInvariant(const float* m) const;
 
   static const std::vector<std::pair<Math::Vec3f, int> > hex_face_norm_to_number_list_;
   static const std::vector<std::pair<Math::Vec3f, int> > cubic_face_norm_to_number_list_;
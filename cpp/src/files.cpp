@@ -1,6 +1,7 @@
 #include "files.h"
 
 #include <cstdio>
+#include <cstring>
 #include <algorithm>
 
 
@@ -29,6 +30,25 @@ std::vector<File> ListDataFiles(const char* dir) {
 }
 
 
+bool IsMirrorData(const File& file) {
+  auto stem = boost::filesystem::path(file.GetFilename()).stem().string();
+  auto tag_len = std::strlen(kMirrorDataTag);
+  return stem.size() >= tag_len && stem.compare(stem.size() - tag_len, tag_len, kMirrorDataTag) == 0;
+}
+
+
+std::string GetOrientationFileName(const std::string& data_filename) {
+  constexpr char kDataPrefix[] = "directions";
+  auto name = boost::filesystem::path(data_filename).stem().string();
+  if (name.compare(0, std::strlen(kDataPrefix), kDataPrefix) == 0) {
+    name.replace(0, std::strlen(kDataPrefix), "orientations");
+  } else {
+    name = "orientations_" + name;
+  }
+  return name + ".dat";
+}
+
+
 std::string PathJoin(const std::string& p1, const std::string& p2) {
   boost::filesystem::path p(p1);
   p /= (p2);
@@ -36,6 +56,77 @@ std::string PathJoin(const std::string& p1, const std::string& p2) {
 }
 
 
+namespace {
+
+bool IsLittleEndian() {
+  uint32_t v = 1;
+  uint8_t b = 0;
+  std::memcpy(&b, &v, 1);
+  return b == 1;
+}
+
+
+void SwapBytes(float* data, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    uint8_t b[4];
+    std::memcpy(b, data + i, 4);
+    std::swap(b[0], b[3]);
+    std::swap(b[1], b[2]);
+    std::memcpy(data + i, b, 4);
+  }
+}
+
+}  // namespace
+
+
+// PFM stores rows from bottom to top. A negative scale in header means little endian.
+bool WritePfm(const char* filename, uint32_t width, uint32_t height, const float* data) {
+  std::FILE* fp = std::fopen(filename, "wb");
+  if (!fp) {
+    return false;
+  }
+
+  bool little_endian = IsLittleEndian();
+  std::fprintf(fp, "PF\n%u %u\n%s\n", width, height, little_endian ? "-1.0" : "1.0");
+  size_t row_size = width * 3;
+  bool ok = true;
+  for (uint32_t y = height; ok && y > 0; y--) {
+    ok = std::fwrite(data + (y - 1) * row_size, sizeof(float), row_size, fp) == row_size;
+  }
+  std::fclose(fp);
+  return ok;
+}
+
+
+bool ReadPfm(const char* filename, uint32_t* width, uint32_t* height, std::vector<float>* data) {
+  std::FILE* fp = std::fopen(filename, "rb");
+  if (!fp) {
+    return false;
+  }
+
+  char magic[3] = { 0 };
+  float scale = 0;
+  if (std::fscanf(fp, "%2s %u %u %f", magic, width, height, &scale) != 4 ||
+      std::strcmp(magic, "PF") != 0 || std::fgetc(fp) == EOF) {
+    std::fclose(fp);
+    return false;
+  }
+
+  size_t row_size = *width * 3;
+  data->resize(row_size * *height);
+  bool ok = true;
+  for (uint32_t y = *height; ok && y > 0; y--) {
+    ok = std::fread(data->data() + (y - 1) * row_size, sizeof(float), row_size, fp) == row_size;
+  }
+  std::fclose(fp);
+
+  if (ok && (scale < 0) != IsLittleEndian()) {
+    SwapBytes(data->data(), data->size());
+  }
+  return ok;
+}
+
+
 File::File(const char* filename)
     : file_(nullptr), file_opened_(false),
       path_(filename) {}
@@ -82,16 +173,17 @@ bool File::Open(uint8_t mode) {
 
 
 bool File::Close() {
+  bool ok = true;
   if (file_opened_) {
-    std::fclose(file_);
+    ok = std::fclose(file_) == 0;
     file_ = nullptr;
     file_opened_ = false;
   }
-  return true;
+  return ok;
 }
 
 
-size_t File::GetSize() {
+size_t File::GetSize() const {
   auto size = file_size(path_);
   if (size == static_cast<uintmax_t>(-1)) {
     return 0;
@@ -100,4 +192,85 @@ size_t File::GetSize() {
   }
 }
 
+
+std::string File::GetFilename() const {
+  return path_.filename().string();
+}
+
+
+AsyncFileWriter::AsyncFileWriter(const std::string& path, size_t buffer_num)
+    : path_(path), free_buffers_(std::max(buffer_num, static_cast<size_t>(1))), writing_(false), stop_(false),
+      failed_(false), thread_(&AsyncFileWriter::Run, this) {}
+
+
+AsyncFileWriter::~AsyncFileWriter() {
+  Flush();
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  thread_.join();
+}
+
+
+std::vector<float> AsyncFileWriter::GetBuffer() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [this] { return !free_buffers_.empty(); });
+  auto buffer = std::move(free_buffers_.back());
+  free_buffers_.pop_back();
+  buffer.clear();
+  return buffer;
+}
+
+
+void AsyncFileWriter::Write(const std::string& filename, uint8_t mode, std::vector<float>&& data) {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    tasks_.push_back(Task{ filename, mode, std::move(data) });
+  }
+  cv_.notify_all();
+}
+
+
+bool AsyncFileWriter::Flush() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [this] { return tasks_.empty() && !writing_; });
+  return !failed_;
+}
+
+
+void AsyncFileWriter::Run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    cv_.wait(lock, [this] { return stop_ || !tasks_.empty(); });
+    if (tasks_.empty()) {
+      return;
+    }
+
+    auto task = std::move(tasks_.front());
+    tasks_.pop_front();
+    writing_ = true;
+    lock.unlock();
+
+    File file(path_.c_str(), task.filename.c_str());
+    bool ok = file.Open(task.mode);
+    if (ok) {
+      ok = file.Write(task.data.data(), task.data.size()) == task.data.size();
+      ok = file.Close() && ok;
+      if (!ok) {
+        std::fprintf(stderr, "\nERROR! Cannot write %s!\n", file.GetFilename().c_str());
+      }
+    } else {
+      std::fprintf(stderr, "\nERROR! Cannot open %s to write!\n", file.GetFilename().c_str());
+    }
+
+    lock.lock();
+    failed_ = failed_ || !ok;
+    free_buffers_.emplace_back(std::move(task.data));
+    writing_ = false;
+    cv_.notify_all();
+  }
+}
+
 }  // namespace IceHalo
@@ -3,6 +3,10 @@
 
 #include <vector>
 #include <string>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #define BOOST_FILESYSTEM_NO_DEPRECATED
 #include <boost/filesystem.hpp>
@@ -27,7 +31,8 @@ public:
   bool Open(uint8_t mode = OpenMode::kRead);
   bool Close();
 
-  size_t GetSize();
+  size_t GetSize() const;
+  std::string GetFilename() const;
 
   template<class T>
   size_t Read(T* buffer, size_t n = 1);
@@ -78,12 +83,67 @@ size_t File::Write(const T* data, size_t n) {
   return count;
 }
 
+/* Write float data files into a directory in a background thread, so that writing overlaps with computing.
+ *
+ * Data are passed in blocks got from GetBuffer(). There are a fixed number of blocks, by default two,
+ * so one is filled while the other is written. A block is returned for reuse, with its capacity, when
+ * it is written, and GetBuffer() waits if all blocks are in use. Blocks are written in the order they
+ * are passed in, so several blocks may be appended to one file.
+ */
+class AsyncFileWriter {
+public:
+  explicit AsyncFileWriter(const std::string& path, size_t buffer_num = 2);
+  ~AsyncFileWriter();                 // Flush() before return
+  AsyncFileWriter(AsyncFileWriter const&) = delete;
+  void operator=(AsyncFileWriter const&) = delete;
+
+  std::vector<float> GetBuffer();     // An empty block. Wait till one is free.
+  void Write(const std::string& filename, uint8_t mode, std::vector<float>&& data);
+  bool Flush();                       // Wait till all blocks are written. False if any write has failed.
+
+private:
+  struct Task {
+    std::string filename;
+    uint8_t mode;
+    std::vector<float> data;
+  };
+
+  void Run();
+
+  std::string path_;
+  std::deque<Task> tasks_;
+  std::vector<std::vector<float> > free_buffers_;
+  bool writing_;
+  bool stop_;
+  bool failed_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::thread thread_;
+};
+
+
 bool exists(const char* filename);
 
 std::vector<File> ListDataFiles(const char* dir);
 
+/* Tag at the end of a data file name, before the extension, if every ray in it is as likely as its mirror image
+ * by the vertical plane of the sun. The renderer may fold such data onto both sides. */
+constexpr char kMirrorDataTag[] = "_mirror";
+bool IsMirrorData(const File& file);
+
+/* Orientation records of a data file, written if the simulation records orientations. The file name is that of
+ * the data file, with "directions" replaced by "orientations", and extension ".dat" so that it is not taken as
+ * a data file. */
+std::string GetOrientationFileName(const std::string& data_filename);
+
 std::string PathJoin(const std::string& p1, const std::string& p2);
 
+/* Read and write 3-channel float images in PFM format. Data are row-major from the top row, width x height x 3.
+ * Files are written in little endian. */
+bool WritePfm(const char* filename, uint32_t width, uint32_t height, const float* data);
+bool ReadPfm(const char* filename, uint32_t* width, uint32_t* height, std::vector<float>* data);
+
 }  // namespace IceHalo
 
 #endif  // SRC_FILES_H_
@@ -1,4 +1,5 @@
 #include "mymath.h"
+#include "simdmath.h"
 
 #include <cstring>
 #include <algorithm>
@@ -66,18 +67,23 @@ void Vec3FromTo(const float* vec1, const float* vec2, float* vec) {
 }
 
 
+void RotateZMatrix(const float* lon_lat_roll, float* mat) {
+  float cl = std::cos(lon_lat_roll[0]);
+  float sl = std::sin(lon_lat_roll[0]);
+  float ca = std::cos(lon_lat_roll[1]);
+  float sa = std::sin(lon_lat_roll[1]);
+  float cr = std::cos(lon_lat_roll[2]);
+  float sr = std::sin(lon_lat_roll[2]);
+  float ax[9] = {-cr * sl - cl * sa * sr, -cl * cr * sa + sl * sr, cl * ca,
+                 cl * cr - sl * sa * sr, -cr * sl * sa - cl * sr, ca * sl,
+                 ca * sr, ca * cr, sa};
+  std::memcpy(mat, ax, sizeof(float) * 9);
+}
+
+
 void RotateZ(const float* lon_lat_roll, const float* input_vec, float* output_vec, uint64_t dataNum) {
-  using std::cos;
-  using std::sin;
-  float ax[9] = {-cos(lon_lat_roll[2]) * sin(lon_lat_roll[0]) - cos(lon_lat_roll[0]) * sin(lon_lat_roll[1]) * sin(lon_lat_roll[2]),
-                 -cos(lon_lat_roll[0]) * cos(lon_lat_roll[2]) * sin(lon_lat_roll[1]) + sin(lon_lat_roll[0]) * sin(lon_lat_roll[2]),
-                 cos(lon_lat_roll[0]) * cos(lon_lat_roll[1]),
-                 cos(lon_lat_roll[0]) * cos(lon_lat_roll[2]) - sin(lon_lat_roll[0]) * sin(lon_lat_roll[1]) * sin(lon_lat_roll[2]),
-                 -cos(lon_lat_roll[2]) * sin(lon_lat_roll[0]) * sin(lon_lat_roll[1]) - cos(lon_lat_roll[0]) * sin(lon_lat_roll[2]),
-                 cos(lon_lat_roll[1]) * sin(lon_lat_roll[0]),
-                 cos(lon_lat_roll[1]) * sin(lon_lat_roll[2]),
-                 cos(lon_lat_roll[1]) * cos(lon_lat_roll[2]),
-                 sin(lon_lat_roll[1])};
+  float ax[9];
+  RotateZMatrix(lon_lat_roll, ax);
 
   ConstDummyMatrix matRt(ax, 3, 3);
   ConstDummyMatrix inputVec(input_vec, dataNum, 3);
@@ -88,17 +94,9 @@ void RotateZ(const float* lon_lat_roll, const float* input_vec, float* output_ve
 
 void RotateZBack(const float* lon_lat_roll, const float* input_vec, float* output_vec,
                  uint64_t dataNum) {
-  using std::cos;
-  using std::sin;
-  float ax[9] = {-cos(lon_lat_roll[2]) * sin(lon_lat_roll[0]) - cos(lon_lat_roll[0]) * sin(lon_lat_roll[1]) * sin(lon_lat_roll[2]),
-                  cos(lon_lat_roll[0]) * cos(lon_lat_roll[2]) - sin(lon_lat_roll[0]) * sin(lon_lat_roll[1]) * sin(lon_lat_roll[2]),
-                  cos(lon_lat_roll[1]) * sin(lon_lat_roll[2]),
-                  -cos(lon_lat_roll[0]) * cos(lon_lat_roll[2]) * sin(lon_lat_roll[1]) + sin(lon_lat_roll[0]) * sin(lon_lat_roll[2]),
-                  -cos(lon_lat_roll[2]) * sin(lon_lat_roll[0]) * sin(lon_lat_roll[1]) - cos(lon_lat_roll[0]) * sin(lon_lat_roll[2]),
-                  cos(lon_lat_roll[1]) * cos(lon_lat_roll[2]),
-                  cos(lon_lat_roll[0]) * cos(lon_lat_roll[1]),
-                  cos(lon_lat_roll[1]) * sin(lon_lat_roll[0]),
-                  sin(lon_lat_roll[1])};
+  float m[9];
+  RotateZMatrix(lon_lat_roll, m);
+  float ax[9] = { m[0], m[3], m[6], m[1], m[4], m[7], m[2], m[5], m[8] };
 
   ConstDummyMatrix matR(ax, 3, 3);
   ConstDummyMatrix inputVec(input_vec, dataNum, 3);
@@ -107,6 +105,98 @@ void RotateZBack(const float* lon_lat_roll, const float* input_vec, float* outpu
 }
 
 
+namespace {
+
+void QuatMultiply(const float* a, const float* b, float* c) {
+  float w = a[0] * b[0] - a[1] * b[1] - a[2] * b[2] - a[3] * b[3];
+  float x = a[0] * b[1] + a[1] * b[0] + a[2] * b[3] - a[3] * b[2];
+  float y = a[0] * b[2] - a[1] * b[3] + a[2] * b[0] + a[3] * b[1];
+  float z = a[0] * b[3] + a[1] * b[2] - a[2] * b[1] + a[3] * b[0];
+  c[0] = w;
+  c[1] = x;
+  c[2] = y;
+  c[3] = z;
+}
+
+}  // namespace
+
+
+// The rotation of RotateZ is Rz(-roll) * P * Ry(lat) * Rz(-lon) on column vectors, where P maps
+// (x, y, z) to (y, z, x), i.e. the crystal frame when all angles are zero.
+void RotateZQuat(const float* lon_lat_roll, float* quat) {
+  RotateZQuat(lon_lat_roll, lon_lat_roll + 2, quat, 1);
+}
+
+
+void RotateZQuat(const float* lon_lat, const float* roll, float* quat, size_t num) {
+  auto* half = new float[num * 3];    // Half angles, [lon..., lat..., roll...]
+  auto* s = new float[num * 3];
+  auto* c = new float[num * 3];
+  for (decltype(num) i = 0; i < num; i++) {
+    half[i] = lon_lat[i * 2 + 0] / 2;
+    half[num + i] = lon_lat[i * 2 + 1] / 2;
+    half[num * 2 + i] = roll[i] / 2;
+  }
+  SinCosFast(half, s, c, num * 3);
+
+  const float q_p[4] = { 0.5f, -0.5f, -0.5f, -0.5f };
+  for (decltype(num) i = 0; i < num; i++) {
+    float q_lon[4] = { c[i], 0, 0, -s[i] };
+    float q_lat[4] = { c[num + i], 0, s[num + i], 0 };
+    float q_roll[4] = { c[num * 2 + i], 0, 0, -s[num * 2 + i] };
+
+    float* q = quat + i * 4;
+    float tmp[4];
+    QuatMultiply(q_lat, q_lon, q);
+    QuatMultiply(q_p, q, tmp);
+    QuatMultiply(q_roll, tmp, q);
+  }
+
+  delete[] half;
+  delete[] s;
+  delete[] c;
+}
+
+
+void RotateByQuat(const float* quat, const float* input_vec, float* output_vec, size_t num, bool back, size_t step) {
+  float sign = back ? -1.0f : 1.0f;
+  size_t i = 0;
+#if defined(__AVX2__)
+  const __m256i kQuatIdx = _mm256_setr_epi32(0, 4, 8, 12, 16, 20, 24, 28);
+  const __m256i kVecIdx = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+                                             _mm256_set1_epi32(static_cast<int>(step)));
+  const __m256 kSign = _mm256_set1_ps(sign);
+  float out[3][8];
+  for (; i + 8 <= num; i += 8) {
+    const float* q = quat + i * 4;
+    const float* v = input_vec + i * step;
+    __m256 w = _mm256_i32gather_ps(q + 0, kQuatIdx, 4);
+    __m256 ux = _mm256_mul_ps(kSign, _mm256_i32gather_ps(q + 1, kQuatIdx, 4));
+    __m256 uy = _mm256_mul_ps(kSign, _mm256_i32gather_ps(q + 2, kQuatIdx, 4));
+    __m256 uz = _mm256_mul_ps(kSign, _mm256_i32gather_ps(q + 3, kQuatIdx, 4));
+    __m256 vx = _mm256_i32gather_ps(v + 0, kVecIdx, 4);
+    __m256 vy = _mm256_i32gather_ps(v + 1, kVecIdx, 4);
+    __m256 vz = _mm256_i32gather_ps(v + 2, kVecIdx, 4);
+    QuatRotate(w, ux, uy, uz, &vx, &vy, &vz);
+
+    _mm256_storeu_ps(out[0], vx);
+    _mm256_storeu_ps(out[1], vy);
+    _mm256_storeu_ps(out[2], vz);
+    for (int k = 0; k < 8; k++) {
+      float* o = output_vec + (i + k) * step;
+      o[0] = out[0][k];
+      o[1] = out[1][k];
+      o[2] = out[2][k];
+    }
+  }
+#endif
+  for (; i < num; i++) {
+    const float* q = quat + i * 4;
+    QuatRotate(q[0], sign * q[1], sign * q[2], sign * q[3], input_vec + i * step, output_vec + i * step);
+  }
+}
+
+
 std::vector<Vec3f> FindInnerPoints(const HalfSpaceSet& hss) {
   float* a = hss.a, *b = hss.b, *c = hss.c, *d = hss.d;
   int n = hss.n;
@@ -491,36 +581,165 @@ HalfSpaceSet::HalfSpaceSet(int n, float* a, float* b, float* c, float* d)
 
 
 RandomNumberGenerator::RandomNumberGenerator(uint32_t seed)
-    : generator_{static_cast<std::mt19937::result_type>(seed)} {}
+    : seed_(seed), state_{}, buffer_{}, buffer_pos_(kBufferSize), gauss_cache_(0), has_gauss_cache_(false) {
+  Reseed(0);
+}
 
 
-RandomNumberGeneratorPtr RandomNumberGenerator::instance_ = nullptr;
-std::mutex RandomNumberGenerator::instance_mutex_{};
+thread_local std::unique_ptr<RandomNumberGenerator> RandomNumberGenerator::instance_ = nullptr;
 
 
-RandomNumberGeneratorPtr RandomNumberGenerator::GetInstance() {
+RandomNumberGenerator* RandomNumberGenerator::GetInstance() {
   if (!instance_) {
-    std::unique_lock<std::mutex> lock(instance_mutex_);
-    if (!instance_) {
 #ifdef RANDOM_SEED
-      auto seed = std::chrono::system_clock::now().time_since_epoch().count();
-      instance_ = std::shared_ptr<RandomNumberGenerator>(new RandomNumberGenerator(static_cast<uint32_t>(seed)));
+    auto seed = std::chrono::system_clock::now().time_since_epoch().count();
+    instance_.reset(new RandomNumberGenerator(static_cast<uint32_t>(seed)));
 #else
-      instance_ = std::shared_ptr<RandomNumberGenerator>(new RandomNumberGenerator(kDefaultRandomSeed));
+    instance_.reset(new RandomNumberGenerator(kDefaultRandomSeed));
 #endif
+  }
+  return instance_.get();
+}
+
+
+// Lane states are filled from a splitmix64 sequence started at the stream seed.
+void RandomNumberGenerator::Reseed(uint32_t stream_id) {
+  uint64_t x = static_cast<uint64_t>(seed_ + stream_id);
+  for (int k = 0; k < kLanes; k++) {
+    for (int j = 0; j < 4; j += 2) {
+      x += 0x9e3779b97f4a7c15ull;
+      uint64_t z = x;
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+      z = z ^ (z >> 31);
+      state_[j][k] = static_cast<uint32_t>(z);
+      state_[j + 1][k] = static_cast<uint32_t>(z >> 32);
     }
   }
-  return instance_;
+  buffer_pos_ = kBufferSize;
+  has_gauss_cache_ = false;
 }
 
 
-float RandomNumberGenerator::GetGaussian() {
-  return gauss_dist_(generator_);
+// xoshiro128+. The upper 24 bits of each output make a float in [0, 1).
+void RandomNumberGenerator::Generate(float* data, size_t rounds) {
+  constexpr float kScale = 1.0f / (1u << 24);
+  size_t r = 0;
+#if defined(__AVX2__)
+  __m256i s0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(state_[0]));
+  __m256i s1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(state_[1]));
+  __m256i s2 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(state_[2]));
+  __m256i s3 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(state_[3]));
+  const __m256 kScale8 = _mm256_set1_ps(kScale);
+  for (; r < rounds; r++) {
+    __m256i result = _mm256_add_epi32(s0, s3);
+    __m256i t = _mm256_slli_epi32(s1, 9);
+    s2 = _mm256_xor_si256(s2, s0);
+    s3 = _mm256_xor_si256(s3, s1);
+    s1 = _mm256_xor_si256(s1, s2);
+    s0 = _mm256_xor_si256(s0, s3);
+    s2 = _mm256_xor_si256(s2, t);
+    s3 = _mm256_or_si256(_mm256_slli_epi32(s3, 11), _mm256_srli_epi32(s3, 21));
+    _mm256_storeu_ps(data + r * kLanes,
+                     _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(result, 8)), kScale8));
+  }
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(state_[0]), s0);
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(state_[1]), s1);
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(state_[2]), s2);
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(state_[3]), s3);
+#endif
+  for (; r < rounds; r++) {
+    for (int k = 0; k < kLanes; k++) {
+      uint32_t result = state_[0][k] + state_[3][k];
+      uint32_t t = state_[1][k] << 9;
+      state_[2][k] ^= state_[0][k];
+      state_[3][k] ^= state_[1][k];
+      state_[1][k] ^= state_[2][k];
+      state_[0][k] ^= state_[3][k];
+      state_[2][k] ^= t;
+      state_[3][k] = (state_[3][k] << 11) | (state_[3][k] >> 21);
+      data[r * kLanes + k] = static_cast<float>(result >> 8) * kScale;
+    }
+  }
+}
+
+
+void RandomNumberGenerator::Refill() {
+  Generate(buffer_, kBufferSize / kLanes);
+  buffer_pos_ = 0;
 }
 
 
 float RandomNumberGenerator::GetUniform() {
-  return uniform_dist_(generator_);
+  if (buffer_pos_ >= kBufferSize) {
+    Refill();
+  }
+  return buffer_[buffer_pos_++];
+}
+
+
+// Take what is left in the buffer, then generate whole rounds into data directly. The buffer is always
+// consumed up to a round boundary before that, so the sequence is the same as from GetUniform().
+void RandomNumberGenerator::GetUniform(float* data, size_t num) {
+  size_t n = std::min(num, kBufferSize - buffer_pos_);
+  std::memcpy(data, buffer_ + buffer_pos_, sizeof(float) * n);
+  buffer_pos_ += n;
+
+  size_t rounds = (num - n) / kLanes;
+  Generate(data + n, rounds);
+  n += rounds * kLanes;
+
+  for (; n < num; n++) {
+    data[n] = GetUniform();
+  }
+}
+
+
+// Box-Muller transform. Every pair of uniforms gives two numbers, the second one is kept for the next call.
+float RandomNumberGenerator::GetGaussian() {
+  if (has_gauss_cache_) {
+    has_gauss_cache_ = false;
+    return gauss_cache_;
+  }
+  float u1 = GetUniform();
+  float u2 = GetUniform();
+  float r = std::sqrt(-2.0f * std::log(1.0f - u1));
+  float s, c;
+  SinCosFast(2 * kPi * u2, &s, &c);
+  gauss_cache_ = r * s;
+  has_gauss_cache_ = true;
+  return r * c;
+}
+
+
+void RandomNumberGenerator::GetGaussian(float* data, size_t num) {
+  size_t i = 0;
+  if (num > 0 && has_gauss_cache_) {
+    data[i++] = GetGaussian();
+  }
+
+  constexpr size_t kBlock = 64;
+  float s[kBlock];
+  float c[kBlock];
+  for (; i + 2 <= num; ) {
+    size_t pairs = std::min((num - i) / 2, kBlock);
+    float* d = data + i;
+    GetUniform(d, pairs * 2);
+    for (size_t k = 0; k < pairs; k++) {
+      s[k] = 2 * kPi * d[k * 2 + 1];
+    }
+    SinCosFast(s, s, c, pairs);
+    for (size_t k = 0; k < pairs; k++) {
+      float r = std::sqrt(-2.0f * std::log(1.0f - d[k * 2]));
+      d[k * 2 + 0] = r * c[k];
+      d[k * 2 + 1] = r * s[k];
+    }
+    i += pairs * 2;
+  }
+
+  if (i < num) {
+    data[i] = GetGaussian();
+  }
 }
 
 
@@ -534,136 +753,352 @@ float RandomNumberGenerator::Get(Distribution dist, float mean, float std) {
 }
 
 
-RandomSamplerPtr RandomSampler::GetInstance() {
-  if (!instance_) {
-    std::unique_lock<std::mutex> lock(instance_mutex_);
-    if (!instance_) {
-      instance_ = std::shared_ptr<RandomSampler>(new RandomSampler());
+void RandomNumberGenerator::Get(Distribution dist, float mean, float std, float* data, size_t num) {
+  switch (dist) {
+    case Distribution::UNIFORM :
+      GetUniform(data, num);
+      for (decltype(num) i = 0; i < num; i++) {
+        data[i] = (data[i] - 0.5f) * 2 * std + mean;
+      }
+      break;
+    case Distribution::GAUSS :
+      GetGaussian(data, num);
+      for (decltype(num) i = 0; i < num; i++) {
+        data[i] = data[i] * std + mean;
+      }
+      break;
+  }
+}
+
+
+// Acklam's rational approximation of the inverse normal CDF, relative error below 1.2e-9.
+float Quantile(Distribution dist, float mean, float std, float u) {
+  if (dist == Distribution::UNIFORM) {
+    return (u - 0.5f) * 2 * std + mean;
+  }
+
+  constexpr double a[6] = { -3.969683028665376e+01, 2.209460984245205e+02, -2.759285104469687e+02,
+                            1.383577518672690e+02, -3.066479806614716e+01, 2.506628277459239e+00 };
+  constexpr double b[5] = { -5.447609879822406e+01, 1.615858368580409e+02, -1.556989798598866e+02,
+                            6.680131188771972e+01, -1.328068155288572e+01 };
+  constexpr double c[6] = { -7.784894002430293e-03, -3.223964580411365e-01, -2.400758277161838e+00,
+                            -2.549732539343734e+00, 4.374664141464968e+00, 2.938163982698783e+00 };
+  constexpr double d[4] = { 7.784695709041462e-03, 3.224671290700398e-01, 2.445134137142996e+00,
+                            3.754408661907416e+00 };
+  constexpr double kLow = 0.02425;
+
+  double p = std::min(std::max(static_cast<double>(u), 1e-12), 1 - 1e-12);
+  double x;
+  if (p < kLow || p > 1 - kLow) {
+    double q = std::sqrt(-2 * std::log(p < kLow ? p : 1 - p));
+    x = (((((c[0] * q + c[1]) * q + c[2]) * q + c[3]) * q + c[4]) * q + c[5]) /
+        ((((d[0] * q + d[1]) * q + d[2]) * q + d[3]) * q + 1);
+    x = p < kLow ? x : -x;
+  } else {
+    double q = p - 0.5;
+    double r = q * q;
+    x = (((((a[0] * r + a[1]) * r + a[2]) * r + a[3]) * r + a[4]) * r + a[5]) * q /
+        (((((b[0] * r + b[1]) * r + b[2]) * r + b[3]) * r + b[4]) * r + 1);
+  }
+  return static_cast<float>(x) * std + mean;
+}
+
+
+namespace {
+
+constexpr int kSobolBits = 32;
+
+/* Generator matrices of Sobol sequence, as direction numbers v_1 ... v_32 of every dimension.
+ * Primitive polynomials and initial numbers of dimension 2 to 8 are from Joe & Kuo (new-joe-kuo-6.21201).
+ */
+struct SobolMatrices {
+  uint32_t v[SobolSampler::kMaxDim][kSobolBits];
+
+  SobolMatrices() : v{} {
+    struct {
+      int s;
+      uint32_t a;
+      uint32_t m[5];
+    } kParams[SobolSampler::kMaxDim - 1] = {
+      { 1, 0, { 1 } },
+      { 2, 1, { 1, 3 } },
+      { 3, 1, { 1, 3, 1 } },
+      { 3, 2, { 1, 1, 1 } },
+      { 4, 1, { 1, 1, 3, 3 } },
+      { 4, 4, { 1, 3, 5, 13 } },
+      { 5, 2, { 1, 1, 5, 5, 17 } },
+    };
+
+    for (int k = 0; k < kSobolBits; k++) {
+      v[0][k] = 1u << (kSobolBits - 1 - k);    // van der Corput sequence
+    }
+    for (int d = 1; d < SobolSampler::kMaxDim; d++) {
+      const auto& param = kParams[d - 1];
+      for (int k = 0; k < kSobolBits; k++) {
+        if (k < param.s) {
+          v[d][k] = param.m[k] << (kSobolBits - 1 - k);
+          continue;
+        }
+        uint32_t x = v[d][k - param.s] ^ (v[d][k - param.s] >> param.s);
+        for (int j = 1; j < param.s; j++) {
+          if ((param.a >> (param.s - 1 - j)) & 1u) {
+            x ^= v[d][k - j];
+          }
+        }
+        v[d][k] = x;
+      }
+    }
+  }
+};
+
+const SobolMatrices kSobolMatrices;
+
+
+uint32_t ReverseBits(uint32_t x) {
+  x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+  x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+  x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+  x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+  return (x >> 16) | (x << 16);
+}
+
+
+uint32_t Hash(uint32_t x) {
+  x ^= x >> 16;
+  x *= 0x7feb352du;
+  x ^= x >> 15;
+  x *= 0x846ca68bu;
+  x ^= x >> 16;
+  return x;
+}
+
+
+// Laine-Karras hash on reversed bits. Every bit is flipped depending only on the higher bits,
+// which is a nested uniform (Owen) scrambling.
+uint32_t OwenScramble(uint32_t x, uint32_t seed) {
+  x = ReverseBits(x);
+  x += seed;
+  x ^= x * 0x6c50b47cu;
+  x ^= x * 0xb82f1e52u;
+  x ^= x * 0xc7afe638u;
+  x ^= x * 0x8d22f6e6u;
+  return ReverseBits(x);
+}
+
+}  // namespace
+
+
+constexpr int SobolSampler::kMaxDim;
+
+SobolSampler::SobolSampler(uint32_t seed) : seed_{} {
+  for (int d = 0; d < kMaxDim; d++) {
+    seed_[d] = Hash(seed ^ Hash(static_cast<uint32_t>(d) + 0x9e3779b9u));
+  }
+}
+
+
+float SobolSampler::Get(uint32_t idx, int dim) const {
+  const uint32_t* v = kSobolMatrices.v[dim];
+  uint32_t x = 0;
+  for (int k = 0; idx; idx >>= 1, k++) {
+    if (idx & 1u) {
+      x ^= v[k];
     }
   }
-  return instance_;
+  x = OwenScramble(x, seed_[dim]);
+  return (static_cast<float>(x >> 8) + 0.5f) * (1.0f / (1u << 24));   // Center of 24-bit cell, never 0 or 1
 }
 
-RandomSamplerPtr RandomSampler::instance_ = nullptr;
-std::mutex RandomSampler::instance_mutex_{};
+
+void SobolSampler::Get(uint32_t idx, int dim, float* data, size_t num) const {
+  for (decltype(num) i = 0; i < num; i++) {
+    data[i] = Get(static_cast<uint32_t>(idx + i), dim);
+  }
+}
+
+
+RandomSampler* RandomSampler::GetInstance() {
+  static RandomSampler instance;
+  return &instance;
+}
 
 
+// Samplers draw random numbers in bulk first, then transform them in batch with the SIMD functions in simdmath.h.
 void RandomSampler::SampleSphericalPointsCart(float* data, size_t num) {
   auto rng = RandomNumberGenerator::GetInstance();
+  auto* buf = new float[num * 3];   // [u..., lambda..., cos(lambda)...]
+  float* u = buf;
+  float* lambda = buf + num;
+  rng->GetUniform(buf, num * 2);
   for (decltype(num) i = 0; i < num; i++) {
-    float u = rng->GetUniform() * 2 - 1;
-    float q = rng->GetUniform() * 2 * Math::kPi;
-
-    float r = std::sqrt(1.0f - u * u);
+    lambda[i] *= 2 * Math::kPi;
+  }
+  SinCosFast(lambda, lambda, buf + num * 2, num);
 
-    data[i * 3 + 0] = r * std::cos(q);
-    data[i * 3 + 1] = r * std::sin(q);
-    data[i * 3 + 2] = u;
+  for (decltype(num) i = 0; i < num; i++) {
+    float z = u[i] * 2 - 1;
+    float r = std::sqrt(1.0f - z * z);
+    data[i * 3 + 0] = r * buf[num * 2 + i];
+    data[i * 3 + 1] = r * lambda[i];
+    data[i * 3 + 2] = z;
   }
+
+  delete[] buf;
 }
 
 
 void RandomSampler::SampleSphericalPointsCart(Distribution dist, float lat, float std,
                                               float* data, size_t num) {
-  auto rng = RandomNumberGenerator::GetInstance();
+  auto* angles = new float[num * 2];    // [phi..., lambda...]
+  auto* s = new float[num * 2];
+  auto* c = new float[num * 2];
+  SampleSphericalPointsSph(dist, lat, std, data, num);
   for (decltype(num) i = 0; i < num; i++) {
-    float phi = rng->Get(dist, lat * kDegreeToRad, std * kDegreeToRad);
-    if (phi > kPi / 2) {
-      phi = kPi - phi;
-    }
-    if (phi < -kPi / 2) {
-      phi = -kPi - phi;
-    }
-    float lambda = rng->GetUniform() * 2 * Math::kPi;
+    angles[i] = data[i * 2 + 1];
+    angles[num + i] = data[i * 2 + 0];
+  }
+  SinCosFast(angles, s, c, num * 2);
 
-    float r = std::cos(phi);
-    data[i * 3 + 0] = r * std::cos(lambda);
-    data[i * 3 + 1] = r * std::sin(lambda);
-    data[i * 3 + 2] = std::sin(phi);
+  for (decltype(num) i = 0; i < num; i++) {
+    float r = c[i];
+    data[i * 3 + 0] = r * c[num + i];
+    data[i * 3 + 1] = r * s[num + i];
+    data[i * 3 + 2] = s[i];
   }
-}
 
+  delete[] angles;
+  delete[] s;
+  delete[] c;
+}
 
-void RandomSampler::SampleSphericalPointsCart(const float* dir, float std, float* data, size_t num) {
-  auto rng = RandomNumberGenerator::GetInstance();
 
+void RandomSampler::SampleSphericalPointsCart(const float* dir, float std, float* data, size_t num,
+                                              const float* u) {
   float lon = std::atan2(dir[1], dir[0]);
   float lat = std::asin(dir[2] / Math::Norm3(dir));
   float rot[3] = { lon, lat, 0 };
 
   auto* tmp_dir = new float[num * 3];
-
-  double dz = 2 * std::sin(std / 2.0 * kDegreeToRad) * std::sin(std / 2.0 * kDegreeToRad);
+  auto* buf = new float[num * 3];   // [u..., lambda..., cos(lambda)...]
+  float* lambda = buf + num;
+  if (u) {
+    std::memcpy(buf, u, sizeof(float) * num * 2);
+  } else {
+    RandomNumberGenerator::GetInstance()->GetUniform(buf, num * 2);
+  }
   for (decltype(num) i = 0; i < num; i++) {
-    double udz = rng->GetUniform() * dz;
-    double q = rng->GetUniform() * 2 * Math::kPi;
+    lambda[i] *= 2 * Math::kPi;
+  }
+  SinCosFast(lambda, lambda, buf + num * 2, num);
 
-    double r = std::sqrt((2.0f - udz) * udz);
-    tmp_dir[i * 3 + 0] = static_cast<float>(std::cos(q) * r);
-    tmp_dir[i * 3 + 1] = static_cast<float>(std::sin(q) * r);
-    tmp_dir[i * 3 + 2] = static_cast<float>(1.0f - udz);
+  auto dz = static_cast<float>(2 * std::sin(std / 2.0 * kDegreeToRad) * std::sin(std / 2.0 * kDegreeToRad));
+  for (decltype(num) i = 0; i < num; i++) {
+    float udz = buf[i] * dz;
+    float r = std::sqrt((2.0f - udz) * udz);
+    tmp_dir[i * 3 + 0] = buf[num * 2 + i] * r;
+    tmp_dir[i * 3 + 1] = lambda[i] * r;
+    tmp_dir[i * 3 + 2] = 1.0f - udz;
   }
   Math::RotateZBack(rot, tmp_dir, data, num);
 
   delete[] tmp_dir;
+  delete[] buf;
 }
 
 
-void RandomSampler::SampleSphericalPointsSph(float* data, size_t num) {
-  auto rng = RandomNumberGenerator::GetInstance();
+void RandomSampler::SampleSphericalPointsSph(float* data, size_t num, const float* u) {
+  auto* buf = new float[num * 2];   // [u..., lambda...]
+  if (u) {
+    std::memcpy(buf, u, sizeof(float) * num * 2);
+  } else {
+    RandomNumberGenerator::GetInstance()->GetUniform(buf, num * 2);
+  }
   for (decltype(num) i = 0; i < num; i++) {
-    float u = rng->GetUniform() * 2 - 1;
-    float lambda = rng->GetUniform() * 2 * Math::kPi;
+    buf[i] = buf[i] * 2 - 1;
+  }
+  AsinFast(buf, buf, num);
 
-    data[i * 3 + 0] = lambda;
-    data[i * 3 + 1] = std::asin(u);
+  for (decltype(num) i = 0; i < num; i++) {
+    data[i * 2 + 0] = buf[num + i] * 2 * Math::kPi;
+    data[i * 2 + 1] = buf[i];
   }
+
+  delete[] buf;
 }
 
 
 void RandomSampler::SampleSphericalPointsSph(Distribution dist, float lat, float std,
-                                             float* data, size_t num) {
-  auto rng = RandomNumberGenerator::GetInstance();
+                                             float* data, size_t num, const float* u) {
+  auto* buf = new float[num * 2];   // [phi..., lambda...]
+  if (u) {
+    for (decltype(num) i = 0; i < num; i++) {
+      buf[i] = Quantile(dist, lat * kDegreeToRad, std * kDegreeToRad, u[i]);
+    }
+    std::memcpy(buf + num, u + num, sizeof(float) * num);
+  } else {
+    auto rng = RandomNumberGenerator::GetInstance();
+    rng->Get(dist, lat * kDegreeToRad, std * kDegreeToRad, buf, num);
+    rng->GetUniform(buf + num, num);
+  }
+
   for (decltype(num) i = 0; i < num; i++) {
-    float phi = rng->Get(dist, lat * kDegreeToRad, std * kDegreeToRad);
+    float phi = buf[i];
     if (phi > kPi / 2) {
       phi = kPi - phi;
     }
     if (phi < -kPi / 2) {
       phi = -kPi - phi;
     }
-    float lambda = rng->GetUniform() * 2 * Math::kPi;
 
-    data[i * 2 + 0] = lambda;
+    data[i * 2 + 0] = buf[num + i] * 2 * Math::kPi;
     data[i * 2 + 1] = phi;
   }
+
+  delete[] buf;
 }
 
 
 void RandomSampler::SampleTriangularPoints(const float* vertexes, float* data, size_t num) {
-  auto rng = RandomNumberGenerator::GetInstance();
-  for (decltype(num) i = 0; i < num; i++) {
-    float a = rng->GetUniform();
-    float b = rng->GetUniform();
+  auto* idx = new int[num]();
+  SampleTriangularPoints(vertexes, idx, data, num);
+  delete[] idx;
+}
 
-    if (a + b > 1.0f) {
-      a = 1.0f - a;
-      b = 1.0f - b;
-    }
 
+void RandomSampler::SampleTriangularPoints(const float* vertexes, const int* idx, float* data, size_t num,
+                                           const float* u) {
+  auto* ab = new float[num * 2];    // [a..., b...]
+  if (u) {
+    std::memcpy(ab, u, sizeof(float) * num * 2);
+  } else {
+    RandomNumberGenerator::GetInstance()->GetUniform(ab, num * 2);
+  }
+
+  for (decltype(num) i = 0; i < num; i++) {
+    float a = ab[i];
+    float b = ab[num + i];
+    bool flip = a + b > 1.0f;   // Reflect into the lower-left half of the parallelogram
+    a = flip ? 1.0f - a : a;
+    b = flip ? 1.0f - b : b;
+
+    const float* v = vertexes + idx[i] * 9;
     for (int j = 0; j < 3; j++) {
-      data[i * 3 + j] = (vertexes[j + 3] - vertexes[j]) * a +
-                        (vertexes[j + 6] - vertexes[j]) * b + vertexes[j];
+      data[i * 3 + j] = (v[j + 3] - v[j]) * a + (v[j + 6] - v[j]) * b + v[j];
     }
   }
+
+  delete[] ab;
 }
 
 
 int RandomSampler::SampleInt(const float* p, int max) {
-  auto rng = RandomNumberGenerator::GetInstance();
+  return SampleInt(p, max, RandomNumberGenerator::GetInstance()->GetUniform());
+}
+
 
+int RandomSampler::SampleInt(const float* p, int max, float u) {
   float current_cum_p = 0;
-  float current_p = rng->GetUniform();
+  float current_p = u;
 
   for (decltype(max) i = 0; i < max; i++) {
     current_cum_p += p[i];
@@ -3,9 +3,7 @@
 
 #include <vector>
 #include <cmath>
-#include <random>
 #include <memory>
-#include <mutex>
 
 namespace IceHalo {
 
@@ -129,27 +127,77 @@ enum class Distribution {
 };
 
 
+/* Pseudo random number generator, xoshiro128+ running on 8 independent lanes.
+ * The lanes are stepped together (with AVX2 if available) and fill a buffer in bulk. Numbers are taken
+ * round by round, lane by lane, so the scalar and bulk getters give the same sequence for the same stream.
+ */
 class RandomNumberGenerator {
 public:
   float GetGaussian();
   float GetUniform();
   float Get(Distribution dist, float mean, float std);
 
-  static std::shared_ptr<RandomNumberGenerator> GetInstance();
+  /* Bulk versions. Same as calling the scalar versions num times. */
+  void GetGaussian(float* data, size_t num);
+  void GetUniform(float* data, size_t num);   // In [0, 1)
+  void Get(Distribution dist, float mean, float std, float* data, size_t num);
 
-private:
+  /*! @brief Restart the generator on an independent stream.
+   *
+   * The new seed is the initial seed plus stream_id, so a stream gives the same numbers
+   * no matter which thread runs it.
+   */
+  void Reseed(uint32_t stream_id);
+
+  /* Every thread has its own generator. */
+  static RandomNumberGenerator* GetInstance();
+
+  /* A generator apart from those of threads, for numbers that must not depend on what else is drawn. */
   explicit RandomNumberGenerator(uint32_t seed);
 
-  std::mt19937 generator_;
-  std::normal_distribution<float> gauss_dist_;
-  std::uniform_real_distribution<float> uniform_dist_;
+  static constexpr int kLanes = 8;
+
+private:
+
+  void Generate(float* data, size_t rounds);    // rounds * kLanes numbers
+  void Refill();
+
+  static constexpr size_t kBufferSize = 32 * kLanes;
+
+  uint32_t seed_;
+  uint32_t state_[4][kLanes];
+  float buffer_[kBufferSize];
+  size_t buffer_pos_;
+  float gauss_cache_;
+  bool has_gauss_cache_;
 
   static constexpr uint32_t kDefaultRandomSeed = 1;
-  static std::shared_ptr<RandomNumberGenerator> instance_;
-  static std::mutex instance_mutex_;
+  static thread_local std::unique_ptr<RandomNumberGenerator> instance_;
 };
 
-using RandomNumberGeneratorPtr = std::shared_ptr<RandomNumberGenerator>;
+
+/* Map a uniform number u in (0, 1) to a distribution, by its quantile function.
+ * Used where uniform numbers are not random, as RandomNumberGenerator::Get is used for random ones. */
+float Quantile(Distribution dist, float mean, float std, float u);
+
+
+/* Owen-scrambled Sobol sequence, a quasi-random (low-discrepancy) sequence of up to kMaxDim dimensions.
+ * Scrambling is the hash-based nested uniform scrambling of Burley (2020), with its own seed for every
+ * dimension. A number depends only on seed, index and dimension, so any range of the sequence can be
+ * generated on any thread, and a run in batches gives the same numbers as a run in one go.
+ */
+class SobolSampler {
+public:
+  explicit SobolSampler(uint32_t seed);
+
+  float Get(uint32_t idx, int dim) const;                           // In (0, 1)
+  void Get(uint32_t idx, int dim, float* data, size_t num) const;   // Numbers of idx, idx + 1, ... idx + num - 1
+
+  static constexpr int kMaxDim = 8;
+
+private:
+  uint32_t seed_[kMaxDim];
+};
 
 
 class RandomSampler {
@@ -177,15 +225,19 @@ public:
    * @param std half range (like radii), in degree.
    * @param data output data, xyz.
    * @param num number of points.
+   * @param u 2 * num uniform numbers to use, for 2 dimensions one after another, e.g. from SobolSampler.
+   *          Random numbers are drawn if it is nullptr. So are they in other samplers below.
    */
-  void SampleSphericalPointsCart(const float* dir, float std, float* data, size_t num = 1);
+  void SampleSphericalPointsCart(const float* dir, float std, float* data, size_t num = 1,
+                                 const float* u = nullptr);
 
   /*! @brief Generate points distributed uniformly on sphere, in spherical form, (lon, lat).
    *
    * @param data output data, (lon, lat), in rad
    * @param num
+   * @param u 2 * num uniform numbers to use, or nullptr.
    */
-  void SampleSphericalPointsSph(float* data, size_t num = 1);
+  void SampleSphericalPointsSph(float* data, size_t num = 1, const float* u = nullptr);
 
   /*! @brief Generate points distributed on sphere surface up to latitude, in spherical form, (lon, lat).
    *
@@ -194,8 +246,10 @@ public:
    * @param std standard deviation (for Gaussian) or half range (for uniform), in degree.
    * @param data output data, (lon, lat), in rad
    * @param num number of points.
+   * @param u 2 * num uniform numbers to use, or nullptr.
    */
-  void SampleSphericalPointsSph(Distribution dist, float lat, float std, float* data, size_t num = 1);
+  void SampleSphericalPointsSph(Distribution dist, float lat, float std, float* data, size_t num = 1,
+                                const float* u = nullptr);
 
   /*! @brief Generate points evenly distributed on a triangle, in Cartesian form, xyz.
    *
@@ -205,6 +259,17 @@ public:
    */
   void SampleTriangularPoints(const float* vertexes, float* data, size_t num = 1);
 
+  /*! @brief Generate points evenly distributed on triangles, one point on each given triangle.
+   *
+   * @param vertexes vertexes of all triangles, 9 floats each.
+   * @param idx indices of the triangle for every point.
+   * @param data output data, xyz.
+   * @param num number of points.
+   * @param u 2 * num uniform numbers to use, or nullptr.
+   */
+  void SampleTriangularPoints(const float* vertexes, const int* idx, float* data, size_t num,
+                              const float* u = nullptr);
+
   /*! @brief Random choose an integer index from [0, max), proportional to probabilities in p.
    *
    * @param p probabilities, must have max values, sum of all p should be 1.0f.
@@ -212,6 +277,7 @@ public:
    * @return chosen index.
    */
   int SampleInt(const float* p, int max);
+  int SampleInt(const float* p, int max, float u);   // With a given uniform number
 
   /*! @brief Random choose an integer from [0, max)
    *
@@ -220,17 +286,13 @@ public:
    */
   int SampleInt(int max);
 
-  static std::shared_ptr<RandomSampler> GetInstance();
+  /* The sampler has no state of its own, so all threads share one instance. */
+  static RandomSampler* GetInstance();
 
 private:
   RandomSampler() = default;
-
-  static std::shared_ptr<RandomSampler> instance_;
-  static std::mutex instance_mutex_;
 };
 
-using RandomSamplerPtr = std::shared_ptr<RandomSampler>;
-
 
 bool FloatEqual(float a, float b, float threshold = kFloatEps);
 bool FloatEqualZero(float a, float threshold = kFloatEps);
@@ -243,9 +305,41 @@ void Normalize3(float* vec);
 void Normalized3(const float* vec, float* vec_out);
 void Vec3FromTo(const float* vec1, const float* vec2, float* vec);
 
+/*! @brief Build the matrix used by RotateZ. A row vector v is rotated as v * mat.
+ *
+ * @param lon_lat_roll rotation angles, in rad.
+ * @param mat output 3x3 matrix, row major.
+ */
+void RotateZMatrix(const float* lon_lat_roll, float* mat);
 void RotateZ(const float* lon_lat_roll, const float* input_vec, float* output_vec, uint64_t dataNum = 1);
 void RotateZBack(const float* lon_lat_roll, const float* input_vec, float* output_vec, uint64_t dataNum = 1);
 
+/*! @brief Build the unit quaternion of the rotation done by RotateZ.
+ *
+ * Crystal orientations are kept as quaternions, so that rays are rotated without trigonometric functions.
+ *
+ * @param lon_lat_roll rotation angles, in rad.
+ * @param quat output quaternion, (w, x, y, z).
+ */
+void RotateZQuat(const float* lon_lat_roll, float* quat);
+
+/*! @brief Batched version of RotateZQuat.
+ *
+ * @param lon_lat num pairs of (lon, lat), in rad, as given by RandomSampler::SampleSphericalPointsSph.
+ * @param roll num roll angles, in rad.
+ * @param quat output quaternions, 4 floats each.
+ */
+void RotateZQuat(const float* lon_lat, const float* roll, float* quat, size_t num);
+
+/*! @brief Rotate vectors, each by its own unit quaternion, as RotateZ does with the angles of the quaternion,
+ * or as RotateZBack does if back is set.
+ *
+ * @param quat num quaternions, 4 floats each.
+ * @param step floats from one vector to the next, for both input and output. Output may be the same as input.
+ */
+void RotateByQuat(const float* quat, const float* input_vec, float* output_vec, size_t num,
+                  bool back = false, size_t step = 3);
+
 std::vector<Vec3f> FindInnerPoints(const HalfSpaceSet& hss);
 void SortAndRemoveDuplicate(std::vector<Vec3f>* pts);
 std::vector<int> FindCoplanarPoints(const std::vector<Vec3f>& pts, const Vec3f& n0, float d0);
@@ -4,6 +4,7 @@
 #include "threadingpool.h"
 
 #include <limits>
+#include <cstring>
 #include <cmath>
 #include <algorithm>
 
@@ -35,9 +36,36 @@ void RaySegment::ResetWith(const float* pt, const float* dir, float w, int face_
 }
 
 
-Ray::Ray(RaySegment* seg, const CrystalContextPtr& crystal_ctx, const float main_axis_rot[3])
-    : first_ray_segment_(seg), prev_ray_segment_(nullptr),
-      crystal_ctx_(crystal_ctx), main_axis_rot_(main_axis_rot) {}
+Ray::Ray(RaySegment* seg, const CrystalContextPtr& crystal_ctx, const float main_axis_quat[4])
+    : first_ray_segment_(seg), prev_ray_segment_(nullptr), crystal_ctx_(crystal_ctx),
+      main_axis_lat_roll_{ 0, 0 }, wavelength_(0) {
+  std::memcpy(main_axis_quat_, main_axis_quat, sizeof(float) * 4);
+}
+
+
+namespace {
+
+// Reflect and refract one ray. Output 2 directions and 2 weights, reflection first.
+inline void HitOneSurface(const float* dir, const float* norm, float n, float w, float* dir_out, float* w_out) {
+  float cos_theta = Math::Dot3(dir, norm);
+  float rr = cos_theta > 0 ? n : 1.0f / n;
+  float d = (1.0f - rr * rr) / (cos_theta * cos_theta) + rr * rr;
+
+  bool is_total_reflected = d <= 0.0f;
+
+  w_out[0] = Optics::GetReflectRatio(cos_theta, rr) * w;
+  w_out[1] = is_total_reflected ? -1 : w - w_out[0];
+
+  float* dir_reflection = dir_out;
+  float* dir_refraction = dir_out + 3;
+  for (int j = 0; j < 3; j++) {
+    dir_reflection[j] = dir[j] - 2 * cos_theta * norm[j];  // Reflection
+    dir_refraction[j] = is_total_reflected ? dir_reflection[j] :
+                        rr * dir[j] - (rr - std::sqrt(d)) * cos_theta * norm[j];  // Refraction
+  }
+}
+
+}  // namespace
 
 
 void Optics::HitSurface(const IceHalo::CrystalPtr& crystal, float n, size_t num,
@@ -46,25 +74,18 @@ void Optics::HitSurface(const IceHalo::CrystalPtr& crystal, float n, size_t num,
   auto face_norm = crystal->GetFaceNorm();
 
   for (decltype(num) i = 0; i < num; i++) {
-    const float* tmp_dir = dir_in + i * 3;
-    const float* tmp_norm = face_norm + face_id_in[i] * 3;
-
-    float cos_theta = Math::Dot3(tmp_dir, tmp_norm);
-    float rr = cos_theta > 0 ? n : 1.0f / n;
-    float d = (1.0f - rr * rr) / (cos_theta * cos_theta) + rr * rr;
+    HitOneSurface(dir_in + i * 3, face_norm + face_id_in[i] * 3, n, w_in[i], dir_out + i * 6, w_out + i * 2);
+  }
+}
 
-    bool is_total_reflected = d <= 0.0f;
 
-    w_out[2 * i + 0] = GetReflectRatio(cos_theta, rr) * w_in[i];
-    w_out[2 * i + 1] = is_total_reflected ? -1 : w_in[i] - w_out[2 * i + 0];
+void Optics::HitSurface(const IceHalo::CrystalPtr& crystal, const float* n, size_t num,
+                        const float* dir_in, const int* face_id_in, const float* w_in,
+                        float* dir_out, float* w_out) {
+  auto face_norm = crystal->GetFaceNorm();
 
-    float* tmp_dir_reflection = dir_out + (i * 2 + 0) * 3;
-    float* tmp_dir_refraction = dir_out + (i * 2 + 1) * 3;
-    for (int j = 0; j < 3; j++) {
-      tmp_dir_reflection[j] = tmp_dir[j] - 2 * cos_theta * tmp_norm[j];  // Reflection
-      tmp_dir_refraction[j] = is_total_reflected ? tmp_dir_reflection[j] :
-                              rr * tmp_dir[j] - (rr - std::sqrt(d)) * cos_theta * tmp_norm[j];  // Refraction
-    }
+  for (decltype(num) i = 0; i < num; i++) {
+    HitOneSurface(dir_in + i * 3, face_norm + face_id_in[i] * 3, n[i], w_in[i], dir_out + i * 6, w_out + i * 2);
   }
 }
 
@@ -186,6 +207,40 @@ void Optics::IntersectLineWithTriangles(const float* pt, const float* dir, int f
 }
 
 
+bool Optics::IntersectLineWithTriangle(const float* pt, const float* dir,
+                                       const float* face_base, const float* face_point, float* p) {
+  float h[3];
+  Math::Cross3(dir, face_base + 3, h);
+  float a = Math::Dot3(face_base, h);
+  if (Math::FloatEqualZero(a)) {
+    return false;
+  }
+
+  float s[3];
+  Math::Vec3FromTo(face_point, pt, s);
+  float alpha = Math::Dot3(s, h) / a;
+  if (alpha < 0 || alpha > 1) {
+    return false;
+  }
+
+  float q[3];
+  Math::Cross3(s, face_base, q);
+  float beta = Math::Dot3(dir, q) / a;
+  if (beta < 0 || alpha + beta > 1) {
+    return false;
+  }
+
+  float t = Math::Dot3(face_base + 3, q) / a;
+  if (t <= Math::kFloatEps) {
+    return false;
+  }
+  for (int i = 0; i < 3; i++) {
+    p[i] = pt[i] + t * dir[i];
+  }
+  return true;
+}
+
+
 void Optics::IntersectLineWithTrianglesSimd(const float* pt, const float* dir, int face_id, int face_num,
                                             const float* face_bases, const float* face_points, const float* face_norm,
                                             float* p, int* idx) {
@@ -425,5 +480,22 @@ void RaySegmentPool::Clear() {
   current_chunk_id_ = 0;
 }
 
+size_t RaySegmentPool::GetSegmentNum() const {
+  return current_chunk_id_ * kChunkSize + std::min(next_unused_id_.load(), kChunkSize);
+}
+
+
+constexpr int ColorMatchingFunction::kMinWavelength;
+constexpr int ColorMatchingFunction::kMaxWavelength;
+constexpr float ColorMatchingFunction::kCmfX[];
+constexpr float ColorMatchingFunction::kCmfY[];
+constexpr float ColorMatchingFunction::kCmfZ[];
+
+void ColorMatchingFunction::Get(int wavelength, float* xyz) {
+  bool valid = wavelength >= kMinWavelength && wavelength <= kMaxWavelength;
+  xyz[0] = valid ? kCmfX[wavelength - kMinWavelength] : 0.0f;
+  xyz[1] = valid ? kCmfY[wavelength - kMinWavelength] : 0.0f;
+  xyz[2] = valid ? kCmfZ[wavelength - kMinWavelength] : 0.0f;
+}
 
 }   // namespace IceHalo
@@ -2,181 +2,382 @@
 #include "render.h"
 #include "mymath.h"
 #include "context.h"
+#include "threadingpool.h"
+#include "simdmath.h"
 
 #include <limits>
 #include <cstring>
 #include <cmath>
+#include <chrono>
+#include <algorithm>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
 
 
 namespace IceHalo {
 
-void EqualAreaFishEye(const float* cam_rot,      // Camera rotation. [lon, lat, roll]
-                      float hov,                 // Half field of view.
-                      uint64_t data_number,      // Data number
-                      const float* dir,          // Ray directions, [x, y, z]
-                      int img_wid, int img_hei,  // Image size
-                      int* img_xy,               // Image coordinates
-                      VisibleSemiSphere visible_semi_sphere) {
-  float img_r = std::max(img_wid, img_hei) / 2.0f;
-  auto* dir_copy = new float[data_number * 3];
+namespace {
+
+/* Build the rotation matrix for a camera. Camera angles are in degree. A ray d is rotated as d * mat. */
+void CameraRotationMatrix(const float* cam_rot, float* mat) {
   float cam_rot_copy[3];
   std::memcpy(cam_rot_copy, cam_rot, sizeof(float) * 3);
   cam_rot_copy[0] *= -1;
   cam_rot_copy[1] *= -1;
   for (float &i : cam_rot_copy) {
-    i *= Math::kPi / 180.0f;
-  }
-
-  Math::RotateZ(cam_rot_copy, dir, dir_copy, data_number);
-  for (decltype(data_number) i = 0; i < data_number; i++) {
-    if (std::abs(Math::Norm3(dir_copy + i * 3) - 1.0) > 1e-4) {
-      img_xy[i * 2 + 0] = std::numeric_limits<int>::min();
-      img_xy[i * 2 + 1] = std::numeric_limits<int>::min();
-    } else if (visible_semi_sphere == VisibleSemiSphere::kCamera && dir_copy[i * 3 + 2] < 0) {
-      img_xy[i * 2 + 0] = std::numeric_limits<int>::min();
-      img_xy[i * 2 + 1] = std::numeric_limits<int>::min();
-    } else if (visible_semi_sphere == VisibleSemiSphere::kUpper && dir[i * 3 + 2] > 0) {
-      img_xy[i * 2 + 0] = std::numeric_limits<int>::min();
-      img_xy[i * 2 + 1] = std::numeric_limits<int>::min();
-    } else if (visible_semi_sphere == VisibleSemiSphere::kLower && dir[i * 3 + 2] < 0) {
-      img_xy[i * 2 + 0] = std::numeric_limits<int>::min();
-      img_xy[i * 2 + 1] = std::numeric_limits<int>::min();
-    } else {
-      float lon = std::atan2(dir_copy[i * 3 + 1], dir_copy[i * 3 + 0]);
-      float lat = std::asin(dir_copy[i * 3 + 2] / Math::Norm3(dir_copy + i * 3));
-      float proj_r = img_r / 2.0f / std::sin(hov / 2.0f / 180.0f * Math::kPi);
-      float r = 2.0f * proj_r * std::sin((Math::kPi / 2.0f - lat) / 2.0f);
+    i *= Math::kDegreeToRad;
+  }
+  Math::RotateZMatrix(cam_rot_copy, mat);
+}
+
+
+void RotateRay(const float* mat, const float* d, float* v) {
+  for (int j = 0; j < 3; j++) {
+    v[j] = d[0] * mat[j] + d[1] * mat[3 + j] + d[2] * mat[6 + j];
+  }
+}
+
+
+bool IsHidden(const float* d, const float* v, VisibleSemiSphere visible_semi_sphere) {
+  return std::abs(Math::Norm3(d) - 1.0f) > 1e-4f ||
+         (visible_semi_sphere == VisibleSemiSphere::kCamera && v[2] < 0) ||
+         (visible_semi_sphere == VisibleSemiSphere::kUpper && d[2] > 0) ||
+         (visible_semi_sphere == VisibleSemiSphere::kLower && d[2] < 0);
+}
+
+
+/* Round image coordinates, shift by offset and convert to pixel index. Return -1 if out of image.
+ * Comparisons are done in float so that inf and NaN are rejected before converting to int. */
+int PixelIndex(float x, float y, int offset_x, int offset_y, int img_wid, int img_hei) {
+  x = std::floor(x + 0.5f) + offset_x;
+  y = std::floor(y + 0.5f) + offset_y;
+  if (x >= 0 && x < img_wid && y >= 0 && y < img_hei) {
+    return static_cast<int>(y) * img_wid + static_cast<int>(x);
+  } else {
+    return -1;
+  }
+}
+
+
+#if defined(__AVX2__)
+/* Simd version of the helpers above, working on 8 rays. */
+struct Rays8 {
+  __m256 d[3];      // Original directions
+  __m256 v[3];      // Rotated directions
+  __m256 hidden;    // Mask of rays out of visible semi-sphere or not normalized
+};
 
-      img_xy[i * 2 + 0] = static_cast<int>(std::round(r * std::cos(lon) + img_wid / 2.0f));
-      img_xy[i * 2 + 1] = static_cast<int>(std::round(r * std::sin(lon) + img_hei / 2.0f));
+
+void LoadRays8(const float* dir, size_t dir_step, const float* mat, Rays8* rays) {
+  alignas(32) float tmp[3][8];
+  for (int k = 0; k < 8; k++) {
+    for (int j = 0; j < 3; j++) {
+      tmp[j][k] = dir[k * dir_step + j];
     }
   }
+  for (int j = 0; j < 3; j++) {
+    rays->d[j] = _mm256_load_ps(tmp[j]);
+  }
+  for (int j = 0; j < 3; j++) {
+    rays->v[j] = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(rays->d[0], _mm256_set1_ps(mat[j])),
+                                             _mm256_mul_ps(rays->d[1], _mm256_set1_ps(mat[3 + j]))),
+                               _mm256_mul_ps(rays->d[2], _mm256_set1_ps(mat[6 + j])));
+  }
+}
+
+
+void CheckHidden8(VisibleSemiSphere visible_semi_sphere, Rays8* rays) {
+  const __m256 kZero = _mm256_setzero_ps();
+  __m256 n = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(rays->d[0], rays->d[0]),
+                                                        _mm256_mul_ps(rays->d[1], rays->d[1])),
+                                          _mm256_mul_ps(rays->d[2], rays->d[2])));
+  __m256 dn = _mm256_andnot_ps(_mm256_set1_ps(-0.0f), _mm256_sub_ps(n, _mm256_set1_ps(1.0f)));
+  rays->hidden = _mm256_cmp_ps(dn, _mm256_set1_ps(1e-4f), _CMP_GT_OQ);
+  if (visible_semi_sphere == VisibleSemiSphere::kCamera) {
+    rays->hidden = _mm256_or_ps(rays->hidden, _mm256_cmp_ps(rays->v[2], kZero, _CMP_LT_OQ));
+  } else if (visible_semi_sphere == VisibleSemiSphere::kUpper) {
+    rays->hidden = _mm256_or_ps(rays->hidden, _mm256_cmp_ps(rays->d[2], kZero, _CMP_GT_OQ));
+  } else if (visible_semi_sphere == VisibleSemiSphere::kLower) {
+    rays->hidden = _mm256_or_ps(rays->hidden, _mm256_cmp_ps(rays->d[2], kZero, _CMP_LT_OQ));
+  }
+}
+
+
+void StorePixelIndex8(__m256 x, __m256 y, __m256 hidden, int offset_x, int offset_y,
+                      int img_wid, int img_hei, int* pixel_idx) {
+  const __m256 kZero = _mm256_setzero_ps();
+  const __m256 kHalf = _mm256_set1_ps(0.5f);
+  x = _mm256_add_ps(_mm256_floor_ps(_mm256_add_ps(x, kHalf)), _mm256_set1_ps(static_cast<float>(offset_x)));
+  y = _mm256_add_ps(_mm256_floor_ps(_mm256_add_ps(y, kHalf)), _mm256_set1_ps(static_cast<float>(offset_y)));
+
+  __m256 valid = _mm256_andnot_ps(hidden, _mm256_cmp_ps(x, kZero, _CMP_GE_OQ));
+  valid = _mm256_and_ps(valid, _mm256_cmp_ps(x, _mm256_set1_ps(static_cast<float>(img_wid)), _CMP_LT_OQ));
+  valid = _mm256_and_ps(valid, _mm256_cmp_ps(y, kZero, _CMP_GE_OQ));
+  valid = _mm256_and_ps(valid, _mm256_cmp_ps(y, _mm256_set1_ps(static_cast<float>(img_hei)), _CMP_LT_OQ));
+  x = _mm256_and_ps(x, valid);
+  y = _mm256_and_ps(y, valid);
+
+  __m256i idx = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_cvttps_epi32(y), _mm256_set1_epi32(img_wid)),
+                                 _mm256_cvttps_epi32(x));
+  idx = _mm256_blendv_epi8(_mm256_set1_epi32(-1), idx, _mm256_castps_si256(valid));
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(pixel_idx), idx);
+}
+
+
+/* Cosine and sine of longitude, i.e. (x, y) / sqrt(x^2 + y^2). (1, 0) for rays along z axis.
+ * One reciprocal square root replaces a square root and two divisions. */
+void LonCosSin8(__m256 x, __m256 y, __m256* rho, __m256* c, __m256* s) {
+  __m256 rho2 = _mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y));
+  __m256 nonzero = _mm256_cmp_ps(rho2, _mm256_setzero_ps(), _CMP_GT_OQ);
+  __m256 inv_rho = _mm256_and_ps(Math::RsqrtFast(rho2), nonzero);
+  *rho = _mm256_mul_ps(rho2, inv_rho);
+  *c = _mm256_blendv_ps(_mm256_set1_ps(1.0f), _mm256_mul_ps(x, inv_rho), nonzero);
+  *s = _mm256_mul_ps(y, inv_rho);
+}
+#endif
+
+
+/* Scalar version of LonCosSin8 */
+void LonCosSin(float x, float y, float* rho, float* c, float* s) {
+  float rho2 = x * x + y * y;
+  float inv_rho = rho2 > 0 ? Math::RsqrtFast(rho2) : 0.0f;
+  *rho = rho2 * inv_rho;
+  *c = rho2 > 0 ? x * inv_rho : 1.0f;
+  *s = y * inv_rho;
+}
+
+}  // namespace
+
+
+/* Equal area fisheye.
+ * r = 2 * proj_r * sin((pi/2 - lat) / 2) = proj_r * sqrt(2 * (1 - z)) for a unit vector. For z > 0 the
+ * equivalent form proj_r * rho * sqrt(2 / (1 + z)) is used to avoid cancellation near the center.
+ * No trigonometric function is needed per ray.
+ */
+void EqualAreaFishEye(const float* cam_rot,        // Camera rotation. [lon, lat, roll]
+                      float hov,                   // Half field of view.
+                      uint64_t data_number,        // Data number
+                      const float* dir,            // Ray directions, [x, y, z]
+                      size_t dir_step,             // Floats from one ray direction to the next
+                      int img_wid, int img_hei,    // Image size
+                      int offset_x, int offset_y,  // Image offset
+                      int* pixel_idx,              // Pixel indices
+                      VisibleSemiSphere visible_semi_sphere) {
+  float img_r = std::max(img_wid, img_hei) / 2.0f;
+  float proj_r = img_r / 2.0f / std::sin(hov / 2.0f / 180.0f * Math::kPi);
+  float mat[9];
+  CameraRotationMatrix(cam_rot, mat);
+
+  uint64_t i = 0;
+#if defined(__AVX2__)
+  const __m256 kOne = _mm256_set1_ps(1.0f);
+  const __m256 kTwo = _mm256_set1_ps(2.0f);
+  const __m256 kSqrt2 = _mm256_set1_ps(std::sqrt(2.0f));
+  const __m256 kProjR = _mm256_set1_ps(proj_r);
+  for (; i + 8 <= data_number; i += 8) {
+    Rays8 rays{};
+    LoadRays8(dir + i * dir_step, dir_step, mat, &rays);
+    CheckHidden8(visible_semi_sphere, &rays);
+
+    __m256 rho, c, s;
+    LonCosSin8(rays.v[0], rays.v[1], &rho, &c, &s);
+    __m256 r_up = _mm256_mul_ps(_mm256_mul_ps(rho, kSqrt2), Math::RsqrtFast(_mm256_add_ps(kOne, rays.v[2])));
+    __m256 r_down = _mm256_sqrt_ps(_mm256_mul_ps(kTwo, _mm256_sub_ps(kOne, rays.v[2])));
+    __m256 r = _mm256_mul_ps(kProjR, _mm256_blendv_ps(r_down, r_up,
+                                                      _mm256_cmp_ps(rays.v[2], _mm256_setzero_ps(), _CMP_GT_OQ)));
+
+    __m256 x = _mm256_add_ps(_mm256_mul_ps(r, c), _mm256_set1_ps(img_wid / 2.0f));
+    __m256 y = _mm256_add_ps(_mm256_mul_ps(r, s), _mm256_set1_ps(img_hei / 2.0f));
+    StorePixelIndex8(x, y, rays.hidden, offset_x, offset_y, img_wid, img_hei, pixel_idx + i);
+  }
+#endif
+  for (; i < data_number; i++) {
+    const float* d = dir + i * dir_step;
+    float v[3];
+    RotateRay(mat, d, v);
+    if (IsHidden(d, v, visible_semi_sphere)) {
+      pixel_idx[i] = -1;
+      continue;
+    }
 
-  delete[] dir_copy;
+    float rho, c, s;
+    LonCosSin(v[0], v[1], &rho, &c, &s);
+    float r = proj_r * (v[2] > 0 ? rho * std::sqrt(2.0f) * Math::RsqrtFast(1.0f + v[2]) :
+                                   std::sqrt(2.0f * (1.0f - v[2])));
+    pixel_idx[i] = PixelIndex(r * c + img_wid / 2.0f, r * s + img_hei / 2.0f,
+                              offset_x, offset_y, img_wid, img_hei);
+  }
 }
 
 
-void DualEqualAreaFishEye(const float* /* cam_rot */,     // Not used
-                          float  /* hov */,               // Not used
-                          uint64_t data_number,           // Data number
-                          const float* dir,               // Ray directions, [x, y, z]
-                          int img_wid, int img_hei,       // Image size
-                          int* img_xy,                    // Image coordinates
+/* Dual equal area fisheye. Upper semi-sphere on the left, lower on the right (mirrored).
+ * r = proj_r * rho * sqrt(2 / (1 + |z|)), see EqualAreaFishEye.
+ */
+void DualEqualAreaFishEye(const float* /* cam_rot */,         // Not used
+                          float  /* hov */,                   // Not used
+                          uint64_t data_number,               // Data number
+                          const float* dir,                   // Ray directions, [x, y, z]
+                          size_t dir_step,                    // Floats from one ray direction to the next
+                          int img_wid, int img_hei,           // Image size
+                          int /* offset_x */, int /* offset_y */,   // Not used
+                          int* pixel_idx,                     // Pixel indices
                           VisibleSemiSphere /* visible_semi_sphere */) {
   float img_r = std::min(img_wid / 2, img_hei) / 2.0f;
   float proj_r = img_r / 2.0f / std::sin(45.0f / 180.0f * Math::kPi);
-
-  auto* dir_copy = new float[data_number * 3];
-  float cam_rot_copy[3] = {90.0f, 89.999f, 0.0f};
-  cam_rot_copy[0] *= -1;
-  cam_rot_copy[1] *= -1;
-  for (float &i : cam_rot_copy) {
-    i *= Math::kDegreeToRad;
+  float cam_rot[3] = {90.0f, 89.999f, 0.0f};
+  float mat[9];
+  CameraRotationMatrix(cam_rot, mat);
+
+  uint64_t i = 0;
+#if defined(__AVX2__)
+  const __m256 kZero = _mm256_setzero_ps();
+  const __m256 kOne = _mm256_set1_ps(1.0f);
+  const __m256 kSignMask = _mm256_set1_ps(-0.0f);
+  for (; i + 8 <= data_number; i += 8) {
+    Rays8 rays{};
+    LoadRays8(dir + i * dir_step, dir_step, mat, &rays);
+    CheckHidden8(VisibleSemiSphere::kFull, &rays);
+
+    __m256 rho, c, s;
+    LonCosSin8(rays.v[0], rays.v[1], &rho, &c, &s);
+    __m256 az = _mm256_andnot_ps(kSignMask, rays.v[2]);
+    __m256 r = _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(proj_r * std::sqrt(2.0f)), rho),
+                             Math::RsqrtFast(_mm256_add_ps(kOne, az)));
+    __m256 lower = _mm256_cmp_ps(rays.v[2], kZero, _CMP_LT_OQ);
+    c = _mm256_xor_ps(c, _mm256_and_ps(lower, kSignMask));    // lon = pi - lon
+
+    __m256 cx = _mm256_blendv_ps(_mm256_set1_ps(3 * img_r - 0.5f), _mm256_set1_ps(img_r - 0.5f),
+                                 _mm256_cmp_ps(rays.v[2], kZero, _CMP_GT_OQ));
+    __m256 x = _mm256_add_ps(_mm256_mul_ps(r, c), cx);
+    __m256 y = _mm256_add_ps(_mm256_mul_ps(r, s), _mm256_set1_ps(img_r - 0.5f));
+    StorePixelIndex8(x, y, rays.hidden, 0, 0, img_wid, img_hei, pixel_idx + i);
   }
+#endif
+  for (; i < data_number; i++) {
+    const float* d = dir + i * dir_step;
+    float v[3];
+    RotateRay(mat, d, v);
+    if (IsHidden(d, v, VisibleSemiSphere::kFull)) {
+      pixel_idx[i] = -1;
+      continue;
+    }
 
-  Math::RotateZ(cam_rot_copy, dir, dir_copy, data_number);
-  for (decltype(data_number) i = 0; i < data_number; i++) {
-    if (std::abs(Math::Norm3(dir_copy + i * 3) - 1.0) > 1e-4) {
-      img_xy[i * 2 + 0] = std::numeric_limits<int>::min();
-      img_xy[i * 2 + 1] = std::numeric_limits<int>::min();
-    } else {
-      float lon = std::atan2(dir_copy[i * 3 + 1], dir_copy[i * 3 + 0]);
-      float lat = std::asin(dir_copy[i * 3 + 2] / Math::Norm3(dir_copy + i * 3));
-      if (lat < 0) {
-        lon = Math::kPi - lon;
-      }
-      float r = 2.0f * proj_r * std::sin((Math::kPi / 2.0f - std::abs(lat)) / 2.0f);
-
-      img_xy[i * 2 + 0] = static_cast<int>(std::round(r * std::cos(lon) + img_r + (lat > 0 ? -0.5 : 2 * img_r - 0.5)));
-      img_xy[i * 2 + 1] = static_cast<int>(std::round(r * std::sin(lon) + img_r - 0.5));
+    float rho, c, s;
+    LonCosSin(v[0], v[1], &rho, &c, &s);
+    float r = proj_r * std::sqrt(2.0f) * rho * Math::RsqrtFast(1.0f + std::abs(v[2]));
+    if (v[2] < 0) {
+      c = -c;
     }
+    pixel_idx[i] = PixelIndex(r * c + (v[2] > 0 ? img_r - 0.5f : 3 * img_r - 0.5f), r * s + img_r - 0.5f,
+                              0, 0, img_wid, img_hei);
   }
-
-  delete[] dir_copy;
 }
 
 
-void DualEquidistantFishEye(const float* /* cam_rot */,     // Not used
-                            float  /* hov */,               // Not used
-                            uint64_t data_number,           // Data number
-                            const float* dir,               // Ray directions, [x, y, z]
-                            int img_wid, int img_hei,       // Image size
-                            int* img_xy,                    // Image coordinates
+/* Dual equidistant fisheye. Upper semi-sphere on the left, lower on the right (mirrored).
+ * r = (pi/2 - |lat|) * 2 / pi * img_r, where pi/2 - |lat| = atan2(rho, |z|) is well conditioned everywhere.
+ */
+void DualEquidistantFishEye(const float* /* cam_rot */,         // Not used
+                            float  /* hov */,                   // Not used
+                            uint64_t data_number,               // Data number
+                            const float* dir,                   // Ray directions, [x, y, z]
+                            size_t dir_step,                    // Floats from one ray direction to the next
+                            int img_wid, int img_hei,           // Image size
+                            int /* offset_x */, int /* offset_y */,   // Not used
+                            int* pixel_idx,                     // Pixel indices
                             VisibleSemiSphere /* visible_semi_sphere */) {
   float img_r = std::min(img_wid / 2, img_hei) / 2.0f;
-
-  auto* dir_copy = new float[data_number * 3];
-  float cam_rot_copy[3] = {90.0f, 89.999f, 0.0f};
-  cam_rot_copy[0] *= -1;
-  cam_rot_copy[1] *= -1;
-  for (float &i : cam_rot_copy) {
-    i *= Math::kDegreeToRad;
+  float cam_rot[3] = {90.0f, 89.999f, 0.0f};
+  float mat[9];
+  CameraRotationMatrix(cam_rot, mat);
+
+  uint64_t i = 0;
+#if defined(__AVX2__)
+  const __m256 kZero = _mm256_setzero_ps();
+  const __m256 kSignMask = _mm256_set1_ps(-0.0f);
+  for (; i + 8 <= data_number; i += 8) {
+    Rays8 rays{};
+    LoadRays8(dir + i * dir_step, dir_step, mat, &rays);
+    CheckHidden8(VisibleSemiSphere::kFull, &rays);
+
+    __m256 rho, c, s;
+    LonCosSin8(rays.v[0], rays.v[1], &rho, &c, &s);
+    __m256 az = _mm256_andnot_ps(kSignMask, rays.v[2]);
+    __m256 r = _mm256_mul_ps(Math::Atan2Fast(rho, az), _mm256_set1_ps(2.0f / Math::kPi * img_r));
+    __m256 lower = _mm256_cmp_ps(rays.v[2], kZero, _CMP_LT_OQ);
+    c = _mm256_xor_ps(c, _mm256_and_ps(lower, kSignMask));    // lon = pi - lon
+
+    __m256 cx = _mm256_blendv_ps(_mm256_set1_ps(3 * img_r - 0.5f), _mm256_set1_ps(img_r - 0.5f),
+                                 _mm256_cmp_ps(rays.v[2], kZero, _CMP_GT_OQ));
+    __m256 x = _mm256_add_ps(_mm256_mul_ps(r, c), cx);
+    __m256 y = _mm256_add_ps(_mm256_mul_ps(r, s), _mm256_set1_ps(img_r - 0.5f));
+    StorePixelIndex8(x, y, rays.hidden, 0, 0, img_wid, img_hei, pixel_idx + i);
   }
+#endif
+  for (; i < data_number; i++) {
+    const float* d = dir + i * dir_step;
+    float v[3];
+    RotateRay(mat, d, v);
+    if (IsHidden(d, v, VisibleSemiSphere::kFull)) {
+      pixel_idx[i] = -1;
+      continue;
+    }
 
-  Math::RotateZ(cam_rot_copy, dir, dir_copy, data_number);
-  for (decltype(data_number) i = 0; i < data_number; i++) {
-    if (std::abs(Math::Norm3(dir_copy + i * 3) - 1.0) > 1e-4) {
-      img_xy[i * 2 + 0] = std::numeric_limits<int>::min();
-      img_xy[i * 2 + 1] = std::numeric_limits<int>::min();
-    } else {
-      float lon = std::atan2(dir_copy[i * 3 + 1], dir_copy[i * 3 + 0]);
-      float lat = std::asin(dir_copy[i * 3 + 2] / Math::Norm3(dir_copy + i * 3));
-      if (lat < 0) {
-        lon = Math::kPi - lon;
-      }
-      float r = (1.0f - std::abs(lat) * 2.0f / Math::kPi) * img_r;
-
-      img_xy[i * 2 + 0] = static_cast<int>(std::round(r * std::cos(lon) + img_r + (lat > 0 ? -0.5 : 2 * img_r - 0.5)));
-      img_xy[i * 2 + 1] = static_cast<int>(std::round(r * std::sin(lon) + img_r - 0.5));
+    float rho, c, s;
+    LonCosSin(v[0], v[1], &rho, &c, &s);
+    float r = Math::Atan2Fast(rho, std::abs(v[2])) * (2.0f / Math::kPi * img_r);
+    if (v[2] < 0) {
+      c = -c;
     }
+    pixel_idx[i] = PixelIndex(r * c + (v[2] > 0 ? img_r - 0.5f : 3 * img_r - 0.5f), r * s + img_r - 0.5f,
+                              0, 0, img_wid, img_hei);
   }
-
-  delete[] dir_copy;
 }
 
 
-void RectLinear(const float* cam_rot,      // Camera rotation. [lon, lat, roll]
-                float hov,                 // Half field of view.
-                uint64_t data_number,      // Data number
-                const float* dir,          // Ray directions, [x, y, z]
-                int img_wid, int img_hei,  // Image size
-                int* img_xy,               // Image coordinates
+void RectLinear(const float* cam_rot,        // Camera rotation. [lon, lat, roll]
+                float hov,                   // Half field of view.
+                uint64_t data_number,        // Data number
+                const float* dir,            // Ray directions, [x, y, z]
+                size_t dir_step,             // Floats from one ray direction to the next
+                int img_wid, int img_hei,    // Image size
+                int offset_x, int offset_y,  // Image offset
+                int* pixel_idx,              // Pixel indices
                 VisibleSemiSphere visible_semi_sphere) {
-  auto* dir_copy = new float[data_number * 3];
-  float cam_rot_copy[3];
-  std::memcpy(cam_rot_copy, cam_rot, sizeof(float) * 3);
-  cam_rot_copy[0] *= -1;
-  cam_rot_copy[1] *= -1;
-  for (float &i : cam_rot_copy) {
-    i *= Math::kDegreeToRad;
+  float f = img_wid / 2.0f / std::tan(hov * Math::kDegreeToRad);
+  float mat[9];
+  CameraRotationMatrix(cam_rot, mat);
+
+  uint64_t i = 0;
+#if defined(__AVX2__)
+  const __m256 kF = _mm256_set1_ps(f);
+  for (; i + 8 <= data_number; i += 8) {
+    Rays8 rays{};
+    LoadRays8(dir + i * dir_step, dir_step, mat, &rays);
+    CheckHidden8(visible_semi_sphere, &rays);
+    rays.hidden = _mm256_or_ps(rays.hidden, _mm256_cmp_ps(rays.v[2], _mm256_setzero_ps(), _CMP_LT_OQ));
+
+    __m256 k = _mm256_div_ps(kF, rays.v[2]);
+    __m256 x = _mm256_add_ps(_mm256_mul_ps(rays.v[0], k), _mm256_set1_ps(img_wid / 2.0f));
+    __m256 y = _mm256_add_ps(_mm256_mul_ps(rays.v[1], k), _mm256_set1_ps(img_hei / 2.0f));
+    StorePixelIndex8(x, y, rays.hidden, offset_x, offset_y, img_wid, img_hei, pixel_idx + i);
   }
-
-  Math::RotateZ(cam_rot_copy, dir, dir_copy, data_number);
-  for (decltype(data_number) i = 0; i < data_number; i++) {
-    if (dir_copy[i * 3 + 2] < 0 || std::abs(Math::Norm3(dir_copy + i * 3) - 1.0) > 1e-4) {
-      img_xy[i * 2 + 0] = std::numeric_limits<int>::min();
-      img_xy[i * 2 + 1] = std::numeric_limits<int>::min();
-    } else if (visible_semi_sphere == VisibleSemiSphere::kCamera && dir_copy[i * 3 + 2] < 0) {
-      img_xy[i * 2 + 0] = std::numeric_limits<int>::min();
-      img_xy[i * 2 + 1] = std::numeric_limits<int>::min();
-    } else if (visible_semi_sphere == VisibleSemiSphere::kUpper && dir[i * 3 + 2] > 0) {
-      img_xy[i * 2 + 0] = std::numeric_limits<int>::min();
-      img_xy[i * 2 + 1] = std::numeric_limits<int>::min();
-    } else if (visible_semi_sphere == VisibleSemiSphere::kLower && dir[i * 3 + 2] < 0) {
-      img_xy[i * 2 + 0] = std::numeric_limits<int>::min();
-      img_xy[i * 2 + 1] = std::numeric_limits<int>::min();
-    } else {
-      double x = dir_copy[i * 3 + 0] / dir_copy[i * 3 + 2];
-      double y = dir_copy[i * 3 + 1] / dir_copy[i * 3 + 2];
-      x = x * img_wid / 2 / std::tan(hov * Math::kPi / 180.0f) + img_wid / 2.0f;
-      y = y * img_wid / 2 / std::tan(hov * Math::kPi / 180.0f) + img_hei / 2.0f;
-
-      img_xy[i * 2 + 0] = static_cast<int>(std::round(x));
-      img_xy[i * 2 + 1] = static_cast<int>(std::round(y));
+#endif
+  for (; i < data_number; i++) {
+    const float* d = dir + i * dir_step;
+    float v[3];
+    RotateRay(mat, d, v);
+    if (v[2] < 0 || IsHidden(d, v, visible_semi_sphere)) {
+      pixel_idx[i] = -1;
+      continue;
     }
-  }
 
-  delete[] dir_copy;
+    float k = f / v[2];
+    pixel_idx[i] = PixelIndex(v[0] * k + img_wid / 2.0f, v[1] * k + img_hei / 2.0f,
+                              offset_x, offset_y, img_wid, img_hei);
+  }
 }
 
 
@@ -191,18 +392,69 @@ void SrgbGamma(float* linear_rgb) {
 }
 
 
+namespace {
+
+/* threshold[k] is the smallest linear value that SrgbGamma maps to level k or above.
+ * It is found by bisection on the bit pattern of non-negative floats, whose order is the same
+ * as their values. Exhaustively checked against SrgbGamma for all floats in [0, 1]. */
+struct SrgbGammaTable {
+  SrgbGammaTable() {
+    threshold[0] = -std::numeric_limits<float>::max();
+    float one = 1.0f;
+    uint32_t one_bits = 0;
+    std::memcpy(&one_bits, &one, sizeof(float));
+    for (int k = 1; k < 256; k++) {
+      uint32_t lo = 0;
+      uint32_t hi = one_bits;
+      while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        float x;
+        std::memcpy(&x, &mid, sizeof(float));
+        float v[3] = { x, 0, 0 };
+        SrgbGamma(v);
+        if (static_cast<uint8_t>(v[0] * 255) >= k) {
+          hi = mid;
+        } else {
+          lo = mid;
+        }
+      }
+      std::memcpy(&threshold[k], &hi, sizeof(float));
+    }
+  }
+
+  float threshold[256];
+};
+
+}  // namespace
+
+
+uint8_t SrgbGamma8(float linear) {
+  static const SrgbGammaTable table;
+
+  int k = 0;
+  for (int step = 128; step > 0; step >>= 1) {
+    if (linear >= table.threshold[k + step]) {
+      k += step;
+    }
+  }
+  return static_cast<uint8_t>(k);
+}
+
+
 constexpr int SpectrumRenderer::kMinWavelength;
 constexpr int SpectrumRenderer::kMaxWaveLength;
 constexpr uint8_t SpectrumRenderer::kColorMaxVal;
+constexpr size_t SpectrumRenderer::kLoadFileBatchSize;
+constexpr size_t SpectrumRenderer::kProjectChunkSize;
+constexpr uint32_t SpectrumRenderer::kBinRowsPerJob;
+constexpr uint32_t SpectrumRenderer::kMaxCacheNameLength;
+constexpr size_t SpectrumRenderer::kColorTileSize;
 constexpr float SpectrumRenderer::kWhitePointD65[];
 constexpr float SpectrumRenderer::kXyzToRgb[];
-constexpr float SpectrumRenderer::kCmfX[];
-constexpr float SpectrumRenderer::kCmfY[];
-constexpr float SpectrumRenderer::kCmfZ[];
 
 
 SpectrumRenderer::SpectrumRenderer(const IceHalo::RenderContextPtr& context)
-  : context_(context), total_w_(0) {}
+  : context_(context), xyz_data_(nullptr), total_w_(0) {}
 
 
 SpectrumRenderer::~SpectrumRenderer() {
@@ -211,19 +463,161 @@ SpectrumRenderer::~SpectrumRenderer() {
 
 
 void SpectrumRenderer::LoadData() {
-  std::vector<File> files = ListDataFiles(context_->GetDataDirectory().c_str());
-  int i = 0;
-  for (auto& f : files) {
-    auto t0 = std::chrono::system_clock::now();
-    auto num = LoadDataFromFile(f);
+  LoadData(std::vector<SpectrumRenderer*>{ this });
+}
+
+
+void SpectrumRenderer::LoadData(const std::vector<SpectrumRenderer*>& renderers) {
+  std::vector<SpectrumRenderer*> valid_renderers;
+  for (auto r : renderers) {
+    if (projection_functions.find(r->context_->GetProjectionType()) == projection_functions.end()) {
+      std::fprintf(stderr, "Unknown projection type!\n");
+    } else {
+      valid_renderers.emplace_back(r);
+    }
+  }
+  if (valid_renderers.empty()) {
+    return;
+  }
+
+  /* All views share the same data folder. A file is read if any renderer has not accumulated it yet. */
+  std::vector<File> files = ListDataFiles(valid_renderers[0]->context_->GetDataDirectory().c_str());
+  std::vector<size_t> loaded_file_num;
+  for (auto r : valid_renderers) {
+    if (r->context_->IsCacheEnabled() && r->loaded_files_.empty() && r->LoadCache(files)) {
+      std::printf(" Loading cache: %zu files already accumulated\n", r->loaded_files_.size());
+    }
+    loaded_file_num.emplace_back(r->loaded_files_.size());
+  }
+  files.erase(std::remove_if(files.begin(), files.end(), [&valid_renderers](const File& f) {
+                return std::all_of(valid_renderers.begin(), valid_renderers.end(), [&f](const SpectrumRenderer* r) {
+                  return r->loaded_files_.count(f.GetFilename()) > 0;
+                });
+              }),
+              files.end());
+
+  /* Files are processed in batches. Within a batch, files are read concurrently only once,
+   * then accumulated by each renderer in turn. */
+  auto pool = ThreadingPool::GetInstance();
+  for (size_t batch_start = 0; batch_start < files.size(); batch_start += kLoadFileBatchSize) {
+    size_t batch_size = std::min(kLoadFileBatchSize, files.size() - batch_start);
+    std::vector<FileRayData> batch_data(batch_size);
+    std::vector<int> ray_count(batch_size, 0);
+
+    std::vector<float> load_time(batch_size, 0.0f);
+    for (size_t i = 0; i < batch_size; i++) {
+      File* file = &files[batch_start + i];
+      FileRayData* ray_data = &batch_data[i];
+      int* count = &ray_count[i];
+      float* t = &load_time[i];
+      pool->AddJob([=] {
+        auto t_start = std::chrono::system_clock::now();
+        *count = LoadDataFromFile(*file, ray_data);
+        std::chrono::duration<float, std::ratio<1, 1000> > diff = std::chrono::system_clock::now() - t_start;
+        *t = diff.count();
+      });
+    }
+    pool->WaitFinish();
+    for (size_t i = 0; i < batch_size; i++) {
+      std::printf(" Loading data (%zu/%zu): %.2fms; total %d pts\n",
+                  batch_start + i + 1, files.size(), load_time[i], ray_count[i]);
+    }
+
     auto t1 = std::chrono::system_clock::now();
-    std::chrono::duration<float, std::ratio<1, 1000> > diff = t1 - t0;
-    std::printf(" Loading data (%d/%zu): %.2fms; total %d pts\n", i + 1, files.size(), diff.count(), num);
-    i++;
+    for (auto r : valid_renderers) {
+      r->AccumulateBatch(files.data() + batch_start, &batch_data, ray_count);
+    }
+    std::chrono::duration<float, std::ratio<1, 1000> > diff = std::chrono::system_clock::now() - t1;
+    std::printf(" Accumulating data (%zu/%zu): %.2fms\n", batch_start + batch_size, files.size(), diff.count());
+  }
+
+  for (size_t i = 0; i < valid_renderers.size(); i++) {
+    auto r = valid_renderers[i];
+    if (r->context_->IsCacheEnabled() && r->loaded_files_.size() > loaded_file_num[i]) {
+      r->SaveCache();
+    }
   }
 }
 
 
+/* Project and accumulate rays of a batch of files, skipping files already accumulated.
+ * Rays are projected concurrently, and sorted by bands of image rows. Then every binning job owns a band and adds
+ * its rays of each file in file order, so each pixel sees exactly the same summation sequence as a serial load. */
+void SpectrumRenderer::AccumulateBatch(const File* files, std::vector<FileRayData>* batch_data,
+                                       const std::vector<int>& ray_count) {
+  auto pool = ThreadingPool::GetInstance();
+  auto band_num = (context_->GetImageHeight() + kBinRowsPerJob - 1) / kBinRowsPerJob;
+  bool use_xyz = context_->GetAccumulationMode() == AccumulationMode::kXyz;
+
+  std::vector<FileRayData*> valid_data;
+  for (size_t i = 0; i < batch_data->size(); i++) {
+    if (ray_count[i] > 0 && loaded_files_.count(files[i].GetFilename()) == 0) {
+      valid_data.emplace_back(&(*batch_data)[i]);
+      total_w_ += context_->GetTotalRayNum();
+      loaded_files_[files[i].GetFilename()] = files[i].GetSize();
+    }
+  }
+
+  auto mirror_fold = context_->GetMirrorFold();
+  for (auto ray_data : valid_data) {
+    ray_data->folded = mirror_fold == MirrorFold::kAlways || (mirror_fold == MirrorFold::kAuto && ray_data->mirror);
+    if (ray_data->folded) {
+      ray_data->mirror_pixel_idx.resize(ray_data->ray_num);
+      ray_data->mirror_dir.resize(ray_data->ray_num * 3);
+    }
+  }
+
+  for (auto ray_data : valid_data) {
+    for (size_t offset = 0; offset < ray_data->ray_num; offset += kProjectChunkSize) {
+      size_t num = std::min(kProjectChunkSize, ray_data->ray_num - offset);
+      pool->AddJob([=] { ProjectRays(ray_data, offset, num); });
+    }
+  }
+  pool->WaitFinish();
+  for (auto ray_data : valid_data) {
+    pool->AddJob([=] { BucketRays(ray_data); });
+  }
+  pool->WaitFinish();
+
+  std::vector<FileRayData*> xyz_files;
+  for (auto ray_data : valid_data) {
+    if (use_xyz || ray_data->spectral) {
+      xyz_files.emplace_back(ray_data);
+    }
+  }
+  if (!xyz_files.empty()) {
+    double* xyz_data = GetXyzData();
+    for (uint32_t band = 0; band < band_num; band++) {
+      pool->AddJob([=] { BinRaysXyz(xyz_files, xyz_data, band); });
+    }
+  }
+
+  std::vector<int> wavelengths;
+  for (size_t i = 0; i < valid_data.size() && !use_xyz; i++) {
+    if (valid_data[i]->spectral) {
+      continue;
+    }
+    if (std::find(wavelengths.begin(), wavelengths.end(), valid_data[i]->wavelength) == wavelengths.end()) {
+      wavelengths.emplace_back(valid_data[i]->wavelength);
+    }
+  }
+  for (auto wl : wavelengths) {
+    std::vector<FileRayData*> wl_data;
+    for (auto ray_data : valid_data) {
+      if (!ray_data->spectral && ray_data->wavelength == wl) {
+        wl_data.emplace_back(ray_data);
+      }
+    }
+    float* current_data_compensation = nullptr;
+    float* current_data = GetSpectrumData(wl, &current_data_compensation);
+    for (uint32_t band = 0; band < band_num; band++) {
+      pool->AddJob([=] { BinRays(wl_data, current_data, current_data_compensation, band); });
+    }
+  }
+  pool->WaitFinish();
+}
+
+
 void SpectrumRenderer::ResetData() {
   total_w_ = 0;
   for (const auto& kv : spectrum_data_) {
@@ -234,147 +628,540 @@ void SpectrumRenderer::ResetData() {
   }
   spectrum_data_.clear();
   spectrum_data_compensation_.clear();
+  delete[] xyz_data_;
+  xyz_data_ = nullptr;
+  loaded_files_.clear();
 }
 
 
 void SpectrumRenderer::RenderToRgb(uint8_t* rgb_data) {
-  auto img_hei = context_->GetImageHeight();
-  auto img_wid = context_->GetImageWidth();
-  auto wl_num = spectrum_data_.size();
-  auto* wl_data = new float[wl_num];
-  auto* flat_spec_data = new float[wl_num * img_wid * img_hei];
+  auto img_size = context_->GetImageWidth() * context_->GetImageHeight();
+  auto* xyz_data = new float[img_size * 3];
 
-  GatherSpectrumData(wl_data, flat_spec_data);
-  auto ray_color = context_->GetRayColor();
-  auto background_color = context_->GetBackgroundColor();
-  bool use_rgb = ray_color[0] < 0;
+  RenderToXyz(xyz_data);
+  Tonemap(context_, xyz_data, rgb_data);
 
-  if (use_rgb) {
-    Rgb(wl_num, img_wid * img_hei, wl_data, flat_spec_data, rgb_data);
-  } else {
-    Gray(wl_num, img_wid * img_hei, wl_data, flat_spec_data, rgb_data);
+  delete[] xyz_data;
+}
+
+
+void SpectrumRenderer::RenderToXyz(float* xyz_data) {
+  size_t img_size = context_->GetImageWidth() * context_->GetImageHeight();
+  auto pool = ThreadingPool::GetInstance();
+
+  bool use_xyz = context_->GetAccumulationMode() == AccumulationMode::kXyz;
+  if (!use_xyz) {
+    auto wl_num = spectrum_data_.size();
+    auto* wl_data = new float[wl_num];
+    auto* flat_spec_data = new float[wl_num * img_size];
+
+    GatherSpectrumData(wl_data, flat_spec_data);
+    SpectrumToXyzImage(wl_num, img_size, wl_data, flat_spec_data, xyz_data);
+
+    delete[] wl_data;
+    delete[] flat_spec_data;
   }
-  for (decltype(img_wid) i = 0; i < img_wid * img_hei; i++) {
-    for (int c = 0; c < 3; c++) {
-      auto v = static_cast<int>(background_color[c] * kColorMaxVal);
-      if (use_rgb) {
-        v += rgb_data[i * 3 + c];
-      } else {
-        v += static_cast<int>(rgb_data[i * 3 + c] * ray_color[c]);
-      }
-      v = std::max(std::min(v, static_cast<int>(kColorMaxVal)), 0);
-      rgb_data[i * 3 + c] = static_cast<uint8_t>(v);
+
+  if (use_xyz || xyz_data_) {
+    /* XYZ planes are already weighted by color matching functions. No gathering needed.
+     * In spectrum mode they only hold spectral data, and are added to the converted spectra. */
+    const double* xyz_planes = GetXyzData();
+    double factor = 1e5 / total_w_;
+    for (size_t start = 0; start < img_size; start += kColorTileSize) {
+      size_t end = std::min(start + kColorTileSize, img_size);
+      pool->AddJob([=] {
+        for (size_t i = start; i < end; i++) {
+          for (int c = 0; c < 3; c++) {
+            auto v = static_cast<float>(xyz_planes[c * img_size + i] * factor);
+            xyz_data[i * 3 + c] = use_xyz ? v : xyz_data[i * 3 + c] + v;
+          }
+        }
+      });
     }
+    pool->WaitFinish();
+  }
+}
+
+
+void SpectrumRenderer::Tonemap(const RenderContextPtr& context, const float* xyz_data, uint8_t* rgb_data) {
+  size_t img_size = context->GetImageWidth() * context->GetImageHeight();
+  auto intensity_factor = static_cast<float>(context->GetIntensityFactor());
+  const float* ray_color = context->GetRayColor();
+  const float* background_color = context->GetBackgroundColor();
+  bool use_rgb = ray_color[0] < 0;
+
+  auto pool = ThreadingPool::GetInstance();
+  for (size_t start = 0; start < img_size; start += kColorTileSize) {
+    size_t end = std::min(start + kColorTileSize, img_size);
+    pool->AddJob([=] {
+      for (size_t i = start; i < end; i++) {
+        float xyz[3];
+        for (int c = 0; c < 3; c++) {
+          xyz[c] = xyz_data[i * 3 + c] * intensity_factor;
+        }
+        if (use_rgb) {
+          XyzToRgb(xyz, rgb_data + i * 3);
+        } else {
+          XyzToGray(xyz, rgb_data + i * 3);
+        }
+
+        for (int c = 0; c < 3; c++) {
+          auto v = static_cast<int>(background_color[c] * kColorMaxVal);
+          if (use_rgb) {
+            v += rgb_data[i * 3 + c];
+          } else {
+            v += static_cast<int>(rgb_data[i * 3 + c] * ray_color[c]);
+          }
+          v = std::max(std::min(v, static_cast<int>(kColorMaxVal)), 0);
+          rgb_data[i * 3 + c] = static_cast<uint8_t>(v);
+        }
+      }
+    });
   }
+  pool->WaitFinish();
 
   /* Draw horizontal */
   // float imgR = std::min(img_wid_ / 2, img_hei_) / 2.0f;
   // TODO
+}
+
 
-  delete[] wl_data;
-  delete[] flat_spec_data;
+void SpectrumRenderer::XyzToLinearRgb(const float* xyz_data, float* rgb_data, size_t pixel_num) {
+  for (size_t i = 0; i < pixel_num; i++) {
+    for (int j = 0; j < 3; j++) {
+      rgb_data[i * 3 + j] = 0;
+      for (int k = 0; k < 3; k++) {
+        rgb_data[i * 3 + j] += xyz_data[i * 3 + k] * kXyzToRgb[j * 3 + k];
+      }
+    }
+  }
 }
 
 
-int SpectrumRenderer::LoadDataFromFile(IceHalo::File& file) {
-  auto projection_type = context_->GetProjectionType();
-  if (projection_functions.find(projection_type) == projection_functions.end()) {
-    std::fprintf(stderr, "Unknown projection type!\n");
-    return -1;
+void SpectrumRenderer::LinearRgbToXyz(const float* rgb_data, float* xyz_data, size_t pixel_num) {
+  // Inverse of kXyzToRgb by cofactors, so that a round trip gives back the rendered XYZ.
+  const float* m = kXyzToRgb;
+  double inv[9];
+  for (int j = 0; j < 3; j++) {
+    for (int k = 0; k < 3; k++) {
+      int r0 = (k + 1) % 3, r1 = (k + 2) % 3;
+      int c0 = (j + 1) % 3, c1 = (j + 2) % 3;
+      inv[j * 3 + k] = static_cast<double>(m[r0 * 3 + c0]) * m[r1 * 3 + c1] -
+                       static_cast<double>(m[r0 * 3 + c1]) * m[r1 * 3 + c0];
+    }
+  }
+  double det = m[0] * inv[0] + m[1] * inv[3] + m[2] * inv[6];
+  for (double& v : inv) {
+    v /= det;
   }
 
-  auto file_size = file.GetSize();
-  auto* read_buffer = new float[file_size / sizeof(float)];
+  for (size_t i = 0; i < pixel_num; i++) {
+    for (int j = 0; j < 3; j++) {
+      double v = 0;
+      for (int k = 0; k < 3; k++) {
+        v += rgb_data[i * 3 + k] * inv[j * 3 + k];
+      }
+      xyz_data[i * 3 + j] = static_cast<float>(v);
+    }
+  }
+}
+
+
+SpectrumRenderer::FileRayData::FileRayData()
+    : wavelength(0), spectral(false), mirror(false), folded(false), ray_num(0) {}
 
+
+size_t SpectrumRenderer::FileRayData::RayStep() const {
+  return spectral ? 5 : 4;
+}
+
+
+// Read rays from a data file. Return ray number, or -1 if failed.
+int SpectrumRenderer::LoadDataFromFile(IceHalo::File& file, FileRayData* ray_data) {
+  ray_data->ray_num = 0;
+
+  auto file_size = file.GetSize();
   file.Open(OpenMode::kRead | OpenMode::kBinary);
-  auto read_count = file.Read(read_buffer, 1);
+  float wavelength_val = 0;
+  auto read_count = file.Read(&wavelength_val, 1);
   if (read_count <= 0) {
     std::fprintf(stderr, "Failed to read wavelength data!\n");
     file.Close();
-    delete[] read_buffer;
     return -1;
   }
 
-  auto wavelength = static_cast<int>(read_buffer[0]);
-  if (wavelength < SpectrumRenderer::kMinWavelength || wavelength > SpectrumRenderer::kMaxWaveLength) {
+  ray_data->spectral = wavelength_val == LightSpectrum::kSpectralDataTag;
+  auto wavelength = static_cast<int>(wavelength_val);
+  if (!ray_data->spectral &&
+      (wavelength < SpectrumRenderer::kMinWavelength || wavelength > SpectrumRenderer::kMaxWaveLength)) {
     std::fprintf(stderr, "Wavelength out of range!\n");
     file.Close();
-    delete[] read_buffer;
     return -1;
   }
 
-  read_count = file.Read(read_buffer, file_size / sizeof(float));
-  auto total_ray_count = read_count / 4;
+  auto ray_step = ray_data->RayStep();
+  size_t total_ray_count = (file_size / sizeof(float) - 1) / ray_step;
+  ray_data->data.resize(total_ray_count * ray_step);
+  read_count = file.Read(ray_data->data.data(), total_ray_count * ray_step);
+  total_ray_count = read_count / ray_step;
   file.Close();
 
-  if (total_ray_count == 0) {
-    delete[] read_buffer;
-    return 0;
+  ray_data->wavelength = wavelength;
+  ray_data->mirror = IsMirrorData(file);
+  ray_data->ray_num = total_ray_count;
+  ray_data->pixel_idx.resize(total_ray_count);
+  return static_cast<int>(total_ray_count);
+}
+
+
+// Project rays in [offset, offset + num) and fill their pixel index. If the data are folded, also fill pixel index
+// of their mirror images. The sun is always in the vertical plane x = 0, so a mirror image only negates x.
+void SpectrumRenderer::ProjectRays(FileRayData* ray_data, size_t offset, size_t num) {
+  auto projection_type = context_->GetProjectionType();
+  auto img_hei = static_cast<int>(context_->GetImageHeight());
+  auto img_wid = static_cast<int>(context_->GetImageWidth());
+  auto ray_step = ray_data->RayStep();
+  const float* dir = ray_data->data.data() + offset * ray_step;
+
+  projection_functions[projection_type](
+    context_->GetCamRot(), context_->GetFov(), num, dir, ray_step,
+    img_wid, img_hei, context_->GetOffsetX(), context_->GetOffsetY(),
+    ray_data->pixel_idx.data() + offset, context_->GetVisibleSemiSphere());
+
+  if (ray_data->folded) {
+    float* mirror_dir = ray_data->mirror_dir.data() + offset * 3;
+    for (size_t i = 0; i < num; i++) {
+      mirror_dir[i * 3 + 0] = -dir[i * ray_step + 0];
+      mirror_dir[i * 3 + 1] = dir[i * ray_step + 1];
+      mirror_dir[i * 3 + 2] = dir[i * ray_step + 2];
+    }
+    projection_functions[projection_type](
+      context_->GetCamRot(), context_->GetFov(), num, mirror_dir, 3,
+      img_wid, img_hei, context_->GetOffsetX(), context_->GetOffsetY(),
+      ray_data->mirror_pixel_idx.data() + offset, context_->GetVisibleSemiSphere());
   }
+}
 
-  auto* tmp_dir = new float[total_ray_count * 3];
-  auto* tmp_w = new float[total_ray_count];
-  auto* tmp_xy = new int[total_ray_count * 2];
-  for (decltype(read_count) i = 0; i < total_ray_count; i++) {
-    std::memcpy(tmp_dir + i * 3, read_buffer + i * 4, 3 * sizeof(float));
-    tmp_w[i] = read_buffer[i * 4 + 3];
+
+// Sort visible rays, and their mirror images if folded, by binning bands with a counting sort. The sort is stable,
+// so rays of a band keep the order of a plain pass over the file.
+void SpectrumRenderer::BucketRays(FileRayData* ray_data) {
+  auto band_size = static_cast<int>(kBinRowsPerJob * context_->GetImageWidth());
+  auto band_num = (context_->GetImageHeight() + kBinRowsPerJob - 1) / kBinRowsPerJob;
+  int image_num = ray_data->folded ? 2 : 1;
+
+  ray_data->band_offset.assign(band_num + 1, 0);
+  auto* offset = ray_data->band_offset.data();
+  for (int k = 0; k < image_num; k++) {
+    const int* pixel_idx = k == 0 ? ray_data->pixel_idx.data() : ray_data->mirror_pixel_idx.data();
+    for (size_t i = 0; i < ray_data->ray_num; i++) {
+      if (pixel_idx[i] >= 0) {
+        offset[pixel_idx[i] / band_size + 1]++;
+      }
+    }
+  }
+  for (uint32_t b = 0; b < band_num; b++) {
+    offset[b + 1] += offset[b];
   }
-  delete[] read_buffer;
 
-  auto img_hei = context_->GetImageHeight();
-  auto img_wid = context_->GetImageWidth();
-  projection_functions[projection_type](
-    context_->GetCamRot(), context_->GetFov(), total_ray_count, tmp_dir,
-    img_wid, img_hei, tmp_xy, context_->GetVisibleSemiSphere());
-  delete[] tmp_dir;
+  ray_data->band_rays.resize(offset[band_num]);
+  std::vector<uint32_t> next(offset, offset + band_num);
+  for (int k = 0; k < image_num; k++) {
+    const int* pixel_idx = k == 0 ? ray_data->pixel_idx.data() : ray_data->mirror_pixel_idx.data();
+    for (size_t i = 0; i < ray_data->ray_num; i++) {
+      if (pixel_idx[i] >= 0) {
+        ray_data->band_rays[next[pixel_idx[i] / band_size]++] = static_cast<uint32_t>(i * 2 + k);
+      }
+    }
+  }
+}
+
+
+// Kahan-sum rays in a band of image rows, as sorted by BucketRays(). Files are added in the given order.
+void SpectrumRenderer::BinRays(const std::vector<FileRayData*>& ray_data,
+                               float* current_data, float* current_data_compensation, uint32_t band) {
+  for (const auto d : ray_data) {
+    const float* w = d->data.data() + 3;
+    float scale = d->folded ? 0.5f : 1.0f;
+    for (auto e = d->band_offset[band]; e < d->band_offset[band + 1]; e++) {
+      auto i = d->band_rays[e] / 2;
+      int p = d->band_rays[e] % 2 == 0 ? d->pixel_idx[i] : d->mirror_pixel_idx[i];
+      auto tmp_val = w[i * 4] * scale - current_data_compensation[p];
+      auto tmp_sum = current_data[p] + tmp_val;
+      current_data_compensation[p] = tmp_sum - current_data[p] - tmp_val;
+      current_data[p] = tmp_sum;
+    }
+  }
+}
+
+
+// Add CMF weighted rays in a band of image rows, as sorted by BucketRays(), to XYZ planes.
+void SpectrumRenderer::BinRaysXyz(const std::vector<FileRayData*>& ray_data, double* xyz_data, uint32_t band) {
+  size_t img_size = context_->GetImageWidth() * context_->GetImageHeight();
+  double* x_data = xyz_data;
+  double* y_data = xyz_data + img_size;
+  double* z_data = xyz_data + img_size * 2;
+
+  for (const auto d : ray_data) {
+    if (d->spectral) {
+      BinSpectralRaysXyz(d, xyz_data, band);
+      continue;
+    }
+
+    double scale = d->folded ? 0.5 : 1.0;
+    float cmf[3];
+    ColorMatchingFunction::Get(d->wavelength, cmf);
+    double cmf_x = cmf[0] * scale;
+    double cmf_y = cmf[1] * scale;
+    double cmf_z = cmf[2] * scale;
+    const float* w = d->data.data() + 3;
+    for (auto e = d->band_offset[band]; e < d->band_offset[band + 1]; e++) {
+      auto i = d->band_rays[e] / 2;
+      int p = d->band_rays[e] % 2 == 0 ? d->pixel_idx[i] : d->mirror_pixel_idx[i];
+      x_data[p] += cmf_x * w[i * 4];
+      y_data[p] += cmf_y * w[i * 4];
+      z_data[p] += cmf_z * w[i * 4];
+    }
+  }
+}
 
-  float* current_data = nullptr;
-  float* current_data_compensation = nullptr;
+
+// Add rays of spectral data in a band of BucketRays() to XYZ planes.
+// Every ray is weighted by the color matching functions of its own wavelength.
+void SpectrumRenderer::BinSpectralRaysXyz(const FileRayData* ray_data, double* xyz_data, uint32_t band) {
+  size_t img_size = context_->GetImageWidth() * context_->GetImageHeight();
+  double* x_data = xyz_data;
+  double* y_data = xyz_data + img_size;
+  double* z_data = xyz_data + img_size * 2;
+
+  const float* w = ray_data->data.data() + 3;     // w, wavelength
+  double scale = ray_data->folded ? 0.5 : 1.0;
+  for (auto e = ray_data->band_offset[band]; e < ray_data->band_offset[band + 1]; e++) {
+    auto i = ray_data->band_rays[e] / 2;
+    int p = ray_data->band_rays[e] % 2 == 0 ? ray_data->pixel_idx[i] : ray_data->mirror_pixel_idx[i];
+    float cmf[3];
+    ColorMatchingFunction::Get(static_cast<int>(std::floor(w[i * 5 + 1] + 0.5f)), cmf);
+    x_data[p] += cmf[0] * static_cast<double>(w[i * 5]) * scale;
+    y_data[p] += cmf[1] * static_cast<double>(w[i * 5]) * scale;
+    z_data[p] += cmf[2] * static_cast<double>(w[i * 5]) * scale;
+  }
+}
+
+
+// Find or create the accumulation image of a wavelength.
+float* SpectrumRenderer::GetSpectrumData(int wavelength, float** compensation) {
   auto it = spectrum_data_.find(wavelength);
   if (it != spectrum_data_.end()) {
-    current_data = it->second;
-    current_data_compensation = spectrum_data_compensation_[wavelength];
-  } else {
-    current_data = new float[img_hei * img_wid];
-    current_data_compensation = new float[img_hei * img_wid];
-    for (decltype(img_hei) i = 0; i < img_hei * img_wid; i++) {
-      current_data[i] = 0;
-      current_data_compensation[i] = 0;
+    *compensation = spectrum_data_compensation_[wavelength];
+    return it->second;
+  }
+
+  auto img_size = context_->GetImageHeight() * context_->GetImageWidth();
+  auto* current_data = new float[img_size];
+  auto* current_data_compensation = new float[img_size];
+  for (decltype(img_size) i = 0; i < img_size; i++) {
+    current_data[i] = 0;
+    current_data_compensation[i] = 0;
+  }
+  spectrum_data_[wavelength] = current_data;
+  spectrum_data_compensation_[wavelength] = current_data_compensation;
+  *compensation = current_data_compensation;
+  return current_data;
+}
+
+
+// Find or create the XYZ planes.
+double* SpectrumRenderer::GetXyzData() {
+  if (xyz_data_) {
+    return xyz_data_;
+  }
+
+  auto img_size = context_->GetImageHeight() * context_->GetImageWidth();
+  xyz_data_ = new double[img_size * 3];
+  for (decltype(img_size) i = 0; i < img_size * 3; i++) {
+    xyz_data_[i] = 0;
+  }
+  return xyz_data_;
+}
+
+
+namespace {
+
+/* Everything that changes where or how rays are accumulated. A cache is valid only if all of them match. */
+struct RenderCacheHeader {
+  explicit RenderCacheHeader(const RenderContextPtr& context) {
+    std::memset(this, 0, sizeof(RenderCacheHeader));
+    magic = kMagic;
+    version = kVersion;
+    std::memcpy(cam_rot, context->GetCamRot(), 3 * sizeof(float));
+    fov = context->GetFov();
+    img_wid = context->GetImageWidth();
+    img_hei = context->GetImageHeight();
+    offset_x = context->GetOffsetX();
+    offset_y = context->GetOffsetY();
+    projection_type = static_cast<int32_t>(context->GetProjectionType());
+    visible_semi_sphere = static_cast<int32_t>(context->GetVisibleSemiSphere());
+    accumulation_mode = static_cast<int32_t>(context->GetAccumulationMode());
+    mirror_fold = static_cast<int32_t>(context->GetMirrorFold());
+  }
+
+  bool operator==(const RenderCacheHeader& other) const {
+    return std::memcmp(this, &other, sizeof(RenderCacheHeader)) == 0;
+  }
+
+  static constexpr uint32_t kMagic = 0x43524849;  // "IHRC"
+  static constexpr uint32_t kVersion = 3;
+
+  uint32_t magic;
+  uint32_t version;
+  float cam_rot[3];
+  float fov;
+  uint32_t img_wid;
+  uint32_t img_hei;
+  int32_t offset_x;
+  int32_t offset_y;
+  int32_t projection_type;
+  int32_t visible_semi_sphere;
+  int32_t accumulation_mode;
+  int32_t mirror_fold;
+};
+
+constexpr uint32_t RenderCacheHeader::kMagic;
+constexpr uint32_t RenderCacheHeader::kVersion;
+
+}  // namespace
+
+
+/* Load accumulated data from the cache file. Return false if there is no valid cache, and nothing is loaded.
+ *
+ * Cache file layout:
+ *   header, total_w,
+ *   file number, then for each file: name length, name, file size,
+ *   for kSpectrum: wavelength number, then for each wavelength: wavelength, data, compensation,
+ *                  then 1 and X, Y, Z planes of spectral data, or 0 if there are none;
+ *   for kXyz: X, Y, Z planes.
+ */
+bool SpectrumRenderer::LoadCache(const std::vector<File>& files) {
+  File file(context_->GetCachePath().c_str());
+  if (!file.Open(OpenMode::kRead | OpenMode::kBinary)) {
+    return false;
+  }
+
+  RenderCacheHeader header(context_);
+  RenderCacheHeader cache_header(context_);
+  if (file.Read(&cache_header, 1) != 1 || !(cache_header == header)) {
+    std::fprintf(stderr, "\nWARNING! Render cache does not match current settings, ignored!\n");
+    file.Close();
+    return false;
+  }
+
+  std::unordered_map<std::string, size_t> current_files;
+  for (const auto& f : files) {
+    current_files[f.GetFilename()] = f.GetSize();
+  }
+
+  bool valid = file.Read(&total_w_, 1) == 1;
+  uint32_t file_num = 0;
+  valid = valid && file.Read(&file_num, 1) == 1;
+  for (uint32_t i = 0; valid && i < file_num; i++) {
+    uint32_t name_len = 0;
+    uint64_t file_size = 0;
+    std::string name;
+    valid = file.Read(&name_len, 1) == 1 && name_len <= kMaxCacheNameLength && name_len <= file.GetSize();
+    if (valid) {
+      name.resize(name_len);
+      valid = file.Read(&name[0], name_len) == name_len && file.Read(&file_size, 1) == 1;
     }
-    spectrum_data_[wavelength] = current_data;
-    spectrum_data_compensation_[wavelength] = current_data_compensation;
+    auto it = current_files.find(name);
+    if (valid && (it == current_files.end() || it->second != file_size)) {
+      std::fprintf(stderr, "\nWARNING! Data file %s changed since render cache was saved, cache ignored!\n",
+                   name.c_str());
+      valid = false;
+    }
+    loaded_files_[name] = static_cast<size_t>(file_size);
   }
 
-  for (decltype(total_ray_count) i = 0; i < total_ray_count; i++) {
-    int x = tmp_xy[i * 2 + 0];
-    int y = tmp_xy[i * 2 + 1];
-    if (x == std::numeric_limits<int>::min() || y == std::numeric_limits<int>::min()) {
-      continue;
+  auto img_size = context_->GetImageHeight() * context_->GetImageWidth();
+  if (valid && context_->GetAccumulationMode() == AccumulationMode::kXyz) {
+    valid = file.Read(GetXyzData(), img_size * 3) == img_size * 3;
+  } else if (valid) {
+    uint32_t wl_num = 0;
+    valid = file.Read(&wl_num, 1) == 1 && wl_num <= static_cast<uint32_t>(kMaxWaveLength - kMinWavelength + 1);
+    for (uint32_t i = 0; valid && i < wl_num; i++) {
+      int32_t wl = 0;
+      valid = file.Read(&wl, 1) == 1;
+      float* current_data_compensation = nullptr;
+      float* current_data = valid ? GetSpectrumData(wl, &current_data_compensation) : nullptr;
+      valid = valid && file.Read(current_data, img_size) == img_size &&
+              file.Read(current_data_compensation, img_size) == img_size;
     }
-    if (projection_type != ProjectionType::kDualEqualArea && projection_type != ProjectionType::kDualEquidistant) {
-      x += context_->GetOffsetX();
-      y += context_->GetOffsetY();
+    uint32_t has_xyz = 0;
+    valid = valid && file.Read(&has_xyz, 1) == 1;
+    if (valid && has_xyz) {
+      valid = file.Read(GetXyzData(), img_size * 3) == img_size * 3;
     }
-    if (x < 0 || x >= static_cast<int>(img_wid) || y < 0 || y >= static_cast<int>(img_hei)) {
-      continue;
+  }
+  file.Close();
+
+  if (!valid) {
+    std::fprintf(stderr, "\nWARNING! Render cache cannot be used, all data will be loaded!\n");
+    ResetData();
+  }
+  return valid;
+}
+
+
+// Save accumulated data and the list of accumulated files to the cache file. Data are written to a temporary file
+// first, which replaces the cache only if all of it is written, so a failed save keeps the old cache.
+void SpectrumRenderer::SaveCache() {
+  auto cache_path = context_->GetCachePath();
+  auto tmp_path = cache_path + ".tmp";
+  File file(tmp_path.c_str());
+  if (!file.Open(OpenMode::kWrite | OpenMode::kBinary)) {
+    std::fprintf(stderr, "\nWARNING! Render cache cannot be saved!\n");
+    return;
+  }
+
+  bool ok = file.Write(RenderCacheHeader(context_)) == 1;
+  ok = ok && file.Write(total_w_) == 1;
+  ok = ok && file.Write(static_cast<uint32_t>(loaded_files_.size())) == 1;
+  for (const auto& kv : loaded_files_) {
+    ok = ok && file.Write(static_cast<uint32_t>(kv.first.size())) == 1;
+    ok = ok && file.Write(kv.first.c_str(), kv.first.size()) == kv.first.size();
+    ok = ok && file.Write(static_cast<uint64_t>(kv.second)) == 1;
+  }
+
+  auto img_size = context_->GetImageHeight() * context_->GetImageWidth();
+  if (context_->GetAccumulationMode() == AccumulationMode::kXyz) {
+    ok = ok && file.Write(GetXyzData(), img_size * 3) == img_size * 3;
+  } else {
+    ok = ok && file.Write(static_cast<uint32_t>(spectrum_data_.size())) == 1;
+    for (const auto& kv : spectrum_data_) {
+      ok = ok && file.Write(static_cast<int32_t>(kv.first)) == 1;
+      ok = ok && file.Write(kv.second, img_size) == img_size;
+      ok = ok && file.Write(spectrum_data_compensation_[kv.first], img_size) == img_size;
+    }
+    ok = ok && file.Write(static_cast<uint32_t>(xyz_data_ ? 1 : 0)) == 1;
+    if (xyz_data_) {
+      ok = ok && file.Write(xyz_data_, img_size * 3) == img_size * 3;
     }
-    auto tmp_val = tmp_w[i] - current_data_compensation[y * img_wid + x];
-    auto tmp_sum = current_data[y * img_wid + x] + tmp_val;
-    current_data_compensation[y * img_wid + x] = tmp_sum - current_data[y * img_wid + x] - tmp_val;
-    current_data[y * img_wid + x] = tmp_sum;
   }
-  delete[] tmp_xy;
-  delete[] tmp_w;
+  ok = file.Close() && ok;
 
-  total_w_ += context_->GetTotalRayNum();
-  return static_cast<int>(total_ray_count);
+  boost::system::error_code ec;
+  if (ok) {
+    boost::filesystem::rename(tmp_path, cache_path, ec);
+  }
+  if (!ok || ec) {
+    std::fprintf(stderr, "\nWARNING! Render cache cannot be saved!\n");
+    boost::filesystem::remove(tmp_path, ec);
+  }
 }
 
 
 void SpectrumRenderer::GatherSpectrumData(float* wl_data_out, float* sp_data_out) {
   auto img_hei = context_->GetImageHeight();
   auto img_wid = context_->GetImageWidth();
-  auto intensity_factor = context_->GetIntensityFactor();
 
   int k = 0;
   for (const auto& kv : spectrum_data_) {
@@ -383,96 +1170,190 @@ void SpectrumRenderer::GatherSpectrumData(float* wl_data_out, float* sp_data_out
     k++;
   }
   for (decltype(spectrum_data_.size()) i = 0; i < img_wid * img_hei * spectrum_data_.size(); i++) {
-    sp_data_out[i] *= 1e5 / total_w_ * intensity_factor;
+    sp_data_out[i] *= 1e5 / total_w_;
+  }
+}
+
+
+// Convert spectra to interleaved XYZ. Pixels are split into tiles and converted concurrently.
+void SpectrumRenderer::SpectrumToXyzImage(size_t wavelength_number, size_t data_number,
+                                          const float* wavelengths, const float* spec_data,
+                                          float* xyz_data) {
+  /* Color matching function weights of every loaded wavelength, computed only once */
+  auto* cmf = new float[wavelength_number * 3];
+  GetCmfWeights(wavelength_number, wavelengths, cmf);
+
+  auto pool = ThreadingPool::GetInstance();
+  for (size_t offset = 0; offset < data_number; offset += kColorTileSize) {
+    size_t num = std::min(kColorTileSize, data_number - offset);
+    pool->AddJob([=] {
+      float tile_xyz[3 * kColorTileSize];
+      SpectrumToXyz(wavelength_number, data_number, cmf, spec_data, offset, num, tile_xyz);
+      for (size_t i = 0; i < num; i++) {
+        for (int c = 0; c < 3; c++) {
+          xyz_data[(offset + i) * 3 + c] = tile_xyz[c * num + i];
+        }
+      }
+    });
   }
+  pool->WaitFinish();
+
+  delete[] cmf;
 }
 
 
-void SpectrumRenderer::Rgb(size_t wavelength_number, size_t data_number,
-                           const float* wavelengths, const float* spec_data,
-                           uint8_t* rgb_data) {
-  for (decltype(data_number) i = 0; i < data_number; i++) {
-    /* Step 1. Spectrum to XYZ */
-    float xyz[3] = { 0 };
+// Weights of every wavelength image when converting spectra to XYZ.
+// Without interpolation, they are color matching functions at these wavelengths. Otherwise the spectrum of a pixel
+// is interpolated between wavelengths, held constant beyond the ends, and integrated in 1nm steps over the range
+// the wavelengths cover, i.e. to half a spacing beyond each end. Interpolation is linear in images, so it comes
+// down to one weight per wavelength. Weights are scaled by wavelength number / range, which keeps the brightness
+// the same as without interpolation for densely sampled wavelengths.
+void SpectrumRenderer::GetCmfWeights(size_t wavelength_number, const float* wavelengths, float* cmf) const {
+  auto interpolation = context_->GetSpectrumInterpolation();
+  if (interpolation == SpectrumInterpolation::kNone || wavelength_number < 2) {
     for (decltype(wavelength_number) j = 0; j < wavelength_number; j++) {
-      auto wl = static_cast<int>(wavelengths[j]);
-      float v = wl >= kMinWavelength && wl <= kMaxWaveLength ? spec_data[j*data_number + i] : 0.0f;
-      xyz[0] += kCmfX[wl - kMinWavelength] * v;
-      xyz[1] += kCmfY[wl - kMinWavelength] * v;
-      xyz[2] += kCmfZ[wl - kMinWavelength] * v;
+      ColorMatchingFunction::Get(static_cast<int>(wavelengths[j]), cmf + j * 3);
     }
+    return;
+  }
 
-    /* Step 2. XYZ to linear RGB */
-    float gray[3];
-    for (int j = 0; j < 3; j++) {
-      gray[j] = kWhitePointD65[j] * xyz[1];
-    }
+  auto coord = [interpolation](float wl) {
+    return interpolation == SpectrumInterpolation::kDispersion ? IceRefractiveIndex::n(wl) : wl;
+  };
+  std::vector<size_t> order(wavelength_number);
+  for (size_t j = 0; j < wavelength_number; j++) {
+    order[j] = j;
+  }
+  std::sort(order.begin(), order.end(), [wavelengths](size_t a, size_t b) { return wavelengths[a] < wavelengths[b]; });
+  std::vector<float> sorted_wl(wavelength_number);
+  std::vector<float> sorted_x(wavelength_number);
+  for (size_t k = 0; k < wavelength_number; k++) {
+    sorted_wl[k] = wavelengths[order[k]];
+    sorted_x[k] = coord(sorted_wl[k]);
+  }
 
-    float r = 1.0f;
-    for (int j = 0; j < 3; j++) {
-      float a = 0, b = 0;
-      for (int k = 0; k < 3; k++) {
-        a += -gray[k] * kXyzToRgb[j*3 + k];
-        b += (xyz[k] - gray[k]) * kXyzToRgb[j*3 + k];
-      }
-      if (a * b > 0 && a / b < r) {
-        r = a / b;
-      }
+  auto last = wavelength_number - 1;
+  auto wl_start = static_cast<int>(std::round(sorted_wl[0] - (sorted_wl[1] - sorted_wl[0]) / 2));
+  auto wl_end = static_cast<int>(std::round(sorted_wl[last] + (sorted_wl[last] - sorted_wl[last - 1]) / 2));
+  wl_start = std::max(wl_start, kMinWavelength);
+  wl_end = std::min(wl_end, kMaxWaveLength);
+
+  std::fill(cmf, cmf + wavelength_number * 3, 0.0f);
+  size_t k = 0;     // Interpolating between sorted wavelengths k and k + 1
+  for (int wl = wl_start; wl <= wl_end; wl++) {
+    while (k + 2 < wavelength_number && sorted_wl[k + 1] < wl) {
+      k++;
     }
+    float t = (coord(wl) - sorted_x[k]) / (sorted_x[k + 1] - sorted_x[k]);
+    t = std::min(std::max(t, 0.0f), 1.0f);
 
-    float rgb[3] = { 0 };
-    for (int j = 0; j < 3; j++) {
-      xyz[j] = (xyz[j] - gray[j]) * r + gray[j];
-    }
-    for (int j = 0; j < 3; j++) {
-      for (int k = 0; k < 3; k++) {
-        rgb[j] += xyz[k] * kXyzToRgb[j*3 + k];
-      }
-      rgb[j] = std::min(std::max(rgb[j], 0.0f), 1.0f);
+    float v[3];
+    ColorMatchingFunction::Get(wl, v);
+    for (int c = 0; c < 3; c++) {
+      cmf[order[k] * 3 + c] += (1 - t) * v[c];
+      cmf[order[k + 1] * 3 + c] += t * v[c];
     }
+  }
 
-    /* Step 3. Convert linear sRGB to sRGB */
-    SrgbGamma(rgb);
-    for (int j = 0; j < 3; j++) {
-      rgb_data[i * 3 + j] = static_cast<uint8_t>(rgb[j] * 255);
-    }
+  float scale = static_cast<float>(wavelength_number) / (wl_end - wl_start + 1);
+  for (size_t i = 0; i < wavelength_number * 3; i++) {
+    cmf[i] *= scale;
   }
 }
 
 
-void SpectrumRenderer::Gray(size_t wavelength_number, size_t data_number,
-                            const float* wavelengths, const float* spec_data,
-                            uint8_t* rgb_data) {
-  for (decltype(data_number) i = 0; i < data_number; i++) {
-    /* Step 1. Spectrum to XYZ */
-    float xyz[3] = { 0 };
-    for (decltype(wavelength_number) j = 0; j < wavelength_number; j++) {
-      auto wl = static_cast<int>(wavelengths[j]);
-      float v = wl >= kMinWavelength && wl <= kMaxWaveLength ? spec_data[j*data_number + i] : 0.0f;
-      xyz[0] += kCmfX[wl - kMinWavelength] * v;
-      xyz[1] += kCmfY[wl - kMinWavelength] * v;
-      xyz[2] += kCmfZ[wl - kMinWavelength] * v;
+// Step 1. Spectrum to XYZ, for pixels in [offset, offset + num).
+// Wavelengths are in the outer loop so spectrum data are read contiguously, 8 pixels at a time.
+void SpectrumRenderer::SpectrumToXyz(size_t wavelength_number, size_t data_number,
+                                     const float* cmf, const float* spec_data,
+                                     size_t offset, size_t num, float* xyz) {
+  float* x = xyz;
+  float* y = xyz + num;
+  float* z = xyz + num * 2;
+  for (size_t i = 0; i < num * 3; i++) {
+    xyz[i] = 0;
+  }
+
+  for (decltype(wavelength_number) j = 0; j < wavelength_number; j++) {
+    const float* v = spec_data + j * data_number + offset;
+    size_t i = 0;
+#if defined(__AVX__)
+    __m256 cx = _mm256_set1_ps(cmf[j * 3 + 0]);
+    __m256 cy = _mm256_set1_ps(cmf[j * 3 + 1]);
+    __m256 cz = _mm256_set1_ps(cmf[j * 3 + 2]);
+    for (; i + 8 <= num; i += 8) {
+      __m256 v8 = _mm256_loadu_ps(v + i);
+      _mm256_storeu_ps(x + i, _mm256_add_ps(_mm256_loadu_ps(x + i), _mm256_mul_ps(cx, v8)));
+      _mm256_storeu_ps(y + i, _mm256_add_ps(_mm256_loadu_ps(y + i), _mm256_mul_ps(cy, v8)));
+      _mm256_storeu_ps(z + i, _mm256_add_ps(_mm256_loadu_ps(z + i), _mm256_mul_ps(cz, v8)));
+    }
+#endif
+    for (; i < num; i++) {
+      x[i] += cmf[j * 3 + 0] * v[i];
+      y[i] += cmf[j * 3 + 1] * v[i];
+      z[i] += cmf[j * 3 + 2] * v[i];
     }
+  }
+}
 
-    /* Step 2. XYZ to linear RGB */
-    float gray[3];
-    for (int j = 0; j < 3; j++) {
-      gray[j] = kWhitePointD65[j] * xyz[1];
+
+// Convert one XYZ value to sRGB. Colors out of gamut are desaturated towards the gray of the same Y.
+void SpectrumRenderer::XyzToRgb(float* xyz, uint8_t* rgb_data) {
+  /* Step 2. XYZ to linear RGB */
+  float gray[3];
+  for (int j = 0; j < 3; j++) {
+    gray[j] = kWhitePointD65[j] * xyz[1];
+  }
+
+  float r = 1.0f;
+  for (int j = 0; j < 3; j++) {
+    float a = 0, b = 0;
+    for (int k = 0; k < 3; k++) {
+      a += -gray[k] * kXyzToRgb[j*3 + k];
+      b += (xyz[k] - gray[k]) * kXyzToRgb[j*3 + k];
     }
+    if (a * b > 0 && a / b < r) {
+      r = a / b;
+    }
+  }
 
-    float rgb[3] = { 0 };
-    for (int j = 0; j < 3; j++) {
-      for (int k = 0; k < 3; k++) {
-        rgb[j] += gray[k] * kXyzToRgb[j*3 + k];
-      }
-      rgb[j] = std::min(std::max(rgb[j], 0.0f), 1.0f);
+  float rgb[3] = { 0 };
+  for (int j = 0; j < 3; j++) {
+    xyz[j] = (xyz[j] - gray[j]) * r + gray[j];
+  }
+  for (int j = 0; j < 3; j++) {
+    for (int k = 0; k < 3; k++) {
+      rgb[j] += xyz[k] * kXyzToRgb[j*3 + k];
     }
+    rgb[j] = std::min(std::max(rgb[j], 0.0f), 1.0f);
+  }
 
-    /* Step 3. Convert linear sRGB to sRGB */
-    SrgbGamma(rgb);
-    for (int j = 0; j < 3; j++) {
-      rgb_data[i * 3 + j] = static_cast<uint8_t>(rgb[j] * 255);
+  /* Step 3. Convert linear sRGB to sRGB */
+  for (int j = 0; j < 3; j++) {
+    rgb_data[j] = SrgbGamma8(rgb[j]);
+  }
+}
+
+
+// Convert one XYZ value to gray sRGB. Only Y is used.
+void SpectrumRenderer::XyzToGray(const float* xyz, uint8_t* rgb_data) {
+  /* Step 2. XYZ to linear RGB */
+  float gray[3];
+  for (int j = 0; j < 3; j++) {
+    gray[j] = kWhitePointD65[j] * xyz[1];
+  }
+
+  float rgb[3] = { 0 };
+  for (int j = 0; j < 3; j++) {
+    for (int k = 0; k < 3; k++) {
+      rgb[j] += gray[k] * kXyzToRgb[j*3 + k];
     }
+    rgb[j] = std::min(std::max(rgb[j], 0.0f), 1.0f);
+  }
+
+  /* Step 3. Convert linear sRGB to sRGB */
+  for (int j = 0; j < 3; j++) {
+    rgb_data[j] = SrgbGamma8(rgb[j]);
   }
 }
 
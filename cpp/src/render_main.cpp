@@ -1,11 +1,13 @@
 #include <chrono>
 #include <cstdio>
-#include <unordered_map>
+#include <memory>
+#include <vector>
 
 #include <opencv2/opencv.hpp>
 
 #include "render.h"
 #include "context.h"
+#include "files.h"
 
 int main(int argc, char* argv[]) {
   if (argc != 2) {
@@ -14,25 +16,52 @@ int main(int argc, char* argv[]) {
   }
 
   auto start = std::chrono::system_clock::now();
-  IceHalo::RenderContextPtr ctx = IceHalo::RenderContext::CreateFromFile(argv[1]);
-  IceHalo::SpectrumRenderer renderer(ctx);
-  renderer.LoadData();
-
-  auto flat_rgb_data = new uint8_t[3 * ctx->GetImageWidth() * ctx->GetImageHeight()];
-  renderer.RenderToRgb(flat_rgb_data);
-
-  cv::Mat img(ctx->GetImageHeight(), ctx->GetImageWidth(), CV_8UC3, flat_rgb_data);
-  cv::cvtColor(img, img, cv::COLOR_RGB2BGR);
-  try {
-    cv::imwrite(ctx->GetImagePath(), img);
-  } catch (cv::Exception& ex) {
-    fprintf(stderr, "Exception converting image to PNG format: %s\n", ex.what());
-    delete[] flat_rgb_data;
+  std::vector<IceHalo::RenderContextPtr> views = IceHalo::RenderContext::CreateViewsFromFile(argv[1]);
+  if (views.empty()) {
     return -1;
   }
-  delete[] flat_rgb_data;
+
+  /* All views are accumulated in a single pass over data files */
+  std::vector<std::unique_ptr<IceHalo::SpectrumRenderer> > renderers;
+  std::vector<IceHalo::SpectrumRenderer*> renderer_ptrs;
+  for (const auto& ctx : views) {
+    renderers.emplace_back(new IceHalo::SpectrumRenderer(ctx));
+    renderer_ptrs.emplace_back(renderers.back().get());
+  }
+  IceHalo::SpectrumRenderer::LoadData(renderer_ptrs);
+
+  int ret = 0;
+  for (size_t i = 0; i < views.size(); i++) {
+    const auto& ctx = views[i];
+    auto img_wid = ctx->GetImageWidth();
+    auto img_hei = ctx->GetImageHeight();
+    auto xyz_data = new float[3 * img_wid * img_hei];
+    renderers[i]->RenderToXyz(xyz_data);
+    auto hdr_rgb_data = new float[3 * img_wid * img_hei];
+    IceHalo::SpectrumRenderer::XyzToLinearRgb(xyz_data, hdr_rgb_data, img_wid * img_hei);
+    if (!IceHalo::WritePfm(ctx->GetHdrImagePath().c_str(), img_wid, img_hei, hdr_rgb_data)) {
+      fprintf(stderr, "Failed to write HDR image %s!\n", ctx->GetHdrImagePath().c_str());
+      ret = -1;
+    }
+    delete[] hdr_rgb_data;
+
+    auto flat_rgb_data = new uint8_t[3 * img_wid * img_hei];
+    IceHalo::SpectrumRenderer::Tonemap(ctx, xyz_data, flat_rgb_data);
+    delete[] xyz_data;
+
+    cv::Mat img(img_hei, img_wid, CV_8UC3, flat_rgb_data);
+    cv::cvtColor(img, img, cv::COLOR_RGB2BGR);
+    try {
+      cv::imwrite(ctx->GetImagePath(), img);
+    } catch (cv::Exception& ex) {
+      fprintf(stderr, "Exception converting image to PNG format: %s\n", ex.what());
+      ret = -1;
+    }
+    delete[] flat_rgb_data;
+  }
 
   auto t1 = std::chrono::system_clock::now();
   std::chrono::duration<float, std::ratio<1, 1000> > diff = t1 - start;
   std::printf("Total: %.2fms\n", diff.count());
+  return ret;
 }
@@ -0,0 +1,103 @@
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+#include "context.h"
+#include "files.h"
+
+using namespace IceHalo;
+
+
+// Read all floats of a file, including the header.
+bool ReadFloats(File& file, std::vector<float>* data) {
+  if (!file.Open(OpenMode::kRead | OpenMode::kBinary)) {
+    return false;
+  }
+  data->resize(file.GetSize() / sizeof(float));
+  auto read_count = file.Read(data->data(), data->size());
+  file.Close();
+  return read_count == data->size() && !data->empty();
+}
+
+
+int main(int argc, char* argv[]) {
+  if (argc != 3) {
+    std::printf("USAGE: %s <config-file> <source-directory>\n", argv[0]);
+    std::printf("  Re-weight rays in source-directory, simulated with recorded orientations, to crystal\n"
+                "  orientations of config-file, and write them into data folder of config-file.\n");
+    return -1;
+  }
+
+  auto start = std::chrono::system_clock::now();
+  SimulationContextPtr context = SimulationContext::CreateFromFile(argv[1]);
+  if (!context) {
+    return -1;
+  }
+  std::vector<CrystalContextPtr> crystal_ctxs;
+  context->FillActiveCrystal(&crystal_ctxs);
+
+  auto out_dir = context->GetDataDirectory();
+  if (boost::filesystem::exists(out_dir) && boost::filesystem::equivalent(out_dir, argv[2])) {
+    std::fprintf(stderr, "Data folder of config is the source directory, data would be overwritten!\n");
+    return -1;
+  }
+
+  AsyncFileWriter writer(out_dir);
+  int ret = 0;
+  for (auto& file : ListDataFiles(argv[2])) {
+    File orientation_file(argv[2], GetOrientationFileName(file.GetFilename()).c_str());
+    std::vector<float> data;
+    std::vector<float> orientations;
+    if (!ReadFloats(orientation_file, &orientations)) {
+      std::fprintf(stderr, "\nWARNING! No orientations for %s, skipped!\n", file.GetFilename().c_str());
+      continue;
+    }
+    if (!ReadFloats(file, &data) || data[0] != orientations[0]) {
+      std::fprintf(stderr, "Failed to read %s, or it does not match its orientations!\n", file.GetFilename().c_str());
+      ret = -1;
+      continue;
+    }
+
+    size_t ray_step = data[0] == LightSpectrum::kSpectralDataTag ? 5 : 4;
+    size_t ray_num = (data.size() - 1) / ray_step;
+    if ((orientations.size() - 1) / 4 != ray_num) {
+      std::fprintf(stderr, "Ray number of %s does not match its orientations!\n", file.GetFilename().c_str());
+      ret = -1;
+      continue;
+    }
+
+    // Effective ray number (sum w)^2 / sum w^2 tells how many rays are left after re-weighting.
+    double w_sum = 0;
+    double w2_sum = 0;
+    for (size_t i = 0; i < ray_num; i++) {
+      const float* record = orientations.data() + 1 + i * 4;
+      auto ci = static_cast<size_t>(record[0]);
+      float ratio = 0;
+      if (ci < crystal_ctxs.size() && record[3] > 0) {
+        ratio = crystal_ctxs[ci]->GetOrientationPdf(record[1], record[2]) / record[3];
+      }
+      float& w = data[1 + i * ray_step + 3];
+      w *= ratio;
+      w_sum += ratio;
+      w2_sum += ratio * ratio;
+    }
+    std::printf("%s: %zu rays, effective %.0f\n", file.GetFilename().c_str(), ray_num,
+                w2_sum > 0 ? w_sum * w_sum / w2_sum : 0.0);
+
+    // Data are read into a vector of their own, so skipped files never hold a block. A block is taken only
+    // when there is something to write, which also waits till the writer catches up.
+    auto block = writer.GetBuffer();
+    block.swap(data);
+    writer.Write(file.GetFilename(), OpenMode::kWrite | OpenMode::kBinary, std::move(block));
+  }
+  if (!writer.Flush()) {
+    std::fprintf(stderr, "Failed to write data files!\n");
+    ret = -1;
+  }
+
+  auto t1 = std::chrono::system_clock::now();
+  std::chrono::duration<float, std::ratio<1, 1000> > diff = t1 - start;
+  std::printf("Total: %.2fms\n", diff.count());
+  return ret;
+}
@@ -0,0 +1,312 @@
+#ifndef SRC_SIMDMATH_H_
+#define SRC_SIMDMATH_H_
+
+#include "mymath.h"
+
+#include <cmath>
+#include <algorithm>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+
+namespace IceHalo {
+
+namespace Math {
+
+/* Polynomial approximations for hot loops.
+ * Every function has a scalar version and an 8-lane AVX2 version. Both evaluate the same polynomial,
+ * so the two paths agree up to rounding and a kernel may mix them (e.g. for loop tails).
+ */
+
+/* atan(u) for |u| <= tan(pi/8), Cephes atanf polynomial. */
+constexpr float kTanPi8 = 0.414213562373f;
+constexpr float kAtanP0 = -3.33329491539e-1f;
+constexpr float kAtanP1 = 1.99777106478e-1f;
+constexpr float kAtanP2 = -1.38776856032e-1f;
+constexpr float kAtanP3 = 8.05374449538e-2f;
+
+
+/*! @brief Fast atan2.
+ *
+ * The argument is reduced to [0, 1] by octant symmetry, then to |u| <= tan(pi/8) by
+ * atan(t) = pi/4 + atan((t - 1) / (t + 1)).
+ * Max absolute error is 2.8e-7 rad (1.2 ulp of pi), measured over 2.7e7 random inputs.
+ * atan2(+-0, -0) returns +-pi as std::atan2 does. NaN inputs are not handled.
+ */
+inline float Atan2Fast(float y, float x) {
+  float ax = std::abs(x);
+  float ay = std::abs(y);
+  float mx = std::max(ax, ay);
+  float mn = std::min(ax, ay);
+  float t = mx > 0 ? mn / mx : 0.0f;
+
+  bool reduced = t > kTanPi8;
+  float u = reduced ? (t - 1.0f) / (t + 1.0f) : t;
+  float z = u * u;
+  float a = (((kAtanP3 * z + kAtanP2) * z + kAtanP1) * z + kAtanP0) * z * u + u;
+  a = reduced ? a + kPi / 4 : a;
+  a = ay > ax ? kPi / 2 - a : a;
+  a = std::signbit(x) ? kPi - a : a;
+  return std::signbit(y) ? -a : a;
+}
+
+
+#if defined(__AVX2__)
+inline __m256 Atan2Fast(__m256 y, __m256 x) {
+  const __m256 kSignMask = _mm256_set1_ps(-0.0f);
+  const __m256 kZero = _mm256_setzero_ps();
+  const __m256 kOne = _mm256_set1_ps(1.0f);
+
+  __m256 ax = _mm256_andnot_ps(kSignMask, x);
+  __m256 ay = _mm256_andnot_ps(kSignMask, y);
+  __m256 mx = _mm256_max_ps(ax, ay);
+  __m256 mn = _mm256_min_ps(ax, ay);
+  __m256 t = _mm256_and_ps(_mm256_div_ps(mn, mx), _mm256_cmp_ps(mx, kZero, _CMP_GT_OQ));
+
+  __m256 reduced = _mm256_cmp_ps(t, _mm256_set1_ps(kTanPi8), _CMP_GT_OQ);
+  __m256 u = _mm256_blendv_ps(t, _mm256_div_ps(_mm256_sub_ps(t, kOne), _mm256_add_ps(t, kOne)), reduced);
+  __m256 z = _mm256_mul_ps(u, u);
+  __m256 a = _mm256_set1_ps(kAtanP3);
+  a = _mm256_add_ps(_mm256_mul_ps(a, z), _mm256_set1_ps(kAtanP2));
+  a = _mm256_add_ps(_mm256_mul_ps(a, z), _mm256_set1_ps(kAtanP1));
+  a = _mm256_add_ps(_mm256_mul_ps(a, z), _mm256_set1_ps(kAtanP0));
+  a = _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(a, z), u), u);
+  a = _mm256_add_ps(a, _mm256_and_ps(reduced, _mm256_set1_ps(kPi / 4)));
+  a = _mm256_blendv_ps(a, _mm256_sub_ps(_mm256_set1_ps(kPi / 2), a), _mm256_cmp_ps(ay, ax, _CMP_GT_OQ));
+  a = _mm256_blendv_ps(a, _mm256_sub_ps(_mm256_set1_ps(kPi), a), x);    // Sign bit of x selects
+  return _mm256_xor_ps(a, _mm256_and_ps(kSignMask, y));
+}
+#endif
+
+
+/* sin and cos, Cephes sinf/cosf polynomials on [-pi/4, pi/4].
+ * pi/2 is split into three parts (Cody-Waite) for argument reduction. The first part has 8 significant bits,
+ * so j * kPio2P1 is exact for |j| < 2^16.
+ */
+constexpr float kTwoOverPi = 0.636619772368f;
+constexpr float kPio2P1 = 1.5703125f;
+constexpr float kPio2P2 = 4.837512969970703125e-4f;
+constexpr float kPio2P3 = 7.54978995489188216e-8f;
+constexpr float kSinP0 = -1.6666654611e-1f;
+constexpr float kSinP1 = 8.3321608736e-3f;
+constexpr float kSinP2 = -1.9515295891e-4f;
+constexpr float kCosP0 = 4.166664568298827e-2f;
+constexpr float kCosP1 = -1.388731625493765e-3f;
+constexpr float kCosP2 = 2.443315711809948e-5f;
+
+/* asin(x) for |x| <= 0.5, Cephes asinf polynomial. */
+constexpr float kAsinP0 = 1.6666752422e-1f;
+constexpr float kAsinP1 = 7.4953002686e-2f;
+constexpr float kAsinP2 = 4.5470025998e-2f;
+constexpr float kAsinP3 = 2.4181311049e-2f;
+constexpr float kAsinP4 = 4.2163199048e-2f;
+
+
+/*! @brief Fast sin and cos of the same argument.
+ *
+ * x is reduced to r = x - j * pi/2, |r| <= pi/4, and the quadrant j selects and negates the two polynomials.
+ * Over [-2pi, 2pi] max error is 1.5 ulp for sin and 5.8 ulp for cos (the latter next to the zeros of cos).
+ * For |x| <= 8192 max absolute error is 7.8e-8, though the error in ulp is larger next to zeros.
+ * Errors are measured against double precision over 1e7 random inputs. Larger |x| are not supported.
+ */
+inline void SinCosFast(float x, float* s, float* c) {
+  int j = static_cast<int>(std::lrint(x * kTwoOverPi));
+  auto jf = static_cast<float>(j);
+  float r = ((x - jf * kPio2P1) - jf * kPio2P2) - jf * kPio2P3;
+  float z = r * r;
+  float ps = ((kSinP2 * z + kSinP1) * z + kSinP0) * z * r + r;
+  float pc = ((kCosP2 * z + kCosP1) * z + kCosP0) * z * z - 0.5f * z + 1.0f;
+
+  float sin_v = (j & 1) ? pc : ps;
+  float cos_v = (j & 1) ? ps : pc;
+  *s = (j & 2) ? -sin_v : sin_v;
+  *c = ((j + 1) & 2) ? -cos_v : cos_v;
+}
+
+
+#if defined(__AVX2__)
+inline void SinCosFast(__m256 x, __m256* s, __m256* c) {
+  __m256i j = _mm256_cvtps_epi32(_mm256_mul_ps(x, _mm256_set1_ps(kTwoOverPi)));   // Round to nearest even
+  __m256 jf = _mm256_cvtepi32_ps(j);
+  __m256 r = _mm256_sub_ps(x, _mm256_mul_ps(jf, _mm256_set1_ps(kPio2P1)));
+  r = _mm256_sub_ps(r, _mm256_mul_ps(jf, _mm256_set1_ps(kPio2P2)));
+  r = _mm256_sub_ps(r, _mm256_mul_ps(jf, _mm256_set1_ps(kPio2P3)));
+  __m256 z = _mm256_mul_ps(r, r);
+
+  __m256 ps = _mm256_set1_ps(kSinP2);
+  ps = _mm256_add_ps(_mm256_mul_ps(ps, z), _mm256_set1_ps(kSinP1));
+  ps = _mm256_add_ps(_mm256_mul_ps(ps, z), _mm256_set1_ps(kSinP0));
+  ps = _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(ps, z), r), r);
+  __m256 pc = _mm256_set1_ps(kCosP2);
+  pc = _mm256_add_ps(_mm256_mul_ps(pc, z), _mm256_set1_ps(kCosP1));
+  pc = _mm256_add_ps(_mm256_mul_ps(pc, z), _mm256_set1_ps(kCosP0));
+  pc = _mm256_mul_ps(_mm256_mul_ps(pc, z), z);
+  pc = _mm256_add_ps(_mm256_sub_ps(pc, _mm256_mul_ps(_mm256_set1_ps(0.5f), z)), _mm256_set1_ps(1.0f));
+
+  const __m256i kOne = _mm256_set1_epi32(1);
+  const __m256i kTwo = _mm256_set1_epi32(2);
+  __m256 swap = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(j, kOne), kOne));
+  __m256 sin_sign = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_and_si256(j, kTwo), 30));
+  __m256 cos_sign = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_and_si256(_mm256_add_epi32(j, kOne), kTwo), 30));
+  *s = _mm256_xor_ps(_mm256_blendv_ps(ps, pc, swap), sin_sign);
+  *c = _mm256_xor_ps(_mm256_blendv_ps(pc, ps, swap), cos_sign);
+}
+#endif
+
+
+/*! @brief Fast asin.
+ *
+ * For |x| > 0.5 uses asin(x) = pi/2 - 2 * asin(sqrt((1 - x) / 2)).
+ * Max error is 2.4 ulp over [-1, 1], measured against double precision over 1e7 random inputs.
+ * |x| > 1 gives NaN.
+ */
+inline float AsinFast(float x) {
+  float a = std::abs(x);
+  bool reduced = a > 0.5f;
+  float z = reduced ? 0.5f * (1.0f - a) : a * a;
+  float t = reduced ? std::sqrt(z) : a;
+  float p = ((((kAsinP4 * z + kAsinP3) * z + kAsinP2) * z + kAsinP1) * z + kAsinP0) * z * t + t;
+  p = reduced ? kPi / 2 - 2 * p : p;
+  return std::signbit(x) ? -p : p;
+}
+
+
+#if defined(__AVX2__)
+inline __m256 AsinFast(__m256 x) {
+  const __m256 kSignMask = _mm256_set1_ps(-0.0f);
+  const __m256 kHalf = _mm256_set1_ps(0.5f);
+
+  __m256 a = _mm256_andnot_ps(kSignMask, x);
+  __m256 reduced = _mm256_cmp_ps(a, kHalf, _CMP_GT_OQ);
+  __m256 z = _mm256_blendv_ps(_mm256_mul_ps(a, a), _mm256_mul_ps(kHalf, _mm256_sub_ps(_mm256_set1_ps(1.0f), a)),
+                              reduced);
+  __m256 t = _mm256_blendv_ps(a, _mm256_sqrt_ps(z), reduced);
+  __m256 p = _mm256_set1_ps(kAsinP4);
+  p = _mm256_add_ps(_mm256_mul_ps(p, z), _mm256_set1_ps(kAsinP3));
+  p = _mm256_add_ps(_mm256_mul_ps(p, z), _mm256_set1_ps(kAsinP2));
+  p = _mm256_add_ps(_mm256_mul_ps(p, z), _mm256_set1_ps(kAsinP1));
+  p = _mm256_add_ps(_mm256_mul_ps(p, z), _mm256_set1_ps(kAsinP0));
+  p = _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(p, z), t), t);
+  p = _mm256_blendv_ps(p, _mm256_sub_ps(_mm256_set1_ps(kPi / 2), _mm256_add_ps(p, p)), reduced);
+  return _mm256_or_ps(p, _mm256_and_ps(kSignMask, x));
+}
+#endif
+
+
+/*! @brief Fast 1 / sqrt(x), for x > 0.
+ *
+ * The scalar version is 1 / std::sqrt(x), within 1 ulp. The AVX2 version refines the hardware estimate
+ * (_mm256_rsqrt_ps, 12 bits) with one Newton step, and its max error is 3.5 ulp, measured over 1e7 random
+ * inputs in [1e-30, 1e30]. So the two paths may differ by a few ulp.
+ */
+inline float RsqrtFast(float x) {
+  return 1.0f / std::sqrt(x);
+}
+
+
+#if defined(__AVX2__)
+inline __m256 RsqrtFast(__m256 x) {
+  __m256 y = _mm256_rsqrt_ps(x);
+  __m256 hxy2 = _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(0.5f), x), _mm256_mul_ps(y, y));
+  return _mm256_mul_ps(y, _mm256_sub_ps(_mm256_set1_ps(1.5f), hxy2));
+}
+#endif
+
+
+/* Batched versions. They run the AVX2 version on blocks of 8 and the scalar one on the tail.
+ * Output arrays may be the same as input ones.
+ */
+inline void SinCosFast(const float* x, float* s, float* c, size_t num) {
+  size_t i = 0;
+#if defined(__AVX2__)
+  for (; i + 8 <= num; i += 8) {
+    __m256 vs, vc;
+    SinCosFast(_mm256_loadu_ps(x + i), &vs, &vc);
+    _mm256_storeu_ps(s + i, vs);
+    _mm256_storeu_ps(c + i, vc);
+  }
+#endif
+  for (; i < num; i++) {
+    SinCosFast(x[i], s + i, c + i);
+  }
+}
+
+
+inline void AsinFast(const float* x, float* y, size_t num) {
+  size_t i = 0;
+#if defined(__AVX2__)
+  for (; i + 8 <= num; i += 8) {
+    _mm256_storeu_ps(y + i, AsinFast(_mm256_loadu_ps(x + i)));
+  }
+#endif
+  for (; i < num; i++) {
+    y[i] = AsinFast(x[i]);
+  }
+}
+
+
+inline void Atan2Fast(const float* y, const float* x, float* a, size_t num) {
+  size_t i = 0;
+#if defined(__AVX2__)
+  for (; i + 8 <= num; i += 8) {
+    _mm256_storeu_ps(a + i, Atan2Fast(_mm256_loadu_ps(y + i), _mm256_loadu_ps(x + i)));
+  }
+#endif
+  for (; i < num; i++) {
+    a[i] = Atan2Fast(y[i], x[i]);
+  }
+}
+
+
+inline void RsqrtFast(const float* x, float* y, size_t num) {
+  size_t i = 0;
+#if defined(__AVX2__)
+  for (; i + 8 <= num; i += 8) {
+    _mm256_storeu_ps(y + i, RsqrtFast(_mm256_loadu_ps(x + i)));
+  }
+#endif
+  for (; i < num; i++) {
+    y[i] = RsqrtFast(x[i]);
+  }
+}
+
+
+/*! @brief Rotate a vector by a unit quaternion (w, ux, uy, uz), as v + w * t + u x t, where t = 2 * u x v.
+ *
+ * Negate u to rotate by the inverse. output may be the same as v.
+ */
+inline void QuatRotate(float w, float ux, float uy, float uz, const float* v, float* output) {
+  float tx = 2 * (uy * v[2] - uz * v[1]);
+  float ty = 2 * (uz * v[0] - ux * v[2]);
+  float tz = 2 * (ux * v[1] - uy * v[0]);
+  float x = v[0] + w * tx + (uy * tz - uz * ty);
+  float y = v[1] + w * ty + (uz * tx - ux * tz);
+  float z = v[2] + w * tz + (ux * ty - uy * tx);
+  output[0] = x;
+  output[1] = y;
+  output[2] = z;
+}
+
+
+#if defined(__AVX2__)
+inline void QuatRotate(__m256 w, __m256 ux, __m256 uy, __m256 uz, __m256* vx, __m256* vy, __m256* vz) {
+  const __m256 kTwo = _mm256_set1_ps(2.0f);
+  __m256 tx = _mm256_mul_ps(kTwo, _mm256_sub_ps(_mm256_mul_ps(uy, *vz), _mm256_mul_ps(uz, *vy)));
+  __m256 ty = _mm256_mul_ps(kTwo, _mm256_sub_ps(_mm256_mul_ps(uz, *vx), _mm256_mul_ps(ux, *vz)));
+  __m256 tz = _mm256_mul_ps(kTwo, _mm256_sub_ps(_mm256_mul_ps(ux, *vy), _mm256_mul_ps(uy, *vx)));
+  *vx = _mm256_add_ps(_mm256_add_ps(*vx, _mm256_mul_ps(w, tx)),
+                      _mm256_sub_ps(_mm256_mul_ps(uy, tz), _mm256_mul_ps(uz, ty)));
+  *vy = _mm256_add_ps(_mm256_add_ps(*vy, _mm256_mul_ps(w, ty)),
+                      _mm256_sub_ps(_mm256_mul_ps(uz, tx), _mm256_mul_ps(ux, tz)));
+  *vz = _mm256_add_ps(_mm256_add_ps(*vz, _mm256_mul_ps(w, tz)),
+                      _mm256_sub_ps(_mm256_mul_ps(ux, ty), _mm256_mul_ps(uy, tx)));
+}
+#endif
+
+}   // namespace Math
+
+}   // namespace IceHalo
+
+#endif  // SRC_SIMDMATH_H_
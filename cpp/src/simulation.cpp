@@ -2,13 +2,18 @@
 #include "mymath.h"
 #include "threadingpool.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
 #include <stack>
 #include <cstdio>
+#include <unordered_map>
 
 namespace IceHalo {
 
 SimulationBufferData::SimulationBufferData()
-    : pt{nullptr}, dir{nullptr}, w{nullptr}, face_id{nullptr}, ray_seg{nullptr}, ray_num(0) {}
+    : pt{nullptr}, dir{nullptr}, w{nullptr}, n{nullptr}, face_id{nullptr}, ray_seg{nullptr}, ray_num(0) {}
 
 
 SimulationBufferData::~SimulationBufferData() {
@@ -28,12 +33,14 @@ void SimulationBufferData::DeleteBuffer(int idx) {
   delete[] pt[idx];
   delete[] dir[idx];
   delete[] w[idx];
+  delete[] n[idx];
   delete[] face_id[idx];
   delete[] ray_seg[idx];
 
   pt[idx] = nullptr;
   dir[idx] = nullptr;
   w[idx] = nullptr;
+  n[idx] = nullptr;
   face_id[idx] = nullptr;
   ray_seg[idx] = nullptr;
 }
@@ -44,16 +51,18 @@ void SimulationBufferData::Allocate(size_t ray_num) {
     auto tmp_pt = new float[ray_num * 3];
     auto tmp_dir = new float[ray_num * 3];
     auto tmp_w = new float[ray_num];
+    auto tmp_n = new float[ray_num];
     auto tmp_face_id = new int[ray_num];
     auto tmp_ray_seg = new RaySegment*[ray_num];
 
     if (pt[i]) {
-      size_t n = std::min(this->ray_num, ray_num);
-      std::memcpy(tmp_pt, pt[i], sizeof(float) * 3 * n);
-      std::memcpy(tmp_dir, dir[i], sizeof(float) * 3 * n);
-      std::memcpy(tmp_w, w[i], sizeof(float) * n);
-      std::memcpy(tmp_face_id, face_id[i], sizeof(int) * n);
-      std::memcpy(tmp_ray_seg, ray_seg[i], sizeof(void*) * n);
+      size_t copy_num = std::min(this->ray_num, ray_num);
+      std::memcpy(tmp_pt, pt[i], sizeof(float) * 3 * copy_num);
+      std::memcpy(tmp_dir, dir[i], sizeof(float) * 3 * copy_num);
+      std::memcpy(tmp_w, w[i], sizeof(float) * copy_num);
+      std::memcpy(tmp_n, n[i], sizeof(float) * copy_num);
+      std::memcpy(tmp_face_id, face_id[i], sizeof(int) * copy_num);
+      std::memcpy(tmp_ray_seg, ray_seg[i], sizeof(void*) * copy_num);
 
       DeleteBuffer(i);
     }
@@ -61,6 +70,7 @@ void SimulationBufferData::Allocate(size_t ray_num) {
     pt[i] = tmp_pt;
     dir[i] = tmp_dir;
     w[i] = tmp_w;
+    n[i] = tmp_n;
     face_id[i] = tmp_face_id;
     ray_seg[i] = tmp_ray_seg;
   }
@@ -125,42 +135,722 @@ void EnterRayData::DeleteBuffer() {
 }
 
 
-Simulator::Simulator(const SimulationContextPtr& context)
+EntrySampleData::EntrySampleData()
+    : axis_quat(nullptr), lat_roll(nullptr), dir(nullptr), pt(nullptr), face_id(nullptr), ray_num(0) {}
+
+
+EntrySampleData::~EntrySampleData() {
+  DeleteBuffer();
+}
+
+
+void EntrySampleData::Clean() {
+  DeleteBuffer();
+  ray_num = 0;
+}
+
+
+void EntrySampleData::Allocate(size_t ray_num) {
+  DeleteBuffer();
+
+  axis_quat = new float[ray_num * 4];
+  lat_roll = new float[ray_num * 2];
+  dir = new float[ray_num * 3];
+  pt = new float[ray_num * 3];
+  face_id = new int[ray_num];
+
+  this->ray_num = ray_num;
+}
+
+
+void EntrySampleData::DeleteBuffer() {
+  delete[] axis_quat;
+  delete[] lat_roll;
+  delete[] dir;
+  delete[] pt;
+  delete[] face_id;
+
+  axis_quat = nullptr;
+  lat_roll = nullptr;
+  dir = nullptr;
+  pt = nullptr;
+  face_id = nullptr;
+}
+
+
+namespace {
+
+// FNV-1a
+uint64_t HashBytes(const void* data, size_t size, uint64_t hash = 0xcbf29ce484222325ull) {
+  const auto* p = static_cast<const uint8_t*>(data);
+  for (size_t i = 0; i < size; i++) {
+    hash ^= p[i];
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+
+// Sample entry faces by their projected areas, and entry points on them, for rays of given directions.
+// If u is given, use its uniform numbers instead, num for faces and 2 * num for points.
+void SampleEntryFaces(const CrystalPtr& crystal, size_t num, const float* dir, const float* u,
+                      int* face_id, float* pt) {
+  auto total_faces = crystal->TotalFaces();
+
+  auto* face_area = new float[total_faces];
+  auto* prob = new float[total_faces];
+  auto* face_norm = crystal->GetFaceNorm();
+  auto* face_point = crystal->GetFaceVertex();
+
+  crystal->CopyFaceAreaData(face_area);
+
+  auto sampler = Math::RandomSampler::GetInstance();
+  for (decltype(num) i = 0; i < num; i++) {
+    float sum = 0;
+    for (int k = 0; k < total_faces; k++) {
+      prob[k] = std::max(-Math::Dot3(face_norm + k * 3, dir + i * 3) * face_area[k], 0.0f);
+      sum += prob[k];
+    }
+    for (int k = 0; k < total_faces; k++) {
+      prob[k] /= sum;
+    }
+
+    if (u) {
+      face_id[i] = sampler->SampleInt(prob, total_faces, u[i]);
+    } else {
+      face_id[i] = sampler->SampleInt(prob, total_faces);
+    }
+  }
+  sampler->SampleTriangularPoints(face_point, face_id, pt, num, u ? u + num : nullptr);
+
+  delete[] face_area;
+  delete[] prob;
+}
+
+}  // namespace
+
+
+TransferTable::TransferTable(const CrystalPtr& crystal, float n, int max_recursion_num, float resolution,
+                             int sample_num)
+    : period_(0), entry_dir_(nullptr), exit_offset_(nullptr), exit_dir_(nullptr), exit_w_(nullptr),
+      exit_ray_num_(0) {
+  std::memset(&header_, 0, sizeof(Header));
+  header_.magic = 0x54544849;   // "IHTT"
+  header_.version = 1;
+  header_.crystal_hash = HashBytes(crystal->GetFaceVertex(), sizeof(float) * crystal->TotalFaces() * 9);
+  header_.n = n;
+  header_.max_recursion_num = max_recursion_num;
+  header_.resolution = resolution;
+  header_.sample_num = sample_num;
+  header_.symmetry = crystal->GetRotationalSymmetry();
+
+  period_ = 2 * Math::kPi / header_.symmetry;
+  float res = resolution * Math::kDegreeToRad;
+  auto row_num = std::max(static_cast<int>(std::ceil(Math::kPi / res)), 1);
+  float row_height = Math::kPi / row_num;
+  row_offset_.resize(row_num + 1);
+  row_offset_[0] = 0;
+  for (int i = 0; i < row_num; i++) {
+    float width = period_ * std::sin((i + 0.5f) * row_height);
+    row_offset_[i + 1] = row_offset_[i] + std::max(static_cast<uint32_t>(std::ceil(width / res)), 1u);
+  }
+}
+
+
+TransferTable::~TransferTable() {
+  DeleteBuffer();
+}
+
+
+void TransferTable::DeleteBuffer() {
+  delete[] entry_dir_;
+  delete[] exit_offset_;
+  delete[] exit_dir_;
+  delete[] exit_w_;
+
+  entry_dir_ = nullptr;
+  exit_offset_ = nullptr;
+  exit_dir_ = nullptr;
+  exit_w_ = nullptr;
+  exit_ray_num_ = 0;
+}
+
+
+size_t TransferTable::GetEntryRayNum() const {
+  return static_cast<size_t>(row_offset_.back()) * header_.sample_num;
+}
+
+
+uint32_t TransferTable::GetSeed() const {
+  return static_cast<uint32_t>(HashBytes(&header_, sizeof(Header)));
+}
+
+
+size_t TransferTable::GetMemorySize() const {
+  size_t size = sizeof(TransferTable) + row_offset_.size() * sizeof(uint32_t);
+  if (exit_offset_) {
+    auto entry_num = GetEntryRayNum();
+    size += entry_num * 3 * sizeof(float) + (entry_num + 1) * sizeof(uint32_t) + exit_ray_num_ * 4 * sizeof(float);
+  }
+  return size;
+}
+
+
+// Uniform on the sphere within every bin. Directions are also kept as the incident directions of entry rays.
+void TransferTable::SampleEntryDirections(Math::RandomNumberGenerator* rng, float* dir) {
+  DeleteBuffer();
+  entry_dir_ = new float[GetEntryRayNum() * 3];
+
+  auto row_num = row_offset_.size() - 1;
+  float row_height = Math::kPi / row_num;
+  size_t idx = 0;
+  for (size_t i = 0; i < row_num; i++) {
+    float z0 = std::cos(i * row_height);
+    float z1 = std::cos((i + 1) * row_height);
+    auto bin_num = row_offset_[i + 1] - row_offset_[i];
+    for (uint32_t j = 0; j < bin_num; j++) {
+      for (int k = 0; k < header_.sample_num; k++) {
+        float z = z0 + (z1 - z0) * rng->GetUniform();
+        float phi = (j + rng->GetUniform()) * period_ / bin_num;
+        float r = std::sqrt(std::max(1.0f - z * z, 0.0f));
+        entry_dir_[idx * 3 + 0] = r * std::cos(phi);
+        entry_dir_[idx * 3 + 1] = r * std::sin(phi);
+        entry_dir_[idx * 3 + 2] = z;
+        idx++;
+      }
+    }
+  }
+  std::memcpy(dir, entry_dir_, sizeof(float) * idx * 3);
+}
+
+
+void TransferTable::SetExitRays(const std::vector<uint32_t>& entry_idx, const std::vector<float>& dir,
+                                const std::vector<float>& w) {
+  delete[] exit_offset_;
+  delete[] exit_dir_;
+  delete[] exit_w_;
+
+  auto entry_num = GetEntryRayNum();
+  exit_ray_num_ = entry_idx.size();
+  exit_offset_ = new uint32_t[entry_num + 1];
+  exit_dir_ = new float[exit_ray_num_ * 3];
+  exit_w_ = new float[exit_ray_num_];
+
+  // Counting sort by entry ray
+  std::fill(exit_offset_, exit_offset_ + entry_num + 1, 0);
+  for (auto e : entry_idx) {
+    exit_offset_[e + 1]++;
+  }
+  for (size_t i = 0; i < entry_num; i++) {
+    exit_offset_[i + 1] += exit_offset_[i];
+  }
+  std::vector<uint32_t> next(exit_offset_, exit_offset_ + entry_num);
+  for (size_t i = 0; i < exit_ray_num_; i++) {
+    auto k = next[entry_idx[i]]++;
+    std::memcpy(exit_dir_ + k * 3, dir.data() + i * 3, sizeof(float) * 3);
+    exit_w_[k] = w[i];
+  }
+}
+
+
+size_t TransferTable::Lookup(const float* dir, float u, float* rot) const {
+  auto row_num = static_cast<int>(row_offset_.size() - 1);
+  float theta = std::acos(std::min(std::max(dir[2], -1.0f), 1.0f));
+  auto row = std::min(static_cast<int>(theta / Math::kPi * row_num), row_num - 1);
+
+  // Fold azimuth into [0, period), by k periods
+  float phi = std::atan2(dir[1], dir[0]);
+  if (phi < 0) {
+    phi += 2 * Math::kPi;
+  }
+  auto k = std::min(static_cast<int>(phi / period_), header_.symmetry - 1);
+  phi -= k * period_;
+  auto bin_num = static_cast<int>(row_offset_[row + 1] - row_offset_[row]);
+  auto col = std::min(std::max(static_cast<int>(phi / period_ * bin_num), 0), bin_num - 1);
+
+  auto sample = std::min(static_cast<int>(u * header_.sample_num), header_.sample_num - 1);
+  size_t entry = static_cast<size_t>(row_offset_[row] + col) * header_.sample_num + sample;
+
+  // Folded direction d, and the minimal rotation c from the entry direction e to d
+  float ca = std::cos(k * period_);
+  float sa = std::sin(k * period_);
+  float d[3] = { ca * dir[0] + sa * dir[1], -sa * dir[0] + ca * dir[1], dir[2] };
+  const float* e = entry_dir_ + entry * 3;
+  float v[3];
+  Math::Cross3(e, d, v);
+  float cc = Math::Dot3(e, d);
+  float f = 1.0f / (1.0f + cc);
+  float c[9] = {
+    cc + v[0] * v[0] * f, v[0] * v[1] * f - v[2], v[0] * v[2] * f + v[1],
+    v[1] * v[0] * f + v[2], cc + v[1] * v[1] * f, v[1] * v[2] * f - v[0],
+    v[2] * v[0] * f - v[1], v[2] * v[1] * f + v[0], cc + v[2] * v[2] * f,
+  };
+
+  // Rotate back by k periods
+  for (int j = 0; j < 3; j++) {
+    rot[0 + j] = ca * c[0 + j] - sa * c[3 + j];
+    rot[3 + j] = sa * c[0 + j] + ca * c[3 + j];
+    rot[6 + j] = c[6 + j];
+  }
+  return entry;
+}
+
+
+const uint32_t* TransferTable::GetExitOffset() const {
+  return exit_offset_;
+}
+
+
+const float* TransferTable::GetExitDir() const {
+  return exit_dir_;
+}
+
+
+const float* TransferTable::GetExitW() const {
+  return exit_w_;
+}
+
+
+std::string TransferTable::GetFileName() const {
+  char name[64];
+  std::snprintf(name, sizeof(name), "transfer_%016llx.bin",
+                static_cast<unsigned long long>(HashBytes(&header_, sizeof(Header))));
+  return name;
+}
+
+
+/* Table file layout:
+ *   header, entry ray number, exit ray number,
+ *   entry directions, exit offsets, exit directions, exit weights.
+ */
+bool TransferTable::Load(const char* filename) {
+  File file(filename);
+  if (!file.Open(OpenMode::kRead | OpenMode::kBinary)) {
+    return false;
+  }
+
+  Header header;
+  uint64_t entry_num = 0;
+  uint64_t exit_num = 0;
+  bool valid = file.Read(&header, 1) == 1 && std::memcmp(&header, &header_, sizeof(Header)) == 0 &&
+               file.Read(&entry_num, 1) == 1 && entry_num == GetEntryRayNum() &&
+               file.Read(&exit_num, 1) == 1;
+  if (!valid) {
+    file.Close();
+    return false;
+  }
+
+  DeleteBuffer();
+  entry_dir_ = new float[entry_num * 3];
+  exit_offset_ = new uint32_t[entry_num + 1];
+  exit_dir_ = new float[exit_num * 3];
+  exit_w_ = new float[exit_num];
+  exit_ray_num_ = exit_num;
+  valid = file.Read(entry_dir_, entry_num * 3) == entry_num * 3 &&
+          file.Read(exit_offset_, entry_num + 1) == entry_num + 1 &&
+          exit_offset_[entry_num] == exit_num &&
+          file.Read(exit_dir_, exit_num * 3) == exit_num * 3 &&
+          file.Read(exit_w_, exit_num) == exit_num;
+  file.Close();
+  if (!valid) {
+    DeleteBuffer();
+  }
+  return valid;
+}
+
+
+// The table is written to a temporary file first, and renamed to filename only if all of it is written, so that
+// a failed or interrupted save never leaves a partial table to be loaded later.
+bool TransferTable::Save(const char* filename) const {
+  auto tmp_path = std::string(filename) + ".tmp";
+  File file(tmp_path.c_str());
+  if (!file.Open(OpenMode::kWrite | OpenMode::kBinary)) {
+    return false;
+  }
+
+  auto entry_num = GetEntryRayNum();
+  bool ok = file.Write(header_) == 1;
+  ok = ok && file.Write(static_cast<uint64_t>(entry_num)) == 1;
+  ok = ok && file.Write(static_cast<uint64_t>(exit_ray_num_)) == 1;
+  ok = ok && file.Write(entry_dir_, entry_num * 3) == entry_num * 3;
+  ok = ok && file.Write(exit_offset_, entry_num + 1) == entry_num + 1;
+  ok = ok && file.Write(exit_dir_, exit_ray_num_ * 3) == exit_ray_num_ * 3;
+  ok = ok && file.Write(exit_w_, exit_ray_num_) == exit_ray_num_;
+  ok = file.Close() && ok;
+
+  boost::system::error_code ec;
+  if (ok) {
+    boost::filesystem::rename(tmp_path, filename, ec);
+  }
+  if (!ok || ec) {
+    boost::filesystem::remove(tmp_path, ec);
+    return false;
+  }
+  return true;
+}
+
+
+namespace {
+
+/* Dimensions of the quasi-random sequence, used by an entry ray of the first scattering.
+ * Crystal main axis, which shapes halos most, takes the first two dimensions, whose projection is
+ * best stratified. Dimensions before kDimSun are sampled together with the crystal. */
+enum QuasiRandomDim : int {
+  kDimAxis = 0,         // Crystal main axis, 2 dimensions
+  kDimRoll = 2,
+  kDimFace = 3,         // Entry face
+  kDimEntryPoint = 4,   // Entry point on the face, 2 dimensions
+  kDimSun = 6,          // Position on sun disk, 2 dimensions
+  kDimNum = 8,
+};
+
+static_assert(kDimNum <= Math::SobolSampler::kMaxDim, "Not enough dimensions of quasi-random sequence");
+
+
+/* A ray segment of a companion wavelength that is not built yet. Nodes of one lane are stored in
+ * depth-first order, so a parent always comes before its children. */
+struct CompanionNode {
+  float pt[3];
+  float dir[3];
+  float w;
+  int face_id;
+  int parent;       // -1 for entry rays
+  Ray* root;
+  bool is_finished;
+};
+
+
+/* A companion ray that leaves the path of its hero ray. The ray of node hits face_id at pt, and this
+ * hit is at the given recursion depth. */
+struct CompanionSplit {
+  float pt[3];
+  int face_id;
+  int node;
+  int depth;
+};
+
+
+struct CompanionChunk {
+  std::vector<CompanionNode> nodes[SimulationContext::kMaxHeroLanes];
+  std::vector<CompanionSplit> splits[SimulationContext::kMaxHeroLanes];
+};
+
+
+/* Replay hero ray trees for companion wavelengths. Lanes are processed together, node by node of
+ * the hero tree, and every lane only tests the face that the hero hits. */
+class CompanionTracer {
+public:
+  CompanionTracer(const CrystalPtr& crystal, int max_recursion)
+      : crystal_(crystal), is_convex_(crystal->IsConvex()), max_recursion_(max_recursion), lane_num_(0) {}
+
+  void AddLane(float n) {
+    n_[lane_num_++] = n;
+  }
+
+  int LaneNum() const {
+    return lane_num_;
+  }
+
+  void Trace(Ray* ray, CompanionChunk* chunk) const {
+    const RaySegment* hero = ray->first_ray_segment_;
+    int nodes[SimulationContext::kMaxHeroLanes];
+    float pts[SimulationContext::kMaxHeroLanes * 3];
+    for (int l = 0; l < lane_num_; l++) {
+      nodes[l] = AddNode(l, hero->pt_.val(), hero->dir_.val(), hero->w_, hero->face_id_, -1, ray, chunk);
+      std::memcpy(pts + l * 3, hero->pt_.val(), sizeof(float) * 3);
+    }
+    TraceHit(hero, nodes, pts, hero->face_id_, 0, chunk);
+  }
+
+private:
+  int AddNode(int lane, const float* pt, const float* dir, float w, int face_id, int parent, Ray* root,
+              CompanionChunk* chunk) const {
+    auto& nodes = chunk->nodes[lane];
+    nodes.emplace_back();
+    auto& nd = nodes.back();
+    std::memcpy(nd.pt, pt, sizeof(float) * 3);
+    std::memcpy(nd.dir, dir, sizeof(float) * 3);
+    nd.w = w;
+    nd.face_id = face_id;
+    nd.parent = parent;
+    nd.root = root;
+    nd.is_finished = false;
+    return static_cast<int>(nodes.size() - 1);
+  }
+
+  // Rays of nodes hit face_id at pts. The hero ray is the one that hits.
+  void TraceHit(const RaySegment* hero, const int* nodes, const float* pts, int face_id, int depth,
+                CompanionChunk* chunk) const {
+    int next_nodes[2][SimulationContext::kMaxHeroLanes];
+    bool has_next[2] = { false, false };
+    const RaySegment* hero_next[2] = { hero->next_reflect_, hero->next_refract_ };
+    for (int l = 0; l < lane_num_; l++) {
+      next_nodes[0][l] = -1;
+      next_nodes[1][l] = -1;
+      if (nodes[l] < 0) {
+        continue;
+      }
+
+      const auto nd = chunk->nodes[l][nodes[l]];
+      float dir_out[6];
+      float w_out[2];
+      Optics::HitSurface(crystal_, n_[l], 1, nd.dir, &face_id, &nd.w, dir_out, w_out);
+      for (int k = 0; k < 2; k++) {
+        if (w_out[k] <= 0) {    // Refractive rays in total reflection case
+          continue;
+        }
+        int next = AddNode(l, pts + l * 3, dir_out + k * 3, w_out[k], face_id, nodes[l], nd.root, chunk);
+        if (hero_next[k]) {
+          next_nodes[k][l] = next;
+          has_next[k] = true;
+        } else {
+          // Hero is totally reflected here but the companion is not. Trace it alone.
+          int alone[SimulationContext::kMaxHeroLanes];
+          std::fill(alone, alone + lane_num_, -1);
+          alone[l] = next;
+          TracePropagate(nullptr, alone, depth + 1, chunk);
+        }
+      }
+    }
+    for (int k = 0; k < 2; k++) {
+      if (has_next[k]) {
+        TracePropagate(hero_next[k], next_nodes[k], depth + 1, chunk);
+      }
+    }
+  }
+
+  // Propagate rays of nodes to next face. The hero ray is the one propagating, or nullptr if they
+  // have left the hero path.
+  void TracePropagate(const RaySegment* hero, const int* nodes, int depth, CompanionChunk* chunk) const {
+    const RaySegment* hero_next = nullptr;
+    if (hero) {
+      hero_next = hero->next_reflect_ ? hero->next_reflect_ : hero->next_refract_;
+    }
+    int hero_face = hero_next ? hero_next->face_id_ : -1;
+    bool hero_exits = hero && !hero_next && hero->is_finished_ && hero->w_ >= SimulationContext::kPropMinW;
+
+    auto face_bases = crystal_->GetFaceBaseVector();
+    auto face_vertexes = crystal_->GetFaceVertex();
+
+    int hit_nodes[SimulationContext::kMaxHeroLanes];
+    float hit_pts[SimulationContext::kMaxHeroLanes * 3];
+    bool has_hit = false;
+    for (int l = 0; l < lane_num_; l++) {
+      hit_nodes[l] = -1;
+      if (nodes[l] < 0) {
+        continue;
+      }
+
+      auto& nd = chunk->nodes[l][nodes[l]];
+      if (nd.w < SimulationContext::kPropMinW) {
+        nd.is_finished = true;
+        continue;
+      }
+
+      // In a convex crystal, a ray can only leave the crystal, or hit the same face as the hero if
+      // it hits the face at all.
+      float pt[3];
+      int face_id = -1;
+      if (hero_next && is_convex_ &&
+          Optics::IntersectLineWithTriangle(nd.pt, nd.dir, face_bases + hero_face * 6,
+                                            face_vertexes + hero_face * 9, pt)) {
+        face_id = hero_face;
+      } else if (!(hero_exits && is_convex_)) {
+        Optics::Propagate(crystal_, 1, nd.pt, nd.dir, &nd.w, &nd.face_id, pt, &face_id);
+      }
+
+      if (face_id < 0) {
+        nd.is_finished = true;
+      } else if (depth >= max_recursion_) {
+        continue;   // Dropped, as the hero rays reaching max recursion
+      } else if (hero_next && face_id == hero_face) {
+        hit_nodes[l] = nodes[l];
+        std::memcpy(hit_pts + l * 3, pt, sizeof(float) * 3);
+        has_hit = true;
+      } else {
+        CompanionSplit split;
+        std::memcpy(split.pt, pt, sizeof(float) * 3);
+        split.face_id = face_id;
+        split.node = nodes[l];
+        split.depth = depth;
+        chunk->splits[l].emplace_back(split);
+      }
+    }
+    if (has_hit) {
+      TraceHit(hero, hit_nodes, hit_pts, hero_face, depth, chunk);
+    }
+  }
+
+  CrystalPtr crystal_;
+  bool is_convex_;
+  int max_recursion_;
+  int lane_num_;
+  float n_[SimulationContext::kMaxHeroLanes];
+};
+
+}  // namespace
+
+
+SimulationCost::SimulationCost()
+    : entry_ray_num(0), ray_segment_num(0), exit_ray_num(0), trace_time(0), table_memory(0) {}
+
+
+SimulationCost& SimulationCost::operator+=(const SimulationCost& other) {
+  entry_ray_num += other.entry_ray_num;
+  ray_segment_num += other.ray_segment_num;
+  exit_ray_num += other.exit_ray_num;
+  trace_time += other.trace_time;
+  table_memory += other.table_memory;
+  return *this;
+}
+
+
+Simulator::Simulator(const SimulationContextPtr& context, ThreadingPool* pool)
     : context_(context),
-      total_ray_num_(0), active_ray_num_(0), buffer_size_(0),
-      enter_ray_offset_(0) {}
+      threading_pool_(pool ? pool : ThreadingPool::GetInstance()),
+      ray_seg_pool_(std::make_shared<RaySegmentPool>()),
+      wavelengths_{ context->GetCurrentWavelength() }, hero_idx_(0), spectrum_(nullptr),
+      ray_num_(context->GetTotalInitRays()), total_ray_num_(0), active_ray_num_(0), buffer_size_(0),
+      enter_ray_offset_(0), sobol_(0), sobol_offset_(0),
+      mirror_symmetric_(false), mirror_copies_(false), record_orientations_(false) {}
 
 
 // Start simulation
 void Simulator::Start() {
+  Start(context_->GetCurrentWavelength());
+}
+
+
+void Simulator::Start(float wavelength) {
+  Start(std::vector<float>{ wavelength });
+}
+
+
+void Simulator::Start(const std::vector<float>& wavelengths) {
+  wavelengths_ = wavelengths;
+  hero_idx_ = wavelengths_.size() / 2;
+  auto multi_scatter_times = context_->GetMultiScatterTimes();
+  if (wavelengths_.size() > 1 && multi_scatter_times > 1) {
+    std::fprintf(stderr, "\nWARNING! Hero-wavelength tracing does not support multi-scattering, "
+                         "only the first wavelength is traced!\n");
+    wavelengths_.resize(1);
+    hero_idx_ = 0;
+  }
+  spectrum_ = context_->GetSpectrum();
+  if (spectrum_ && wavelengths_.size() > 1) {
+    std::fprintf(stderr, "\nWARNING! Wavelengths are sampled per ray in spectral tracing, "
+                         "only the first wavelength is traced!\n");
+    wavelengths_.resize(1);
+    hero_idx_ = 0;
+  }
+  companion_ray_segments_.clear();
+  companion_ray_segments_.resize(wavelengths_.size());
+
   rays_.clear();
   exit_ray_segments_.clear();
   final_ray_segments_.clear();
   active_crystal_ctxs_.clear();
-  RaySegmentPool::GetInstance()->Clear();
+  ray_seg_pool_->Clear();
   enter_ray_data_.Clean();
   enter_ray_offset_ = 0;
 
   context_->FillActiveCrystal(&active_crystal_ctxs_);
-  total_ray_num_ = context_->GetTotalInitRays();
+  crystal_costs_.assign(active_crystal_ctxs_.size(), SimulationCost());
+  total_ray_num_ = ray_num_;
+  float n = IceRefractiveIndex::n(wavelengths_[hero_idx_]);
+  PrepareTransferTables(n);
+  GroupCrystals();
+  for (size_t ci = 0; ci < active_crystal_ctxs_.size(); ci++) {
+    const auto* table = crystal_tables_[ci];
+    if (table && std::find(crystal_tables_.begin(), crystal_tables_.begin() + ci, table) ==
+                 crystal_tables_.begin() + ci) {
+      crystal_costs_[ci].table_memory = table->GetMemorySize();    // Counted once for crystals sharing it
+    }
+  }
 
-  InitSunRays();
-  auto multi_scatter_times = context_->GetMultiScatterTimes();
+  // Orientations of all crystals passed by a ray would be needed when multi-scattering.
+  record_orientations_ = context_->IsRecordingOrientations();
+  if (record_orientations_ && multi_scatter_times > 1) {
+    std::fprintf(stderr, "\nWARNING! Orientations are not recorded for multi-scattering!\n");
+    record_orientations_ = false;
+  }
+
+  // A ray may pass several crystals when multi-scattering, so all of them must be symmetric.
+  // Recorded rays may be re-weighted to any orientations later, which are not always symmetric.
+  mirror_symmetric_ = !record_orientations_;
+  for (const auto& ctx : active_crystal_ctxs_) {
+    mirror_symmetric_ = mirror_symmetric_ && ctx->IsMirrorSymmetric();
+  }
+  mirror_copies_ = mirror_symmetric_ && context_->IsMirrorCopies();
+
+  bool correlated = context_->IsCorrelatedSampling();
+  bool quasi_random = context_->IsQuasiRandomSampling();
+  if (!correlated) {
+    InitSunRays();
+  } else if (entry_samples_.ray_num != total_ray_num_) {
+    InitCorrelatedSamples();
+  }
+  int max_recursion_num = context_->GetMaxRecursionNum();
   for (int i = 0; i < multi_scatter_times; i++) {
     rays_.emplace_back();
     rays_.back().reserve(total_ray_num_);
     exit_ray_segments_.emplace_back();
     exit_ray_segments_.back().reserve(total_ray_num_ * 2);
 
+    std::vector<size_t> entry_ray_nums;
+    std::vector<size_t> entry_ray_offsets;
+    size_t entry_ray_offset = 0;
     for (const auto& ctx : active_crystal_ctxs_) {
-      active_ray_num_ = static_cast<size_t>(ctx->GetPopulation() * total_ray_num_);
+      entry_ray_nums.emplace_back(static_cast<size_t>(ctx->GetPopulation() * total_ray_num_));
+      entry_ray_offsets.emplace_back(entry_ray_offset);
+      entry_ray_offset += entry_ray_nums.back();
+    }
+
+    for (const auto& group : crystal_groups_) {
       if (buffer_size_ < total_ray_num_ * kBufferSizeFactor) {
         buffer_size_ = total_ray_num_ * kBufferSizeFactor;
         buffer_.Allocate(buffer_size_);
       }
-      InitEntryRays(ctx);
-      TraceRays(ctx->GetCrystal());
-      enter_ray_offset_ += active_ray_num_;
+      auto t0 = std::chrono::steady_clock::now();
+      auto segment_num = ray_seg_pool_->GetSegmentNum();
+      auto exit_ray_num = GetExitRayNum();
+
+      // Entry rays of all crystals in the group go into one batch. Every ray keeps its own crystal context.
+      auto ray_offset = rays_.back().size();
+      size_t group_ray_num = 0;
+      for (auto ci : group) {
+        enter_ray_offset_ = entry_ray_offsets[ci];
+        InitEntryRays(active_crystal_ctxs_[ci], entry_ray_nums[ci], group_ray_num,
+                      correlated && i == 0, quasi_random && i == 0);
+        group_ray_num += entry_ray_nums[ci];
+      }
+      active_ray_num_ = group_ray_num;
+
+      auto crystal = active_crystal_ctxs_[group[0]]->GetCrystal();
+      const auto* table = crystal_tables_[group[0]];
+      if (table) {
+        TransferRays(*table, &exit_ray_segments_.back());
+      } else {
+        TraceRays(crystal, n, max_recursion_num, &exit_ray_segments_.back());
+      }
+      if (wavelengths_.size() > 1) {
+        TraceCompanions(crystal, ray_offset);
+      }
+
+      // Work of a batch is shared among its crystals by their entry rays.
+      std::chrono::duration<double, std::milli> t = std::chrono::steady_clock::now() - t0;
+      auto group_segment_num = ray_seg_pool_->GetSegmentNum() - segment_num;
+      auto group_exit_ray_num = GetExitRayNum() - exit_ray_num;
+      for (auto ci : group) {
+        double share = group_ray_num > 0 ? static_cast<double>(entry_ray_nums[ci]) / group_ray_num : 0.0;
+        auto& cost = crystal_costs_[ci];
+        cost.entry_ray_num += entry_ray_nums[ci];
+        cost.ray_segment_num += static_cast<uint64_t>(group_segment_num * share);
+        cost.trace_time += t.count() * share;
+        if (i == multi_scatter_times - 1) {
+          cost.exit_ray_num += static_cast<uint64_t>(group_exit_ray_num * share);
+        }
+      }
     }
 
     if (i < multi_scatter_times - 1) {
@@ -173,6 +863,326 @@ void Simulator::Start() {
 }
 
 
+// Find transfer tables of active crystals, from those kept, or from table files, or build them.
+// Tables are used only if every ray has the same refractive index, and its ray path can be ignored.
+// Only tables of this Start() are kept, so tables of other wavelengths are released.
+void Simulator::PrepareTransferTables(float n) {
+  crystal_tables_.assign(active_crystal_ctxs_.size(), nullptr);
+  auto path = context_->GetTransferTablePath();
+  if (path.empty()) {
+    transfer_tables_.clear();
+    return;
+  }
+  if (spectrum_ || wavelengths_.size() > 1) {
+    std::fprintf(stderr, "\nWARNING! Transfer tables need a single wavelength, all rays are traced!\n");
+    transfer_tables_.clear();
+    return;
+  }
+
+  std::vector<std::shared_ptr<TransferTable> > tables;
+  bool built = false;
+  for (size_t ci = 0; ci < active_crystal_ctxs_.size(); ci++) {
+    const auto& ctx = active_crystal_ctxs_[ci];
+    if (ctx->HasRayPathFilter()) {
+      std::fprintf(stderr, "\nWARNING! Transfer tables do not keep ray paths, rays of crystal %zu "
+                           "with a ray path filter are traced!\n", ci);
+      continue;
+    }
+
+    std::shared_ptr<TransferTable> table(new TransferTable(ctx->GetCrystal(), n, context_->GetMaxRecursionNum(),
+                                                           context_->GetTransferTableResolution(),
+                                                           context_->GetTransferTableSampleNum()));
+    auto filename = table->GetFileName();
+    for (const auto& t : tables) {
+      if (t->GetFileName() == filename) {
+        crystal_tables_[ci] = t.get();
+        break;
+      }
+    }
+    if (crystal_tables_[ci]) {
+      continue;
+    }
+    for (const auto& t : transfer_tables_) {
+      if (t->GetFileName() == filename) {
+        crystal_tables_[ci] = t.get();
+        tables.emplace_back(t);
+        break;
+      }
+    }
+    if (crystal_tables_[ci]) {
+      continue;
+    }
+
+    auto full_path = PathJoin(path, filename);
+    if (!table->Load(full_path.c_str())) {
+      BuildTransferTable(ctx, n, table.get());
+      built = true;
+      if (!table->Save(full_path.c_str())) {
+        std::fprintf(stderr, "\nWARNING! Cannot save transfer table %s!\n", full_path.c_str());
+      }
+    }
+    crystal_tables_[ci] = table.get();
+    tables.emplace_back(std::move(table));
+  }
+  transfer_tables_.swap(tables);
+  if (built) {
+    ray_seg_pool_->Clear();
+  }
+}
+
+
+// Group active crystals that share a geometry and a transfer table, so that they are traced in one batch.
+// Groups are in the order of their first crystals.
+void Simulator::GroupCrystals() {
+  crystal_groups_.clear();
+  for (size_t ci = 0; ci < active_crystal_ctxs_.size(); ci++) {
+    auto crystal = active_crystal_ctxs_[ci]->GetCrystal();
+    bool found = false;
+    for (auto& group : crystal_groups_) {
+      if (active_crystal_ctxs_[group[0]]->GetCrystal() == crystal && crystal_tables_[group[0]] == crystal_tables_[ci]) {
+        group.emplace_back(ci);
+        found = true;
+        break;
+      }
+    }
+    if (!found) {
+      crystal_groups_.emplace_back(1, ci);
+    }
+  }
+}
+
+
+// Trace entry rays of every bin in crystal frame, with crystal main axis along z.
+void Simulator::BuildTransferTable(const CrystalContextPtr& ctx, float n, TransferTable* table) {
+  auto crystal = ctx->GetCrystal();
+  active_ray_num_ = table->GetEntryRayNum();
+  if (buffer_size_ < active_ray_num_ * kBufferSizeFactor) {
+    buffer_size_ = active_ray_num_ * kBufferSizeFactor;
+    buffer_.Allocate(buffer_size_);
+  }
+
+  // Random numbers come from a stream of the table, so that a table is the same whether it is built or loaded,
+  // and building it does not change random numbers of the simulation.
+  Math::RandomNumberGenerator rng(table->GetSeed());
+  table->SampleEntryDirections(&rng, buffer_.dir[0]);
+  auto* u = new float[active_ray_num_ * 3];
+  rng.GetUniform(u, active_ray_num_ * 3);
+  SampleEntryFaces(crystal, active_ray_num_, buffer_.dir[0], u, buffer_.face_id[0], buffer_.pt[0]);
+  delete[] u;
+
+  const float identity_quat[4] = { 1.0f, 0.0f, 0.0f, 0.0f };
+  std::vector<RayPtr> rays;
+  std::unordered_map<const Ray*, uint32_t> entry_idx_map;
+  rays.reserve(active_ray_num_);
+  entry_idx_map.reserve(active_ray_num_);
+  for (decltype(active_ray_num_) i = 0; i < active_ray_num_; i++) {
+    buffer_.w[0][i] = 1.0f;
+    auto r = ray_seg_pool_->GetRaySegment(buffer_.pt[0] + i * 3, buffer_.dir[0] + i * 3, 1.0f,
+                                          buffer_.face_id[0][i]);
+    buffer_.ray_seg[0][i] = r;
+    r->root_ = new Ray(r, ctx, identity_quat);
+    rays.emplace_back(r->root_);
+    entry_idx_map[r->root_] = static_cast<uint32_t>(i);
+  }
+
+  std::vector<RaySegment*> exit_segments;
+  TraceRays(crystal, n, context_->GetMaxRecursionNum(), &exit_segments);
+
+  std::vector<uint32_t> entry_idx;
+  std::vector<float> exit_dir;
+  std::vector<float> exit_w;
+  for (const auto& r : exit_segments) {
+    if (!r->is_finished_) {
+      continue;
+    }
+    entry_idx.emplace_back(entry_idx_map[r->root_]);
+    exit_dir.insert(exit_dir.end(), r->dir_.val(), r->dir_.val() + 3);
+    exit_w.emplace_back(r->w_);
+  }
+  table->SetExitRays(entry_idx, exit_dir, exit_w);
+}
+
+
+// Replace tracing of entry rays in buffer by exit rays from a transfer table.
+void Simulator::TransferRays(const TransferTable& table, std::vector<RaySegment*>* exit_segments) {
+  auto ray_pool = ray_seg_pool_;
+  auto rng = Math::RandomNumberGenerator::GetInstance();
+  auto* u = new float[active_ray_num_];
+  rng->GetUniform(u, active_ray_num_);
+
+  const auto* exit_offset = table.GetExitOffset();
+  const auto* exit_dir = table.GetExitDir();
+  const auto* exit_w = table.GetExitW();
+  for (decltype(active_ray_num_) i = 0; i < active_ray_num_; i++) {
+    auto prev_r = buffer_.ray_seg[0][i];
+    float rot[9];
+    auto entry = table.Lookup(buffer_.dir[0] + i * 3, u[i], rot);
+    for (auto k = exit_offset[entry]; k < exit_offset[entry + 1]; k++) {
+      const float* d = exit_dir + k * 3;
+      float dir[3] = {
+        rot[0] * d[0] + rot[1] * d[1] + rot[2] * d[2],
+        rot[3] * d[0] + rot[4] * d[1] + rot[5] * d[2],
+        rot[6] * d[0] + rot[7] * d[1] + rot[8] * d[2],
+      };
+      auto r = ray_pool->GetRaySegment(prev_r->pt_.val(), dir, prev_r->w_ * exit_w[k], -1);
+      r->is_finished_ = true;
+      r->prev_ = prev_r;
+      r->root_ = prev_r->root_;
+      exit_segments->emplace_back(r);
+    }
+  }
+  active_ray_num_ = 0;
+
+  delete[] u;
+}
+
+
+// Exit rays of the current scattering, of all wavelengths.
+size_t Simulator::GetExitRayNum() const {
+  size_t num = exit_ray_segments_.back().size();
+  for (const auto& segments : companion_ray_segments_) {
+    num += segments.size();
+  }
+  return num;
+}
+
+
+void Simulator::InitCorrelatedSamples() {
+  context_->FillActiveCrystal(&active_crystal_ctxs_);
+  total_ray_num_ = ray_num_;
+
+  InitSunRays();
+  entry_samples_.Allocate(total_ray_num_);
+  enter_ray_offset_ = 0;
+  for (const auto& ctx : active_crystal_ctxs_) {
+    auto entry_ray_num = static_cast<size_t>(ctx->GetPopulation() * total_ray_num_);
+    SampleEntryRays(ctx, entry_ray_num, context_->IsQuasiRandomSampling(),
+                    entry_samples_.axis_quat + enter_ray_offset_ * 4, entry_samples_.lat_roll + enter_ray_offset_ * 2,
+                    entry_samples_.dir + enter_ray_offset_ * 3, entry_samples_.face_id + enter_ray_offset_,
+                    entry_samples_.pt + enter_ray_offset_ * 3);
+    enter_ray_offset_ += entry_ray_num;
+  }
+  enter_ray_offset_ = 0;
+}
+
+
+void Simulator::SetRayNumber(uint64_t ray_num) {
+  ray_num_ = ray_num;
+}
+
+
+uint64_t Simulator::GetRayNumber() const {
+  return ray_num_;
+}
+
+
+bool Simulator::IsMirrorSymmetric() const {
+  return mirror_symmetric_;
+}
+
+
+bool Simulator::HasMirrorCopies() const {
+  return mirror_copies_;
+}
+
+
+bool Simulator::HasOrientations() const {
+  return record_orientations_;
+}
+
+
+void Simulator::SetQuasiRandomSequence(uint32_t seed, uint64_t offset) {
+  sobol_ = Math::SobolSampler(seed);
+  sobol_offset_ = offset;
+}
+
+
+// Quasi-random numbers of dimensions [dim, dim + dim_num) for entry rays [first, first + num), one dimension
+// after another. The caller deletes them.
+float* Simulator::GetQuasiRandomSamples(size_t first, int dim, int dim_num, size_t num) const {
+  auto* u = new float[num * dim_num];
+  auto idx = static_cast<uint32_t>(sobol_offset_ + first);
+  for (int d = 0; d < dim_num; d++) {
+    sobol_.Get(idx, dim + d, u + d * num, num);
+  }
+  return u;
+}
+
+
+const std::vector<SimulationCost>& Simulator::GetCrystalCosts() const {
+  return crystal_costs_;
+}
+
+
+constexpr double Simulator::kBaseMemory;
+constexpr size_t Simulator::kRayRefCountSize;
+
+// Memory of a Start() is counted from what it allocates:
+//   * ray segments, with a spare chunk of the pool, as the last chunk is allocated as a whole and the
+//     number of segments varies from batch to batch,
+//   * a Ray for every entry ray of every scattering, with a RayPtr and exit segment pointers reserved for it,
+//   * a pointer for every final exit ray, and two output blocks of them at most, being filled and written,
+//   * kBufferSizeFactor buffer slots, a sun ray, and correlated samples for every ray,
+//   * transfer tables, which do not depend on ray number.
+uint64_t Simulator::EstimateMemory(const SimulationContextPtr& context, const SimulationCost& cost,
+                                   uint64_t cost_ray_num, uint64_t ray_num) {
+  double scale = static_cast<double>(ray_num) / std::max(cost_ray_num, static_cast<uint64_t>(1));
+
+  double memory = (cost.ray_segment_num * scale + RaySegmentPool::kChunkSize) * sizeof(RaySegment);
+
+  memory += cost.entry_ray_num * scale *
+            (sizeof(Ray) + kRayRefCountSize + sizeof(RayPtr) + 2 * sizeof(RaySegment*));
+  size_t output_size = sizeof(float) * (context->GetSpectrum() ? 5 : 4);
+  memory += cost.exit_ray_num * scale * (sizeof(RaySegment*) + 2 * output_size);
+
+  size_t buffer_slot_size = 2 * (sizeof(float) * 8 + sizeof(int) + sizeof(RaySegment*));
+  size_t sun_ray_size = sizeof(float) * 3 + sizeof(RaySegment*);
+  size_t sample_size = context->IsCorrelatedSampling() ? sizeof(float) * 12 + sizeof(int) : 0;
+  memory += ray_num * (kBufferSizeFactor * buffer_slot_size + sun_ray_size + sample_size);
+  memory += cost.table_memory;
+
+  return static_cast<uint64_t>(memory);
+}
+
+constexpr uint64_t Simulator::kMinBatchRayNum;
+
+uint64_t Simulator::GetBatchRayNumber(const SimulationContextPtr& context, size_t simulator_num,
+                                      const SimulationCost& cost, uint64_t cost_ray_num) {
+  auto total_ray_num = context->GetTotalInitRays();
+  if (context->GetMaxMemory() == 0) {
+    return total_ray_num;
+  }
+
+  // Memory grows with ray number, so the largest batch that fits is found by bisection.
+  simulator_num = std::max(simulator_num, static_cast<size_t>(1));
+  double budget = (context->GetMaxMemory() - kBaseMemory) / simulator_num * 1024 * 1024;
+  if (EstimateMemory(context, cost, cost_ray_num, total_ray_num) <= budget) {
+    return total_ray_num;
+  }
+  uint64_t lo = kMinBatchRayNum;
+  uint64_t hi = total_ray_num;
+  while (lo + 1 < hi) {
+    auto mid = lo + (hi - lo) / 2;
+    if (EstimateMemory(context, cost, cost_ray_num, mid) <= budget) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  return std::min(lo, total_ray_num);
+}
+
+
+size_t Simulator::GetWavelengthNum() const {
+  return wavelengths_.size();
+}
+
+
+float Simulator::GetWavelength(size_t idx) const {
+  return wavelengths_[idx];
+}
+
+
 // Init sun rays, and fill into dir[1]. They will be rotated and fill into dir[0] in InitEntryRays().
 // In world frame.
 void Simulator::InitSunRays() {
@@ -182,82 +1192,133 @@ void Simulator::InitSunRays() {
   if (enter_ray_data_.ray_num < total_ray_num_) {
     enter_ray_data_.Allocate(total_ray_num_);
   }
-  sampler->SampleSphericalPointsCart(sun_ray_dir, sun_r, enter_ray_data_.ray_dir, total_ray_num_);
+  float* u = nullptr;
+  if (context_->IsQuasiRandomSampling()) {
+    u = GetQuasiRandomSamples(0, kDimSun, 2, total_ray_num_);
+  }
+  sampler->SampleSphericalPointsCart(sun_ray_dir, sun_r, enter_ray_data_.ray_dir, total_ray_num_, u);
+  delete[] u;
   for (decltype(enter_ray_data_.ray_num) i = 0; i < enter_ray_data_.ray_num; i++) {
     enter_ray_data_.ray_seg[i] = nullptr;
   }
 }
 
 
-// Init entry rays into a crystal. Fill pt[0], face_id[0], w[0] and ray_seg[0].
-// Rotate entry rays into crystal frame
+// Init num entry rays into a crystal. Fill pt[0], face_id[0], w[0] and ray_seg[0] from buffer_offset.
+// Rotate entry rays into crystal frame, or take them from entry_samples_ if use_samples is set.
 // Add RayPtr and main axis rotation
-void Simulator::InitEntryRays(const CrystalContextPtr& ctx) {
-  auto crystal = ctx->GetCrystal();
-  auto total_faces = crystal->TotalFaces();
-
-  auto* face_area = new float[total_faces];
-  auto* prob = new float[total_faces];
-  auto* face_norm = crystal->GetFaceNorm();
-  auto* face_point = crystal->GetFaceVertex();
-
-  crystal->CopyFaceAreaData(face_area);
+void Simulator::InitEntryRays(const CrystalContextPtr& ctx, size_t num, size_t buffer_offset,
+                              bool use_samples, bool quasi_random) {
+  float* dir = buffer_.dir[0] + buffer_offset * 3;
+  float* pt = buffer_.pt[0] + buffer_offset * 3;
+  int* face_id = buffer_.face_id[0] + buffer_offset;
+  float* w = buffer_.w[0] + buffer_offset;
+  RaySegment** ray_seg = buffer_.ray_seg[0] + buffer_offset;
+
+  float* axis_quat = nullptr;
+  float* lat_roll = nullptr;
+  if (use_samples) {
+    axis_quat = entry_samples_.axis_quat + enter_ray_offset_ * 4;
+    lat_roll = entry_samples_.lat_roll + enter_ray_offset_ * 2;
+    std::memcpy(dir, entry_samples_.dir + enter_ray_offset_ * 3, sizeof(float) * num * 3);
+    std::memcpy(pt, entry_samples_.pt + enter_ray_offset_ * 3, sizeof(float) * num * 3);
+    std::memcpy(face_id, entry_samples_.face_id + enter_ray_offset_, sizeof(int) * num);
+  } else {
+    axis_quat = new float[num * 4];
+    lat_roll = new float[num * 2];
+    SampleEntryRays(ctx, num, quasi_random, axis_quat, lat_roll, dir, face_id, pt);
+  }
 
-  auto ray_pool = RaySegmentPool::GetInstance();
+  auto ray_pool = ray_seg_pool_;
   auto rng = Math::RandomNumberGenerator::GetInstance();
-  auto sampler = Math::RandomSampler::GetInstance();
-
-  float axis_rot[3];
-  for (decltype(active_ray_num_) i = 0; i < active_ray_num_; i++) {
-    InitMainAxis(ctx, axis_rot);
-    Math::RotateZ(axis_rot, enter_ray_data_.ray_dir + (i + enter_ray_offset_) * 3, buffer_.dir[0] + i * 3);
+  for (decltype(num) i = 0; i < num; i++) {
+    auto prev_r = use_samples ? nullptr : enter_ray_data_.ray_seg[enter_ray_offset_ + i];
+    w[i] = prev_r ? prev_r->w_ : 1.0f;
 
-    float sum = 0;
-    for (int k = 0; k < total_faces; k++) {
-      prob[k] = std::max(-Math::Dot3(face_norm + k * 3, buffer_.dir[0] + i * 3) * face_area[k], 0.0f);
-      sum += prob[k];
-    }
-    for (int k = 0; k < total_faces; k++) {
-      prob[k] /= sum;
+    auto r = ray_pool->GetRaySegment(pt + i * 3, dir + i * 3, w[i], face_id[i]);
+    ray_seg[i] = r;
+    r->root_ = new Ray(r, ctx, axis_quat + i * 4);
+    r->root_->prev_ray_segment_ = prev_r;
+    std::memcpy(r->root_->main_axis_lat_roll_, lat_roll + i * 2, sizeof(float) * 2);
+    if (spectrum_) {
+      // A scattered ray keeps its wavelength
+      r->root_->wavelength_ = prev_r ? prev_r->root_->wavelength_ : spectrum_->Sample(rng->GetUniform());
+      buffer_.n[0][buffer_offset + i] = IceRefractiveIndex::n(r->root_->wavelength_);
     }
+    rays_.back().emplace_back(r->root_);
+  }
 
-    buffer_.face_id[0][i] = sampler->SampleInt(prob, total_faces);
-    sampler->SampleTriangularPoints(face_point + buffer_.face_id[0][i] * 9, buffer_.pt[0] + i * 3);
+  if (!use_samples) {
+    delete[] axis_quat;
+    delete[] lat_roll;
+  }
+}
 
-    auto prev_r = enter_ray_data_.ray_seg[enter_ray_offset_ + i];
-    buffer_.w[0][i] = prev_r ? prev_r->w_ : 1.0f;
 
-    auto r = ray_pool->GetRaySegment(buffer_.pt[0] + i * 3, buffer_.dir[0] + i * 3, buffer_.w[0][i],
-                                     buffer_.face_id[0][i]);
-    buffer_.ray_seg[0][i] = r;
-    r->root_ = new Ray(r, ctx, axis_rot);
-    r->root_->prev_ray_segment_ = prev_r;
-    rays_.back().emplace_back(r->root_);
+// Sample main axis rotations, entry faces and entry points for sun rays in enter_ray_data_,
+// starting from enter_ray_offset_. Directions are rotated into crystal frame.
+// With quasi_random, samples of ray i are from point (enter_ray_offset_ + i) of the quasi-random sequence.
+void Simulator::SampleEntryRays(const CrystalContextPtr& ctx, size_t num, bool quasi_random,
+                                float* axis_quat, float* lat_roll, float* dir, int* face_id, float* pt) {
+  float* u = nullptr;
+  if (quasi_random) {
+    u = GetQuasiRandomSamples(enter_ray_offset_, kDimAxis, kDimSun - kDimAxis, num);
   }
 
-  delete[] face_area;
-  delete[] prob;
+  InitMainAxis(ctx, num, u, axis_quat, lat_roll);
+  Math::RotateByQuat(axis_quat, enter_ray_data_.ray_dir + enter_ray_offset_ * 3, dir, num);
+
+  static_assert(kDimEntryPoint == kDimFace + 1, "Entry points must follow entry faces");
+  SampleEntryFaces(ctx->GetCrystal(), num, dir, u ? u + (kDimFace - kDimAxis) * num : nullptr, face_id, pt);
+
+  delete[] u;
 }
 
 
-// Init crystal main axis.
-// Random sample points on a sphere with given parameters.
-void Simulator::InitMainAxis(const CrystalContextPtr& ctx, float* axis) {
+// Init crystal main axes of num crystals, as quaternions, and their latitudes and rolls.
+// Random sample points on a sphere with given parameters. If u is given, use its uniform numbers instead,
+// for axis (2 dimensions) and roll (1 dimension).
+void Simulator::InitMainAxis(const CrystalContextPtr& ctx, size_t num, const float* u, float* axis_quat,
+                             float* lat_roll) {
   auto rng = Math::RandomNumberGenerator::GetInstance();
   auto sampler = Math::RandomSampler::GetInstance();
 
+  auto* lon_lat = new float[num * 2];
+  auto* roll = new float[num];
   if (ctx->GetAxisDist() == Math::Distribution::UNIFORM) {
     // Random sample on full sphere, ignore other parameters.
-    sampler->SampleSphericalPointsSph(axis);
+    sampler->SampleSphericalPointsSph(lon_lat, num, u);
   } else {
-    sampler->SampleSphericalPointsSph(ctx->GetAxisDist(), ctx->GetAxisMean(), ctx->GetAxisStd(), axis);
+    sampler->SampleSphericalPointsSph(ctx->GetAxisDist(), ctx->GetAxisMean(), ctx->GetAxisStd(), lon_lat, num, u);
   }
   if (ctx->GetRollDist() == Math::Distribution::UNIFORM) {
-    // Random roll, ignore other parameters.
-    axis[2] = rng->GetUniform() * 2 * Math::kPi;
+    // Random roll, ignore other parameters. A symmetric crystal repeats itself, so one period is enough.
+    if (u) {
+      std::memcpy(roll, u + (kDimRoll - kDimAxis) * num, sizeof(float) * num);
+    } else {
+      rng->GetUniform(roll, num);
+    }
+    float period = ctx->GetRollPeriod() * Math::kDegreeToRad;
+    for (decltype(num) i = 0; i < num; i++) {
+      roll[i] *= period;
+    }
+  } else if (u) {
+    for (decltype(num) i = 0; i < num; i++) {
+      roll[i] = Math::Quantile(ctx->GetRollDist(), ctx->GetRollMean() * Math::kDegreeToRad,
+                               ctx->GetRollStd() * Math::kDegreeToRad, u[(kDimRoll - kDimAxis) * num + i]);
+    }
   } else {
-    axis[2] = rng->Get(ctx->GetRollDist(), ctx->GetRollMean(), ctx->GetRollStd()) * Math::kDegreeToRad;
+    rng->Get(ctx->GetRollDist(), ctx->GetRollMean() * Math::kDegreeToRad, ctx->GetRollStd() * Math::kDegreeToRad,
+             roll, num);
+  }
+  Math::RotateZQuat(lon_lat, roll, axis_quat, num);
+  for (decltype(num) i = 0; i < num; i++) {
+    lat_roll[i * 2 + 0] = lon_lat[i * 2 + 1];
+    lat_roll[i * 2 + 1] = roll[i];
   }
+
+  delete[] lon_lat;
+  delete[] roll;
 }
 
 
@@ -273,6 +1334,8 @@ void Simulator::RestoreResultRays() {
 
   float prob = context_->GetMultiScatterProb();
   auto rng = Math::RandomNumberGenerator::GetInstance();
+  std::vector<float> axis_quat;
+  axis_quat.reserve(exit_ray_segments_.back().size() * 4);
   size_t idx = 0;
   for (const auto& r : exit_ray_segments_.back()) {
     if (!r->is_finished_ || r->w_ < context_->kScatMinW) {
@@ -282,12 +1345,13 @@ void Simulator::RestoreResultRays() {
       final_ray_segments_.emplace_back(r);
       continue;
     }
-    const auto axis_rot = r->root_->main_axis_rot_.val();
-    Math::RotateZBack(axis_rot, r->dir_.val(), enter_ray_data_.ray_dir + idx * 3);
+    axis_quat.insert(axis_quat.end(), r->root_->main_axis_quat_, r->root_->main_axis_quat_ + 4);
+    std::memcpy(enter_ray_data_.ray_dir + idx * 3, r->dir_.val(), sizeof(float) * 3);
     enter_ray_data_.ray_seg[idx] = r;
     idx++;
   }
   total_ray_num_ = idx;
+  Math::RotateByQuat(axis_quat.data(), enter_ray_data_.ray_dir, enter_ray_data_.ray_dir, total_ray_num_, true);
 
   // Shuffle
   auto sampler = Math::RandomSampler::GetInstance();
@@ -307,13 +1371,13 @@ void Simulator::RestoreResultRays() {
 
 
 // Trace rays.
-// Start from dir[0] and pt[0].
-void Simulator::TraceRays(const CrystalPtr& crystal) {
-  auto pool = ThreadingPool::GetInstance();
+// Start from dir[0] and pt[0]. In spectral tracing, refractive indices are taken from n[0] instead of n.
+void Simulator::TraceRays(const CrystalPtr& crystal, float n, int recursion_num,
+                          std::vector<RaySegment*>* exit_segments) {
+  auto pool = threading_pool_;
+  bool spectral = spectrum_ != nullptr;
 
-  int max_recursion_num = context_->GetMaxRecursionNum();
-  float n = IceRefractiveIndex::n(context_->GetCurrentWavelength());
-  for (int i = 0; i < max_recursion_num; i++) {
+  for (int i = 0; i < recursion_num; i++) {
     if (buffer_size_ < active_ray_num_ * 2) {
       buffer_size_ = active_ray_num_ * kBufferSizeFactor;
       buffer_.Allocate(buffer_size_);
@@ -322,24 +1386,34 @@ void Simulator::TraceRays(const CrystalPtr& crystal) {
     for (decltype(active_ray_num_) j = 0; j < active_ray_num_; j += step) {
       decltype(active_ray_num_) current_num = std::min(active_ray_num_ - j, step);
       pool->AddJob([=] {
-        Optics::HitSurface(crystal, n, current_num,
-                           buffer_.dir[0] + j * 3, buffer_.face_id[0] + j, buffer_.w[0] + j,
-                           buffer_.dir[1] + j * 6, buffer_.w[1] + j * 2);
+        if (spectral) {
+          Optics::HitSurface(crystal, buffer_.n[0] + j, current_num,
+                             buffer_.dir[0] + j * 3, buffer_.face_id[0] + j, buffer_.w[0] + j,
+                             buffer_.dir[1] + j * 6, buffer_.w[1] + j * 2);
+          for (decltype(current_num) k = j; k < j + current_num; k++) {
+            buffer_.n[1][k * 2 + 0] = buffer_.n[0][k];
+            buffer_.n[1][k * 2 + 1] = buffer_.n[0][k];
+          }
+        } else {
+          Optics::HitSurface(crystal, n, current_num,
+                             buffer_.dir[0] + j * 3, buffer_.face_id[0] + j, buffer_.w[0] + j,
+                             buffer_.dir[1] + j * 6, buffer_.w[1] + j * 2);
+        }
         Optics::Propagate(crystal, current_num * 2,
                           buffer_.pt[0] + j * 3, buffer_.dir[1] + j * 6, buffer_.w[1] + j * 2, buffer_.face_id[0] + j,
                           buffer_.pt[1] + j * 6, buffer_.face_id[1] + j * 2);
       });
     }
     pool->WaitFinish();
-    StoreRaySegments();
+    StoreRaySegments(exit_segments);
     RefreshBuffer();    // active_ray_num_ is updated.
   }
 }
 
 
 // Save rays
-void Simulator::StoreRaySegments() {
-  auto ray_pool = RaySegmentPool::GetInstance();
+void Simulator::StoreRaySegments(std::vector<RaySegment*>* exit_segments) {
+  auto ray_pool = ray_seg_pool_;
   for (size_t i = 0; i < active_ray_num_ * 2; i++) {
     if (buffer_.w[1][i] <= 0) {   // Refractive rays in total reflection case
       continue;
@@ -351,7 +1425,7 @@ void Simulator::StoreRaySegments() {
       r->is_finished_ = true;
     }
     if (r->is_finished_ || r->w_ < SimulationContext::kPropMinW) {
-      exit_ray_segments_.back().emplace_back(r);
+      exit_segments->emplace_back(r);
     }
 
     auto prev_ray_seg = buffer_.ray_seg[0][i / 2];
@@ -367,6 +1441,99 @@ void Simulator::StoreRaySegments() {
 }
 
 
+// Trace companion wavelengths, for rays in rays_.back() from ray_offset.
+// Rays following hero paths are replayed in parallel and built into ray segments in order. Rays that
+// split off are then traced as usual, grouped by recursion depth.
+void Simulator::TraceCompanions(const CrystalPtr& crystal, size_t ray_offset) {
+  int max_recursion_num = context_->GetMaxRecursionNum();
+
+  std::vector<size_t> lane_wavelength_idx;
+  CompanionTracer tracer(crystal, max_recursion_num);
+  for (size_t i = 0; i < wavelengths_.size(); i++) {
+    if (i != hero_idx_) {
+      lane_wavelength_idx.emplace_back(i);
+      tracer.AddLane(IceRefractiveIndex::n(wavelengths_[i]));
+    }
+  }
+
+  const auto& rays = rays_.back();
+  auto ray_num = rays.size() - ray_offset;
+  auto step = std::max(ray_num / 100, static_cast<size_t>(10));
+  std::vector<CompanionChunk> chunks((ray_num + step - 1) / step);
+
+  const auto* ray_data = rays.data() + ray_offset;
+  auto* chunk_data = chunks.data();
+  const auto* tracer_ptr = &tracer;
+  for (size_t j = 0; j < ray_num; j += step) {
+    auto current_num = std::min(ray_num - j, step);
+    threading_pool_->AddJob([=] {
+      for (size_t k = 0; k < current_num; k++) {
+        tracer_ptr->Trace(ray_data[j + k].get(), chunk_data + j / step);
+      }
+    });
+  }
+  threading_pool_->WaitFinish();
+
+  std::vector<RaySegment*> segments;
+  std::vector<std::vector<size_t> > depth_splits(max_recursion_num);
+  std::vector<RaySegment*> split_segments;
+  std::vector<CompanionSplit> splits;
+  for (int l = 0; l < tracer.LaneNum(); l++) {
+    auto& exit_segments = companion_ray_segments_[lane_wavelength_idx[l]];
+    split_segments.clear();
+    splits.clear();
+    for (auto& chunk : chunks) {
+      segments.clear();
+      for (const auto& nd : chunk.nodes[l]) {
+        auto r = ray_seg_pool_->GetRaySegment(nd.pt, nd.dir, nd.w, nd.face_id);
+        r->root_ = nd.root;
+        r->prev_ = nd.parent >= 0 ? segments[nd.parent] : nullptr;
+        r->is_finished_ = nd.is_finished;
+        if (nd.is_finished) {
+          exit_segments.emplace_back(r);
+        }
+        segments.emplace_back(r);
+      }
+      for (const auto& split : chunk.splits[l]) {
+        split_segments.emplace_back(segments[split.node]);
+        splits.emplace_back(split);
+      }
+      chunk.nodes[l].clear();
+      chunk.nodes[l].shrink_to_fit();
+    }
+
+    for (auto& d : depth_splits) {
+      d.clear();
+    }
+    for (size_t i = 0; i < splits.size(); i++) {
+      depth_splits[splits[i].depth].emplace_back(i);
+    }
+
+    float n = IceRefractiveIndex::n(wavelengths_[lane_wavelength_idx[l]]);
+    for (int d = 0; d < max_recursion_num; d++) {
+      if (depth_splits[d].empty()) {
+        continue;
+      }
+      active_ray_num_ = depth_splits[d].size();
+      if (buffer_size_ < active_ray_num_ * kBufferSizeFactor) {
+        buffer_size_ = active_ray_num_ * kBufferSizeFactor;
+        buffer_.Allocate(buffer_size_);
+      }
+      for (size_t i = 0; i < active_ray_num_; i++) {
+        const auto& split = splits[depth_splits[d][i]];
+        auto r = split_segments[depth_splits[d][i]];
+        std::memcpy(buffer_.pt[0] + i * 3, split.pt, sizeof(float) * 3);
+        std::memcpy(buffer_.dir[0] + i * 3, r->dir_.val(), sizeof(float) * 3);
+        buffer_.w[0][i] = r->w_;
+        buffer_.face_id[0][i] = split.face_id;
+        buffer_.ray_seg[0][i] = r;
+      }
+      TraceRays(crystal, n, max_recursion_num - d, &exit_segments);
+    }
+  }
+}
+
+
 // Squeeze data, copy into another buffer_ (from buf[1] to buf[0])
 // Update active_ray_num_.
 void Simulator::RefreshBuffer() {
@@ -376,6 +1543,9 @@ void Simulator::RefreshBuffer() {
       std::memcpy(buffer_.pt[0] + idx * 3, buffer_.pt[1] + i * 3, sizeof(float) * 3);
       std::memcpy(buffer_.dir[0] + idx * 3, buffer_.dir[1] + i * 3, sizeof(float) * 3);
       buffer_.w[0][idx] = buffer_.w[1][i];
+      if (spectrum_) {
+        buffer_.n[0][idx] = buffer_.n[1][i];
+      }
       buffer_.face_id[0][idx] = buffer_.face_id[1][i];
       buffer_.ray_seg[0][idx] = buffer_.ray_seg[1][i];
       idx++;
@@ -385,33 +1555,116 @@ void Simulator::RefreshBuffer() {
 }
 
 
-void Simulator::SaveFinalDirections(const char* filename) {
+// Data file layout: wavelength, then dx, dy, dz, w of each ray.
+// In spectral tracing, the wavelength is LightSpectrum::kSpectralDataTag, and each ray is dx, dy, dz, w, wavelength,
+// where w is already multiplied by the spectral weight.
+// If append is set, rays are appended to an existing file of the same wavelength, such as from a previous batch.
+void Simulator::SaveFinalDirections(const char* filename, size_t wavelength_idx, bool append) {
   File file(context_->GetDataDirectory().c_str(), filename);
-  if (!file.Open(OpenMode::kWrite | OpenMode::kBinary)) return;
+  if (!file.Open((append ? OpenMode::kAppend : OpenMode::kWrite) | OpenMode::kBinary)) return;
 
-  file.Write(context_->GetCurrentWavelength());
+  std::vector<float> data;
+  GetFinalDirections(&data, wavelength_idx, !append);
+  file.Write(data.data(), data.size());
+  file.Close();
+}
 
-  auto ray_num = final_ray_segments_.size();
-  size_t idx = 0;
-  auto* data = new float[ray_num * 4];       // dx, dy, dz, w
 
-  float* curr_data = data;
-  for (const auto& r : final_ray_segments_) {
-    const auto axis_rot = r->root_->main_axis_rot_.val();
+void Simulator::GetFinalDirections(std::vector<float>* data, size_t wavelength_idx, bool header) const {
+  const auto& final_ray_segments = wavelength_idx == hero_idx_ ? final_ray_segments_ :
+                                   companion_ray_segments_[wavelength_idx];
+  auto ray_num = final_ray_segments.size();
+  size_t ray_step = spectrum_ ? 5 : 4;
+  size_t header_size = header ? 1 : 0;
+  data->resize(header_size + ray_num * ray_step);
+
+  float* curr_data = data->data();
+  if (header) {
+    *curr_data++ = spectrum_ ? LightSpectrum::kSpectralDataTag : wavelengths_[wavelength_idx];
+  }
+  float* ray_data = curr_data;
+  std::vector<float> axis_quat;
+  axis_quat.reserve(ray_num * 4);
+  size_t idx = 0;
+  for (const auto& r : final_ray_segments) {
     assert(r->root_);
     if (!r->root_->crystal_ctx_->FilterRay(r)) {
       continue;
     }
 
-    Math::RotateZBack(axis_rot, r->dir_.val(), curr_data);
+    axis_quat.insert(axis_quat.end(), r->root_->main_axis_quat_, r->root_->main_axis_quat_ + 4);
+    std::memcpy(curr_data, r->dir_.val(), sizeof(float) * 3);
     curr_data[3] = r->w_;
-    curr_data += 4;
+    if (spectrum_) {
+      curr_data[3] *= spectrum_->GetWeight(r->root_->wavelength_);
+      curr_data[4] = r->root_->wavelength_;
+    }
+    curr_data += ray_step;
     idx++;
   }
-  file.Write(data, idx * 4);
-  file.Close();
+  Math::RotateByQuat(axis_quat.data(), ray_data, ray_data, idx, true, ray_step);
+
+  if (mirror_copies_) {
+    // Mirror by the vertical plane of the sun, with normal n. Rays share weights with their mirror images.
+    const float* sun_dir = context_->GetSunRayDir();
+    float n[3] = { sun_dir[1], -sun_dir[0], 0 };
+    float len = Math::Norm3(n);
+    if (len < Math::kFloatEps) {
+      n[0] = 1;
+      n[1] = 0;
+    } else {
+      n[0] /= len;
+      n[1] /= len;
+    }
+
+    data->resize(header_size + idx * ray_step * 2);
+    ray_data = data->data() + header_size;
+    float* mirror_data = ray_data + idx * ray_step;
+    for (size_t i = 0; i < idx; i++) {
+      float* d = ray_data + i * ray_step;
+      float* m = mirror_data + i * ray_step;
+      float k = 2 * Math::Dot3(d, n);
+      d[3] *= 0.5f;
+      std::memcpy(m, d, sizeof(float) * ray_step);
+      m[0] -= k * n[0];
+      m[1] -= k * n[1];
+    }
+    idx *= 2;
+  }
+  data->resize(header_size + idx * ray_step);
+}
+
+
+void Simulator::GetOrientations(std::vector<float>* data, size_t wavelength_idx, bool header) const {
+  const auto& final_ray_segments = wavelength_idx == hero_idx_ ? final_ray_segments_ :
+                                   companion_ray_segments_[wavelength_idx];
+  size_t header_size = header ? 1 : 0;
+  data->resize(header_size + final_ray_segments.size() * 4);
+
+  float* curr_data = data->data();
+  if (header) {
+    *curr_data++ = spectrum_ ? LightSpectrum::kSpectralDataTag : wavelengths_[wavelength_idx];
+  }
+  std::unordered_map<const CrystalContext*, float> crystal_idx;
+  for (size_t i = 0; i < active_crystal_ctxs_.size(); i++) {
+    crystal_idx[active_crystal_ctxs_[i].get()] = static_cast<float>(i);
+  }
+  size_t idx = 0;
+  for (const auto& r : final_ray_segments) {
+    const auto& ctx = r->root_->crystal_ctx_;
+    if (!ctx->FilterRay(r)) {
+      continue;
+    }
 
-  delete[] data;
+    const float* lat_roll = r->root_->main_axis_lat_roll_;
+    curr_data[0] = crystal_idx[ctx.get()];
+    curr_data[1] = lat_roll[0];
+    curr_data[2] = lat_roll[1];
+    curr_data[3] = ctx->GetOrientationPdf(lat_roll[0], lat_roll[1]);
+    curr_data += 4;
+    idx++;
+  }
+  data->resize(header_size + idx * 4);
 }
 
 
@@ -4,7 +4,10 @@
 #include "context.h"
 #include "crystal.h"
 #include "optics.h"
+#include "threadingpool.h"
 
+#include <memory>
+#include <string>
 #include <vector>
 
 namespace IceHalo {
@@ -21,6 +24,7 @@ public:
   float* pt[2];
   float* dir[2];
   float* w[2];
+  float* n[2];        // Refractive index of every ray, used in spectral tracing
   int* face_id[2];
   RaySegment** ray_seg[2];
 
@@ -49,41 +53,291 @@ private:
 };
 
 
+/* Entry rays sampled once and reused by every wavelength, for correlated sampling. In crystal frame. */
+struct EntrySampleData {
+public:
+  EntrySampleData();
+  ~EntrySampleData();
+
+  void Clean();
+  void Allocate(size_t ray_num);
+
+  float* axis_quat;
+  float* lat_roll;      // Main axis latitude and roll, see Ray
+  float* dir;
+  float* pt;
+  int* face_id;
+
+  size_t ray_num;
+
+private:
+  void DeleteBuffer();
+};
+
+
+/* Exit rays of a crystal for every incident direction, in crystal frame, traced once for one refractive index.
+ *
+ * Incident directions are binned in rows of zenith angle, and every row in azimuth, where azimuth is folded into
+ * one period of the rotational symmetry of the crystal. Bins are about the same size everywhere. A bin keeps all
+ * exit rays of a few entry rays sampled in it. A lookup picks one of them, and turns its exit rays by the rotation
+ * from its incident direction to the one looked up.
+ * It does not depend on sun altitude or crystal orientations, so one table serves all of them, but halos are
+ * blurred by about the bin size.
+ */
+class TransferTable {
+public:
+  /*! @brief Create an empty table. Fill it by Load(), or by SampleEntryDirections(), tracing the entry rays, and
+   * SetExitRays().
+   *
+   * @param resolution bin size in degree.
+   * @param sample_num entry rays in every bin.
+   */
+  TransferTable(const CrystalPtr& crystal, float n, int max_recursion_num, float resolution, int sample_num);
+  ~TransferTable();
+  TransferTable(TransferTable const&) = delete;
+  void operator=(TransferTable const&) = delete;
+
+  size_t GetEntryRayNum() const;
+  uint32_t GetSeed() const;                   // Seed of random numbers to build the table, from its settings
+  void SampleEntryDirections(Math::RandomNumberGenerator* rng, float* dir);   // Entry ray i is in bin i / sample_num
+  size_t GetMemorySize() const;               // Bytes of the table
+
+  /*! @brief Set exit rays of all entry rays.
+   *
+   * @param entry_idx entry ray of every exit ray.
+   * @param dir exit directions, 3 floats each.
+   * @param w exit weights, of an entry ray with weight 1.
+   */
+  void SetExitRays(const std::vector<uint32_t>& entry_idx, const std::vector<float>& dir, const std::vector<float>& w);
+
+  /*! @brief Find exit rays for an incident direction.
+   *
+   * @param dir incident direction, in crystal frame.
+   * @param u uniform number in [0, 1) to pick an entry ray of the bin.
+   * @param rot filled with a 3x3 row-major rotation, from exit directions of the entry ray to the ones for dir.
+   * @return index of the entry ray. Its exit rays are [GetExitOffset()[i], GetExitOffset()[i + 1]).
+   */
+  size_t Lookup(const float* dir, float u, float* rot) const;
+
+  const uint32_t* GetExitOffset() const;
+  const float* GetExitDir() const;
+  const float* GetExitW() const;
+
+  std::string GetFileName() const;    // Unique for the crystal, refractive index and table settings
+  bool Load(const char* filename);    // Return false if there is no matching table, and nothing is loaded
+  bool Save(const char* filename) const;
+
+  struct Header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t crystal_hash;
+    float n;
+    int32_t max_recursion_num;
+    float resolution;
+    int32_t sample_num;
+    int32_t symmetry;
+    int32_t reserved;
+  };
+
+private:
+  void DeleteBuffer();
+
+  Header header_;
+  float period_;                        // Azimuth period in rad
+  std::vector<uint32_t> row_offset_;    // First bin of every zenith row, with the bin number at the end
+
+  float* entry_dir_;
+  uint32_t* exit_offset_;
+  float* exit_dir_;
+  float* exit_w_;
+  size_t exit_ray_num_;
+};
+
+
+/* Work done in tracing, counted for one crystal, or summed over crystals. */
+struct SimulationCost {
+  SimulationCost();
+  SimulationCost& operator+=(const SimulationCost& other);
+
+  uint64_t entry_ray_num;       // Entry rays of all scatterings
+  uint64_t ray_segment_num;
+  uint64_t exit_ray_num;        // Rays saved to data files, of all wavelengths
+  double trace_time;            // In ms
+  uint64_t table_memory;        // Bytes of transfer tables used. They do not grow with ray number
+};
+
+
 class Simulator {
 public:
-  explicit Simulator(const SimulationContextPtr& context);
+  /*! @brief Create a simulator.
+   *
+   * @param context simulation context. It is only read during simulation, so several simulators
+   *                may share one context.
+   * @param pool threading pool used to trace rays. If nullptr, the global pool is used.
+   */
+  explicit Simulator(const SimulationContextPtr& context, ThreadingPool* pool = nullptr);
   ~Simulator() = default;
 
-  void Start();
-  void SaveFinalDirections(const char* filename);
+  void Start();                     // Use current wavelength of the context, or sample one per ray if the
+                                    // context has a spectrum.
+  void Start(float wavelength);
+
+  /*! @brief Hero-wavelength tracing. Trace several wavelengths with one set of ray paths.
+   *
+   * The middle wavelength is the hero and is traced as usual. Others are companions. A companion ray
+   * follows the path of its hero ray, so only the face hit by the hero is tested. If a companion ray
+   * leaves the hero path, i.e. hits another face, or refracts where the hero is totally reflected, it
+   * splits off and is traced on its own. Multi-scattering is not supported.
+   *
+   * @param wavelengths at most SimulationContext::kMaxHeroLanes wavelengths.
+   */
+  void Start(const std::vector<float>& wavelengths);
+
+  /*! @brief Sample sun rays, crystal orientations, entry faces and entry points for correlated sampling.
+   *
+   * They are reused by every following Start() as the first scattering, so all wavelengths see the same
+   * rays. Start() calls it if needed, and it may be called earlier to control the random stream used.
+   */
+  void InitCorrelatedSamples();
+
+  /*! @brief Set the number of entry rays traced by every following Start().
+   *
+   * It is the ray number of the context by default. A large simulation can be split into batches of a smaller
+   * number, and memory is reused from one batch to the next.
+   */
+  void SetRayNumber(uint64_t ray_num);
+  uint64_t GetRayNumber() const;
+
+  /*! @brief Choose the quasi-random sequence used if the context has quasi-random sampling.
+   *
+   * Entry ray i of the first scattering takes point (offset + i) of the sequence. A simulation split into
+   * batches keeps the seed, and sets the offset of every batch to the number of rays before it.
+   */
+  void SetQuasiRandomSequence(uint32_t seed, uint64_t offset);
+
+  /*! @brief Test if every ray of the last Start() is as likely as its mirror image by the vertical plane of the
+   * sun, i.e. all active crystals are mirror symmetric. A renderer may then fold the rays onto both sides.
+   */
+  bool IsMirrorSymmetric() const;
+
+  /*! @brief Test if the last Start() writes the mirror image of every ray, by the vertical plane of the sun.
+   *
+   * It is set if the context asks for mirror copies and IsMirrorSymmetric().
+   */
+  bool HasMirrorCopies() const;
+
+  /*! @brief Test if the last Start() records crystal orientations of rays, see GetOrientations().
+   *
+   * It is set if the context asks for it, and there is no multi-scattering. Such data are never mirror symmetric.
+   */
+  bool HasOrientations() const;
+
+  /*! @brief Cost of every crystal of the context in the last Start(), summed over multi-scattering. */
+  const std::vector<SimulationCost>& GetCrystalCosts() const;
+
+  /*! @brief Estimate memory used by a simulator for rays, buffers and transfer tables, from the cost of a
+   * calibration trace.
+   *
+   * @param cost total cost of a calibration Start().
+   * @param cost_ray_num ray number of the calibration Start().
+   * @param ray_num ray number to estimate for.
+   * @return memory in bytes.
+   */
+  static uint64_t EstimateMemory(const SimulationContextPtr& context, const SimulationCost& cost,
+                                 uint64_t cost_ray_num, uint64_t ray_num);
+
+  /*! @brief Estimate the number of entry rays in one batch, so that simulators do not use more memory than
+   * max_memory of the context altogether. Return the ray number of the context if there is no limit.
+   *
+   * Memory of a batch is estimated by EstimateMemory().
+   *
+   * @param simulator_num number of simulators running at the same time.
+   * @param cost total cost of a calibration Start().
+   * @param cost_ray_num ray number of the calibration Start().
+   */
+  static uint64_t GetBatchRayNumber(const SimulationContextPtr& context, size_t simulator_num,
+                                    const SimulationCost& cost, uint64_t cost_ray_num);
+
+  static constexpr double kBaseMemory = 8;         // MB of the process besides simulators, such as the context
+
+  size_t GetWavelengthNum() const;
+  float GetWavelength(size_t idx = 0) const;
+  void SaveFinalDirections(const char* filename, size_t wavelength_idx = 0, bool append = false);
+
+  /*! @brief Fill final ray directions in data file format, as SaveFinalDirections() writes.
+   *
+   * Rays are rotated to world frame and filtered here, so it must be called before next Start(), while
+   * the data may be written later, e.g. by AsyncFileWriter.
+   *
+   * @param data filled with the header (if header is set) and the rays. Its capacity is reused.
+   */
+  void GetFinalDirections(std::vector<float>* data, size_t wavelength_idx = 0, bool header = true) const;
+  /*! @brief Fill orientation records of rays, in the same order as GetFinalDirections() does.
+   *
+   * A record is (crystal index, main axis latitude, roll, pdf), where angles are in rad, crystal index is the
+   * index of active crystals of the context, and pdf is CrystalContext::GetOrientationPdf(). The header is the
+   * same as that of directions.
+   */
+  void GetOrientations(std::vector<float>* data, size_t wavelength_idx = 0, bool header = true) const;
   void SaveAllRays(const char* filename);
   void PrintRayInfo();    // For debug
 
 private:
   void InitSunRays();
-  void InitEntryRays(const CrystalContextPtr& ctx);
-  void InitMainAxis(const CrystalContextPtr& ctx, float* axis);
-  void TraceRays(const CrystalPtr& crystal);
+  void InitEntryRays(const CrystalContextPtr& ctx, size_t num, size_t buffer_offset,
+                     bool use_samples, bool quasi_random);
+  void SampleEntryRays(const CrystalContextPtr& ctx, size_t num, bool quasi_random,
+                       float* axis_quat, float* lat_roll, float* dir, int* face_id, float* pt);
+  void InitMainAxis(const CrystalContextPtr& ctx, size_t num, const float* u, float* axis_quat, float* lat_roll);
+  float* GetQuasiRandomSamples(size_t first, int dim, int dim_num, size_t num) const;
+  void TraceRays(const CrystalPtr& crystal, float n, int recursion_num, std::vector<RaySegment*>* exit_segments);
+  void TraceCompanions(const CrystalPtr& crystal, size_t ray_offset);
+  void PrepareTransferTables(float n);
+  void GroupCrystals();
+  void BuildTransferTable(const CrystalContextPtr& ctx, float n, TransferTable* table);
+  void TransferRays(const TransferTable& table, std::vector<RaySegment*>* exit_segments);
   void RestoreResultRays();
-  void StoreRaySegments();
+  void StoreRaySegments(std::vector<RaySegment*>* exit_segments);
+  size_t GetExitRayNum() const;
   void RefreshBuffer();
 
   static constexpr int kBufferSizeFactor = 4;
+  static constexpr size_t kRayRefCountSize = 32;   // Bytes of the shared_ptr control block of a Ray
+  static constexpr uint64_t kMinBatchRayNum = 1000;
 
   SimulationContextPtr context_;
+  ThreadingPool* threading_pool_;
+  RaySegmentPoolPtr ray_seg_pool_;
+  std::vector<float> wavelengths_;
+  size_t hero_idx_;
+  const LightSpectrum* spectrum_;     // Not nullptr for spectral tracing
   std::vector<CrystalContextPtr> active_crystal_ctxs_;
+  std::vector<SimulationCost> crystal_costs_;
 
   std::vector<std::vector<RayPtr> > rays_;
   std::vector<std::vector<RaySegment*> > exit_ray_segments_;
   std::vector<RaySegment*> final_ray_segments_;
+  std::vector<std::vector<RaySegment*> > companion_ray_segments_;    // Indexed by wavelength, empty for hero
 
+  uint64_t ray_num_;
   size_t total_ray_num_;
   size_t active_ray_num_;
   size_t buffer_size_;
 
   SimulationBufferData buffer_;
   EnterRayData enter_ray_data_;
+  EntrySampleData entry_samples_;
   size_t enter_ray_offset_;
+
+  Math::SobolSampler sobol_;
+  uint64_t sobol_offset_;
+  bool mirror_symmetric_;
+  bool mirror_copies_;
+  bool record_orientations_;
+
+  std::vector<std::shared_ptr<TransferTable> > transfer_tables_;    // Kept for following Start()
+  std::vector<const TransferTable*> crystal_tables_;                // For active crystals, nullptr if not used
+  std::vector<std::vector<size_t> > crystal_groups_;                // Active crystals traced in one batch
 };
 
 }  // namespace IceHalo
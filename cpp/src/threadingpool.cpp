@@ -1,5 +1,7 @@
 #include "threadingpool.h"
 
+#include <algorithm>
+
 namespace IceHalo {
 
 
@@ -13,11 +15,7 @@ ThreadingPool* ThreadingPool::GetInstance() {
     {
       std::unique_lock<std::mutex> lock(instance_mutex_);
       if (instance_ == nullptr) {
-#ifdef MULTI_THREAD
-        instance_ = new ThreadingPool(kHardwareConcurrency);
-#else
-        instance_ = new ThreadingPool();    // Default use single thread.
-#endif
+        instance_ = new ThreadingPool(GetDefaultThreadNum());
       }
     }
   }
@@ -25,6 +23,15 @@ ThreadingPool* ThreadingPool::GetInstance() {
 }
 
 
+size_t ThreadingPool::GetDefaultThreadNum() {
+#ifdef MULTI_THREAD
+  return static_cast<size_t>(std::max(kHardwareConcurrency, 1));
+#else
+  return 1;    // Default use single thread.
+#endif
+}
+
+
 ThreadingPool::ThreadingPool(size_t num)
     : thread_num_(num), alive_(false),
       running_jobs_(0), alive_threads_(0) {
@@ -32,6 +39,21 @@ ThreadingPool::ThreadingPool(size_t num)
 }
 
 
+// Finish all queued jobs and stop working threads.
+ThreadingPool::~ThreadingPool() {
+  {
+    std::unique_lock<std::mutex> lock(queue_mutex_);
+    alive_ = false;
+  }
+  queue_condition_.notify_all();
+  for (auto& t : pool_) {
+    if (t.joinable()) {
+      t.join();
+    }
+  }
+}
+
+
 void ThreadingPool::Start() {
   if (alive_ || running_jobs_ > 0 || alive_threads_ > 0) {
     return;
@@ -14,7 +14,8 @@ namespace IceHalo {
 
 class ThreadingPool {
 public:
-  ~ThreadingPool() = default;
+  explicit ThreadingPool(size_t num = 1);
+  ~ThreadingPool();
 
   void Start();
   void AddJob(std::function<void()> job);
@@ -22,10 +23,9 @@ public:
   bool TaskRunning();
 
   static ThreadingPool* GetInstance();
+  static size_t GetDefaultThreadNum();    // Hardware concurrency if MULTI_THREAD is defined, otherwise 1
 
 private:
-  ThreadingPool(size_t num = 1);
-
   size_t thread_num_;
   std::vector<std::thread> pool_;
   std::atomic<bool> alive_;
@@ -0,0 +1,61 @@
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "render.h"
+#include "context.h"
+#include "files.h"
+
+int main(int argc, char* argv[]) {
+  if (argc != 2) {
+    std::printf("USAGE: %s config.json\n", argv[0]);
+    return -1;
+  }
+
+  auto start = std::chrono::system_clock::now();
+  std::vector<IceHalo::RenderContextPtr> views = IceHalo::RenderContext::CreateViewsFromFile(argv[1]);
+  if (views.empty()) {
+    return -1;
+  }
+
+  int ret = 0;
+  for (const auto& ctx : views) {
+    uint32_t img_wid = 0;
+    uint32_t img_hei = 0;
+    std::vector<float> hdr_rgb_data;
+    if (!IceHalo::ReadPfm(ctx->GetHdrImagePath().c_str(), &img_wid, &img_hei, &hdr_rgb_data)) {
+      fprintf(stderr, "Failed to read HDR image %s!\n", ctx->GetHdrImagePath().c_str());
+      ret = -1;
+      continue;
+    }
+    if (img_wid != ctx->GetImageWidth() || img_hei != ctx->GetImageHeight()) {
+      fprintf(stderr, "HDR image size %ux%u does not match config %ux%u!\n",
+              img_wid, img_hei, ctx->GetImageWidth(), ctx->GetImageHeight());
+      ret = -1;
+      continue;
+    }
+
+    std::vector<float> xyz_data(hdr_rgb_data.size());
+    IceHalo::SpectrumRenderer::LinearRgbToXyz(hdr_rgb_data.data(), xyz_data.data(), img_wid * img_hei);
+
+    auto flat_rgb_data = new uint8_t[3 * img_wid * img_hei];
+    IceHalo::SpectrumRenderer::Tonemap(ctx, xyz_data.data(), flat_rgb_data);
+
+    cv::Mat img(img_hei, img_wid, CV_8UC3, flat_rgb_data);
+    cv::cvtColor(img, img, cv::COLOR_RGB2BGR);
+    try {
+      cv::imwrite(ctx->GetImagePath(), img);
+    } catch (cv::Exception& ex) {
+      fprintf(stderr, "Exception converting image to PNG format: %s\n", ex.what());
+      ret = -1;
+    }
+    delete[] flat_rgb_data;
+  }
+
+  auto t1 = std::chrono::system_clock::now();
+  std::chrono::duration<float, std::ratio<1, 1000> > diff = t1 - start;
+  std::printf("Total: %.2fms\n", diff.count());
+  return ret;
+}
@@ -1,43 +1,364 @@
 #include <chrono>
+#include <atomic>
+#include <cinttypes>
+#include <cstring>
+#include <thread>
+#include <vector>
 
 #include "context.h"
 #include "simulation.h"
+#include "threadingpool.h"
 
 using namespace IceHalo;
 
+constexpr uint64_t kCalibrationRayNum = 10000;
+constexpr uint32_t kCalibrationStream = 0xffffffffu;    // Apart from streams of the simulation
+
+
+// Trace a few rays of a wavelength group, and return the cost of every crystal.
+// An empty group means spectral tracing.
+std::vector<SimulationCost> Calibrate(const SimulationContextPtr& context, const std::vector<float>& wavelengths,
+                                      uint64_t ray_num) {
+  Simulator simulator(context);
+  simulator.SetRayNumber(ray_num);
+  Math::RandomNumberGenerator::GetInstance()->Reseed(kCalibrationStream);
+  if (wavelengths.empty()) {
+    simulator.Start();
+  } else {
+    simulator.Start(wavelengths);
+  }
+  return simulator.GetCrystalCosts();
+}
+
+
+SimulationCost SumCost(const std::vector<SimulationCost>& costs) {
+  SimulationCost sum;
+  for (const auto& c : costs) {
+    sum += c;
+  }
+  return sum;
+}
+
+
+// Peak memory of the process in MB, when simulators trace batches of the most costly group at the same time.
+double GetPeakMemory(const SimulationContextPtr& context, const std::vector<SimulationCost>& group_costs,
+                     uint64_t cost_ray_num, uint64_t batch_ray_num, size_t simulator_num) {
+  double peak_memory = 0;
+  for (const auto& cost : group_costs) {
+    peak_memory = std::max(peak_memory,
+                           static_cast<double>(Simulator::EstimateMemory(context, cost, cost_ray_num,
+                                                                         batch_ray_num)));
+  }
+  return peak_memory * simulator_num / (1024.0 * 1024.0) + Simulator::kBaseMemory;
+}
+
+
+// Batches are never smaller than a minimum, so a max_memory below that of the base or of the smallest batches
+// cannot be met.
+void CheckMemoryLimit(const SimulationContextPtr& context, double peak_memory) {
+  if (context->GetMaxMemory() > 0 && peak_memory > context->GetMaxMemory()) {
+    fprintf(stderr, "\nWARNING! <max_memory> %lluMB cannot be met, peak memory is estimated at %.1fMB!\n",
+            static_cast<unsigned long long>(context->GetMaxMemory()), peak_memory);
+  }
+}
+
+
+// Calibrate every wavelength group, and size batches with the most costly one.
+uint64_t GetCalibratedBatchRayNumber(const SimulationContextPtr& context,
+                                     const std::vector<std::vector<float> >& groups, size_t simulator_num) {
+  auto total_ray_num = context->GetTotalInitRays();
+  auto calibration_ray_num = std::min(total_ray_num, kCalibrationRayNum);
+  std::vector<SimulationCost> group_costs;
+  uint64_t batch_ray_num = total_ray_num;
+  for (const auto& g : groups) {
+    auto cost = SumCost(Calibrate(context, g, calibration_ray_num));
+    batch_ray_num = std::min(batch_ray_num,
+                             Simulator::GetBatchRayNumber(context, simulator_num, cost, calibration_ray_num));
+    group_costs.emplace_back(cost);
+  }
+  CheckMemoryLimit(context, GetPeakMemory(context, group_costs, calibration_ray_num, batch_ray_num, simulator_num));
+  return batch_ray_num;
+}
+
+
+// Predict memory, output size and time of a simulation from calibration traces, without running it.
+void PrintPlan(const SimulationContextPtr& context, const std::vector<std::vector<float> >& groups,
+               size_t simulator_num) {
+  auto total_ray_num = context->GetTotalInitRays();
+  auto calibration_ray_num = std::min(total_ray_num, kCalibrationRayNum);
+  double scale = static_cast<double>(total_ray_num) / calibration_ray_num;
+  size_t ray_step = context->GetSpectrum() ? 5 : 4;     // Floats of every saved ray
+  constexpr double kMb = 1024.0 * 1024.0;
+
+  printf("Plan for %llu rays, calibrated with %llu rays:\n",
+         static_cast<unsigned long long>(total_ray_num), static_cast<unsigned long long>(calibration_ray_num));
+
+  std::vector<SimulationCost> group_costs;
+  uint64_t batch_ray_num = total_ray_num;
+  double total_output = 0;
+  double total_time = 0;
+  for (const auto& g : groups) {
+    if (g.empty()) {
+      printf("spectral:\n");
+    } else {
+      for (auto wl : g) {
+        printf("%.1f ", wl);
+      }
+      printf("nm:\n");
+    }
+
+    auto costs = Calibrate(context, g, calibration_ray_num);
+    for (size_t i = 0; i < costs.size(); i++) {
+      const auto& c = costs[i];
+      if (c.entry_ray_num == 0) {
+        printf("  crystal %zu: no rays\n", i);
+        continue;
+      }
+      printf("  crystal %zu: %.2f segments, %.2f exit rays, %.3fus per entry ray\n", i,
+             static_cast<double>(c.ray_segment_num) / c.entry_ray_num,
+             static_cast<double>(c.exit_ray_num) / c.entry_ray_num, c.trace_time * 1e3 / c.entry_ray_num);
+    }
+
+    auto cost = SumCost(costs);
+    auto wavelength_num = std::max(g.size(), static_cast<size_t>(1));
+    double output = (cost.exit_ray_num * scale / wavelength_num * ray_step + 1) * sizeof(float);
+    double time = cost.trace_time * scale;
+    printf("  memory %.1fMB, output %.1fMB per wavelength, ray tracing %.0fms\n",
+           Simulator::EstimateMemory(context, cost, calibration_ray_num, total_ray_num) / kMb, output / kMb, time);
+
+    total_output += output * wavelength_num;
+    total_time += time;
+    batch_ray_num = std::min(batch_ray_num,
+                             Simulator::GetBatchRayNumber(context, simulator_num, cost, calibration_ray_num));
+    group_costs.emplace_back(cost);
+  }
+
+  auto peak_memory = GetPeakMemory(context, group_costs, calibration_ray_num, batch_ray_num, simulator_num);
+  auto batch_num = (total_ray_num + batch_ray_num - 1) / batch_ray_num;
+  printf("Total: peak memory %.1fMB in %llu batches of %llu rays, output %.1fMB, ray tracing %.1fs\n",
+         peak_memory, static_cast<unsigned long long>(batch_num), static_cast<unsigned long long>(batch_ray_num),
+         total_output / kMb, total_time / 1e3 / simulator_num);
+  CheckMemoryLimit(context, peak_memory);
+}
+
+
+// Tag of data file names after a Start(). Symmetric data are tagged for the renderer to fold, unless they
+// already have mirror copies.
+const char* GetDataTag(const Simulator* simulator) {
+  return simulator->IsMirrorSymmetric() && !simulator->HasMirrorCopies() ? kMirrorDataTag : "";
+}
+
+
+// Trace a group of wavelengths. A group of more than one wavelength uses hero-wavelength tracing.
+// Rays are traced in batches of batch_ray_num, and every batch is appended to the same data files.
+// Files are written by writer in background, while the next batch or group is traced.
+// Group g traces batch b on random stream 1 + g + b * group_num. If there is more than one batch, every batch
+// has its own correlated samples, on stream 0 for the first batch and after all group streams for the others.
+// Quasi-random samples of group g are from sequence 1 + g (0 for correlated samples), continued from batch to
+// batch.
+void TraceWavelengths(Simulator* simulator, AsyncFileWriter* writer, const std::vector<float>& wavelengths,
+                      size_t group_idx, size_t group_num, uint64_t total_ray_num, uint64_t batch_ray_num,
+                      bool correlated) {
+  auto rng = Math::RandomNumberGenerator::GetInstance();
+  auto batch_num = (total_ray_num + batch_ray_num - 1) / batch_ray_num;
+  int64_t timestamp = std::chrono::system_clock::now().time_since_epoch().count();
+
+  char filename[256];
+  std::chrono::duration<float, std::ratio<1, 1000> > trace_time{0};
+  std::chrono::duration<float, std::ratio<1, 1000> > save_time{0};
+  for (uint64_t b = 0; b < batch_num; b++) {
+    simulator->SetRayNumber(std::min(batch_ray_num, total_ray_num - b * batch_ray_num));
+    if (correlated && batch_num > 1) {
+      rng->Reseed(static_cast<uint32_t>(b == 0 ? 0 : group_num * batch_num + b));
+      simulator->SetQuasiRandomSequence(0, b * batch_ray_num);
+      simulator->InitCorrelatedSamples();
+    }
+    rng->Reseed(static_cast<uint32_t>(1 + group_idx + b * group_num));
+    simulator->SetQuasiRandomSequence(static_cast<uint32_t>(1 + group_idx), b * batch_ray_num);
+
+    auto t0 = std::chrono::system_clock::now();
+    simulator->Start(wavelengths);
+    auto t1 = std::chrono::system_clock::now();
+    trace_time += t1 - t0;
+
+    t0 = std::chrono::system_clock::now();
+    for (size_t i = 0; i < simulator->GetWavelengthNum(); i++) {
+      float wl = simulator->GetWavelength(i);
+      std::sprintf(filename, "directions_%.1f_%" PRId64 "%s.bin", wl, timestamp, GetDataTag(simulator));
+      auto data = writer->GetBuffer();
+      simulator->GetFinalDirections(&data, i, b == 0);
+      writer->Write(filename, (b > 0 ? OpenMode::kAppend : OpenMode::kWrite) | OpenMode::kBinary,
+                    std::move(data));
+      if (simulator->HasOrientations()) {
+        data = writer->GetBuffer();
+        simulator->GetOrientations(&data, i, b == 0);
+        writer->Write(GetOrientationFileName(filename), (b > 0 ? OpenMode::kAppend : OpenMode::kWrite) |
+                      OpenMode::kBinary, std::move(data));
+      }
+    }
+    t1 = std::chrono::system_clock::now();
+    save_time += t1 - t0;
+  }
+
+  for (auto wl : wavelengths) {
+    printf("%.1f ", wl);
+  }
+  printf("nm: ray tracing %.2fms, saving %.2fms\n", trace_time.count(), save_time.count());
+}
+
+
+// Trace with a wavelength sampled for every ray. All rays go into one data file.
+// Batch b is traced on random stream b + 1, and quasi-random sequence 1 continued from batch to batch.
+void TraceSpectrum(Simulator* simulator, AsyncFileWriter* writer, uint64_t total_ray_num, uint64_t batch_ray_num) {
+  auto rng = Math::RandomNumberGenerator::GetInstance();
+  auto batch_num = (total_ray_num + batch_ray_num - 1) / batch_ray_num;
+  int64_t timestamp = std::chrono::system_clock::now().time_since_epoch().count();
+
+  char filename[256];
+  std::chrono::duration<float, std::ratio<1, 1000> > trace_time{0};
+  std::chrono::duration<float, std::ratio<1, 1000> > save_time{0};
+  for (uint64_t b = 0; b < batch_num; b++) {
+    simulator->SetRayNumber(std::min(batch_ray_num, total_ray_num - b * batch_ray_num));
+    rng->Reseed(static_cast<uint32_t>(b + 1));
+    simulator->SetQuasiRandomSequence(1, b * batch_ray_num);
+
+    auto t0 = std::chrono::system_clock::now();
+    simulator->Start();
+    auto t1 = std::chrono::system_clock::now();
+    trace_time += t1 - t0;
+
+    t0 = std::chrono::system_clock::now();
+    std::sprintf(filename, "directions_spectral_%" PRId64 "%s.bin", timestamp, GetDataTag(simulator));
+    auto data = writer->GetBuffer();
+    simulator->GetFinalDirections(&data, 0, b == 0);
+    writer->Write(filename, (b > 0 ? OpenMode::kAppend : OpenMode::kWrite) | OpenMode::kBinary,
+                  std::move(data));
+    if (simulator->HasOrientations()) {
+      data = writer->GetBuffer();
+      simulator->GetOrientations(&data, 0, b == 0);
+      writer->Write(GetOrientationFileName(filename), (b > 0 ? OpenMode::kAppend : OpenMode::kWrite) |
+                    OpenMode::kBinary, std::move(data));
+    }
+    t1 = std::chrono::system_clock::now();
+    save_time += t1 - t0;
+  }
+
+  printf("spectral: ray tracing %.2fms, saving %.2fms\n", trace_time.count(), save_time.count());
+}
+
+
 int main(int argc, char* argv[]) {
-  if (argc != 2) {
-    printf("USAGE: %s <config-file>\n", argv[0]);
+  bool plan = argc == 3 && std::strcmp(argv[1], "--plan") == 0;
+  if (argc != 2 && !plan) {
+    printf("USAGE: %s [--plan] <config-file>\n", argv[0]);
+    printf("  --plan  predict memory, output size and time from a few rays, without running the simulation\n");
     return -1;
   }
 
   auto start = std::chrono::system_clock::now();
-  SimulationContextPtr context = SimulationContext::CreateFromFile(argv[1]);
-  auto simulator = Simulator(context);
+  SimulationContextPtr context = SimulationContext::CreateFromFile(argv[argc - 1]);
 
   auto t = std::chrono::system_clock::now();
   std::chrono::duration<float, std::ratio<1, 1000> > diff = t - start;
   printf("Initialization: %.2fms\n", diff.count());
 
-  char filename[256];
-  for (auto wl : context->GetWavelengths()) {
-    printf("starting at wavelength: %.1f\n", wl);
+  // Consecutive wavelengths are grouped for hero-wavelength tracing.
+  size_t hero_lanes = static_cast<size_t>(context->GetHeroLanes());
+  if (hero_lanes > 1 && context->GetMultiScatterTimes() > 1) {
+    fprintf(stderr, "\nWARNING! Hero-wavelength tracing does not support multi-scattering, disabled!\n");
+    hero_lanes = 1;
+  }
+  auto wavelengths = context->GetWavelengths();
+  std::vector<std::vector<float> > groups;
+  for (size_t i = 0; i < wavelengths.size(); i += hero_lanes) {
+    groups.emplace_back(wavelengths.begin() + i, wavelengths.begin() + std::min(i + hero_lanes, wavelengths.size()));
+  }
 
-    context->SetCurrentWavelength(wl);
+  // With correlated sampling, entry rays are sampled once on stream 0 and shared by all wavelengths.
+  bool correlated = context->IsCorrelatedSampling();
+  auto concurrent_num = std::min(static_cast<size_t>(context->GetConcurrentWavelengths()), groups.size());
+  if (context->GetSpectrum()) {
+    // Wavelengths are sampled per ray, so the wavelength list is not used. An empty group stands for it.
+    if (context->GetConcurrentWavelengths() > 1) {
+      fprintf(stderr, "\nWARNING! Spectral tracing does not support concurrent wavelengths, disabled!\n");
+    }
+    if (hero_lanes > 1) {
+      fprintf(stderr, "\nWARNING! Spectral tracing does not support hero-wavelength tracing, disabled!\n");
+    }
+    if (correlated) {
+      fprintf(stderr, "\nWARNING! Spectral tracing does not support correlated sampling, disabled!\n");
+    }
+    groups.assign(1, std::vector<float>());
+    concurrent_num = 1;
+  }
+  concurrent_num = std::max(concurrent_num, static_cast<size_t>(1));
 
-    auto t0 = std::chrono::system_clock::now();
-    simulator.Start();
-    auto t1 = std::chrono::system_clock::now();
-    diff = t1 - t0;
-    printf("Ray tracing: %.2fms\n", diff.count());
+  if (plan) {
+    PrintPlan(context, groups, concurrent_num);
+    return 0;
+  }
 
-    t0 = std::chrono::system_clock::now();
-    std::sprintf(filename, "directions_%.1f_%lli.bin", wl, t0.time_since_epoch().count());
-    simulator.SaveFinalDirections(filename);
+  // Simulators running at the same time share the memory limit. Batches are sized with a calibration trace.
+  auto total_ray_num = context->GetTotalInitRays();
+  auto batch_ray_num = total_ray_num;
+  if (context->GetMaxMemory() > 0) {
+    batch_ray_num = GetCalibratedBatchRayNumber(context, groups, concurrent_num);
+  }
+  auto batch_num = (total_ray_num + batch_ray_num - 1) / batch_ray_num;
+  if (batch_num > 1) {
+    printf("Tracing in %llu batches of %llu rays\n",
+           static_cast<unsigned long long>(batch_num), static_cast<unsigned long long>(batch_ray_num));
+  }
 
-    t1 = std::chrono::system_clock::now();
-    diff = t1 - t0;
-    printf("Saving: %.2fms\n", diff.count());
+  // Every simulator fills an output block while another one is written.
+  AsyncFileWriter writer(context->GetDataDirectory(), 2 * concurrent_num);
+  if (context->GetSpectrum()) {
+    auto simulator = Simulator(context);
+    TraceSpectrum(&simulator, &writer, total_ray_num, batch_ray_num);
+  } else if (concurrent_num <= 1) {
+    auto simulator = Simulator(context);
+    auto rng = Math::RandomNumberGenerator::GetInstance();
+    if (correlated && batch_num <= 1) {
+      rng->Reseed(0);
+      simulator.InitCorrelatedSamples();
+    }
+    for (size_t idx = 0; idx < groups.size(); idx++) {
+      printf("starting at wavelength: %.1f\n", groups[idx][0]);
+      TraceWavelengths(&simulator, &writer, groups[idx], idx, groups.size(), total_ray_num, batch_ray_num,
+                       correlated);
+    }
+  } else {
+    // Each worker owns a simulator and a share of the threads, and takes the next wavelength group
+    // when it finishes one. Random streams are bound to group indices, so results are the same as
+    // the serial path, whatever the scheduling is.
+    auto thread_num = (ThreadingPool::GetDefaultThreadNum() + concurrent_num - 1) / concurrent_num;
+    printf("Tracing %zu wavelength groups concurrently\n", concurrent_num);
+
+    std::atomic<size_t> next_idx{0};
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < concurrent_num; i++) {
+      workers.emplace_back([&context, &groups, &next_idx, &writer, thread_num, correlated, total_ray_num,
+                            batch_ray_num, batch_num] {
+        ThreadingPool pool(thread_num);
+        Simulator simulator(context, &pool);
+        if (correlated && batch_num <= 1) {
+          Math::RandomNumberGenerator::GetInstance()->Reseed(0);
+          simulator.InitCorrelatedSamples();
+        }
+        for (size_t idx = next_idx++; idx < groups.size(); idx = next_idx++) {
+          TraceWavelengths(&simulator, &writer, groups[idx], idx, groups.size(), total_ray_num, batch_ray_num,
+                           correlated);
+        }
+      });
+    }
+    for (auto& w : workers) {
+      w.join();
+    }
+  }
+  int ret = 0;
+  if (!writer.Flush()) {
+    fprintf(stderr, "Failed to write data files!\n");
+    ret = -1;
   }
   context->PrintCrystalInfo();
 
@@ -45,5 +366,5 @@ int main(int argc, char* argv[]) {
   diff = end - start;
   printf("Total: %.3fs\n", diff.count() / 1e3);
 
-  return 0;
+  return ret;
 }
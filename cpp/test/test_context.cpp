@@ -1,11 +1,18 @@
 #include "context.h"
+#include "crystal.h"
 #include "mymath.h"
 
 #include "gtest/gtest.h"
 
+#include <cmath>
+#include <set>
+#include <stdexcept>
 #include <string>
+#include <vector>
 
 extern std::string config_file_name;
+std::string CreateTempDirectory();
+std::string WriteTempConfig(const std::string& dir, const char* format, ...);
 
 namespace {
 
@@ -42,10 +49,160 @@ TEST_F(ContextTest, FillSunDir) {
   sampler->SampleSphericalPointsCart(sun_dir, sun_d / 2, dir, kRayNum);
 
   for (int i = 0; i < kRayNum; i++) {
-    float a = std::acos(IceHalo::Math::Dot3(sun_dir, dir + i * 3));    // In rad
+    float cross[3];
+    IceHalo::Math::Cross3(sun_dir, dir + i * 3, cross);
+    float a = std::atan2(IceHalo::Math::Norm3(cross), IceHalo::Math::Dot3(sun_dir, dir + i * 3));   // In rad
     a *= IceHalo::Math::kRadToDegree;    // To degree
     EXPECT_TRUE(a < sun_d / 2 + 1e-3);
   }
 }
 
+
+TEST(CrystalContextTest, OrientationPdf) {
+  using IceHalo::Math::Distribution;
+  constexpr int kLatNum = 720;
+  constexpr int kRollNum = 360;
+  const IceHalo::AxisDistribution axes[] = {
+    { Distribution::UNIFORM, Distribution::UNIFORM, 0.0f, 0.0f, 360.0f, 360.0f },
+    { Distribution::GAUSS, Distribution::UNIFORM, 85.0f, 0.0f, 5.0f, 360.0f },
+    { Distribution::GAUSS, Distribution::GAUSS, 0.0f, 10.0f, 40.0f, 50.0f },
+  };
+
+  // Densities integrate to 1 over latitude and one roll period of the crystal
+  for (const auto& axis : axes) {
+    IceHalo::CrystalContext ctx(IceHalo::Crystal::CreateHexPrism(1.2f), axis, IceHalo::RayPathFilterContext(), 1.0f);
+    const float period = IceHalo::Math::kPi / 3;     // Hexagonal symmetry
+    double sum = 0;
+    for (int i = 0; i < kLatNum; i++) {
+      float lat = ((i + 0.5f) / kLatNum - 0.5f) * IceHalo::Math::kPi;
+      for (int j = 0; j < kRollNum; j++) {
+        sum += ctx.GetOrientationPdf(lat, (j + 0.5f) / kRollNum * period);
+      }
+    }
+    sum *= IceHalo::Math::kPi / kLatNum * period / kRollNum;
+    EXPECT_NEAR(sum, 1.0, 2e-3);
+  }
+}
+
+
+TEST(LightSpectrumTest, SampleWeight) {
+  constexpr int kSampleNum = 10000;
+  IceHalo::LightSpectrum flat({ 400.0f, 700.0f }, { 1.0f, 1.0f }, IceHalo::LightSpectrum::Sampling::kIlluminant);
+  IceHalo::LightSpectrum flat_xyz({ 400.0f, 700.0f }, { 1.0f, 1.0f }, IceHalo::LightSpectrum::Sampling::kXyz);
+
+  double w_sum = 0;
+  for (int i = 0; i < kSampleNum; i++) {
+    float u = (i + 0.5f) / kSampleNum;
+    float wl = flat.Sample(u);
+    EXPECT_GE(wl, 400.0f);
+    EXPECT_LE(wl, 700.0f);
+    EXPECT_NEAR(flat.GetWeight(wl), 1.0f, 1e-3);
+
+    wl = flat_xyz.Sample(u);
+    EXPECT_GE(wl, 400.0f);
+    EXPECT_LE(wl, 700.0f);
+    w_sum += flat_xyz.GetWeight(wl);
+  }
+  EXPECT_NEAR(w_sum / kSampleNum, 1.0, 1e-2);
+  EXPECT_EQ(flat_xyz.GetWeight(380.0f), 0.0f);
+}
+
+
+class CrystalFamilyTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    dir = CreateTempDirectory();
+  }
+
+  // A config of a single crystal entry. Populations of active crystals are normalized to a sum of 1.
+  IceHalo::SimulationContextPtr CreateContext(const char* type, const char* parameter) {
+    auto config_path = WriteTempConfig(dir, "{\n"
+                                       "  \"ray\": { \"number\": 10, \"wavelength\": [550] },\n"
+                                       "  \"crystal\": [ { \"enable\": true, \"type\": \"%s\", \"parameter\": %s,\n"
+                                       "                 \"axis\": { \"mean\": 0, \"std\": 0, \"type\": \"gauss\" },\n"
+                                       "                 \"roll\": { \"mean\": 0, \"std\": 0, \"type\": \"gauss\" },\n"
+                                       "                 \"population\": 1.0 } ]\n"
+                                       "}\n", type, parameter);
+    return IceHalo::SimulationContext::CreateFromFile(config_path.c_str());
+  }
+
+  static std::vector<IceHalo::CrystalContextPtr> GetCrystals(const IceHalo::SimulationContextPtr& context) {
+    std::vector<IceHalo::CrystalContextPtr> crystals;
+    context->FillActiveCrystal(&crystals);
+    return crystals;
+  }
+
+  // Top of a hexagonal prism, which is its height parameter
+  static float GetTop(const IceHalo::CrystalPtr& crystal) {
+    const float* v = crystal->GetFaceVertex();
+    float top = v[2];
+    for (int i = 0; i < crystal->TotalFaces() * 3; i++) {
+      top = std::max(top, v[i * 3 + 2]);
+    }
+    return top;
+  }
+
+  std::string dir;
+};
+
+
+TEST_F(CrystalFamilyTest, OneDistribution) {
+  using IceHalo::Math::Distribution;
+
+  auto crystals = GetCrystals(CreateContext("HexPrism",
+                                            R"({"type": "lognormal", "mean": 1.2, "std": 0.3, "buckets": 4})"));
+  ASSERT_EQ(crystals.size(), 4u);
+  for (int k = 0; k < 4; k++) {
+    auto median = 1.2 * std::exp(IceHalo::Math::Quantile(Distribution::GAUSS, 0.0f, 0.3f, (k + 0.5f) / 4));
+    EXPECT_NEAR(GetTop(crystals[k]->GetCrystal()), median, 1e-5);
+    EXPECT_FLOAT_EQ(crystals[k]->GetPopulation(), 1.0f / 4);
+  }
+
+  crystals = GetCrystals(CreateContext("HexPrism", R"({"type": "uniform", "mean": 1.0, "std": 0.5, "buckets": 5})"));
+  ASSERT_EQ(crystals.size(), 5u);
+  for (const auto& c : crystals) {
+    EXPECT_GT(GetTop(c->GetCrystal()), 0.5f);
+    EXPECT_LT(GetTop(c->GetCrystal()), 1.5f);
+  }
+}
+
+
+TEST_F(CrystalFamilyTest, TwoDistributions) {
+  auto crystals = GetCrystals(CreateContext("HexPyramid",
+                                            R"([{"type": "uniform", "mean": 0.5, "std": 0.2, "buckets": 3}, 1.0,
+                                                {"type": "gauss", "mean": 0.5, "std": 0.1, "buckets": 2}])"));
+  ASSERT_EQ(crystals.size(), 6u);
+  std::set<const IceHalo::Crystal*> geometries;
+  for (const auto& c : crystals) {
+    EXPECT_FLOAT_EQ(c->GetPopulation(), 1.0f / (3 * 2));
+    geometries.insert(c->GetCrystal().get());
+  }
+  EXPECT_EQ(geometries.size(), 6u);
+}
+
+
+TEST_F(CrystalFamilyTest, SharedGeometry) {
+  // Buckets of a distribution of std 0 have the same value, so they share one crystal.
+  auto crystals = GetCrystals(CreateContext("HexPrism", R"({"type": "uniform", "mean": 1.0, "std": 0, "buckets": 4})"));
+  ASSERT_EQ(crystals.size(), 4u);
+  for (const auto& c : crystals) {
+    EXPECT_EQ(c->GetCrystal(), crystals[0]->GetCrystal());
+    EXPECT_FLOAT_EQ(c->GetPopulation(), 1.0f / 4);
+  }
+}
+
+
+TEST_F(CrystalFamilyTest, InvalidDistribution) {
+  EXPECT_THROW(CreateContext("HexPrism", R"({"type": "gauss", "mean": 0.1, "std": 1.0, "buckets": 4})"),
+               std::invalid_argument);
+  EXPECT_THROW(CreateContext("HexPyramid", R"([{"type": "uniform", "mean": 1, "std": 0.5}, 1, 0.3, 1.2, 0.9])"),
+               std::invalid_argument);
+  EXPECT_THROW(CreateContext("HexPyramid", R"([1, 1, 1, {"type": "uniform", "mean": 1, "std": 0.5}, 0.3, 1.2, 0.9])"),
+               std::invalid_argument);
+  EXPECT_THROW(CreateContext("IrregularHexPyramid",
+                             R"([1, 1, 1, 1, 1, 1, 1, {"type": "uniform", "mean": 1, "std": 0.5}, 1, 1, 0, 1.2, 0])"),
+               std::invalid_argument);
+  EXPECT_NO_THROW(CreateContext("HexPyramid", R"([1, 1, {"type": "uniform", "mean": 0.3, "std": 0.1}, 1.2, 0.9])"));
+}
+
 }  // namespace
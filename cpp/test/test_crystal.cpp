@@ -280,4 +280,39 @@ TEST_F(CrystalTest, IrregularHexPrismVertex1) {
   checkCrystal(c1, c2);
 }
 
+TEST_F(CrystalTest, Symmetry) {
+  using IceHalo::Math::kPi;
+
+  auto c = IceHalo::Crystal::CreateHexPrism(1.2f);
+  EXPECT_EQ(c->GetRotationalSymmetry(), 6);
+  for (int k = 0; k < 12; k++) {
+    EXPECT_TRUE(c->HasMirrorPlane(k * kPi / 6));
+  }
+  EXPECT_FALSE(c->HasMirrorPlane(kPi / 12));
+
+  auto p = IceHalo::Crystal::CreateHexPyramid(0.3f, 1.0f, 0.3f);
+  EXPECT_EQ(p->GetRotationalSymmetry(), 6);
+
+  float dist[6] = { 1.0f, 1.2f, 1.0f, 1.2f, 1.0f, 1.2f };
+  c = IceHalo::Crystal::CreateIrregularHexPrism(dist, 1.2f);
+  EXPECT_EQ(c->GetRotationalSymmetry(), 3);
+
+  float dist2[6] = { 1.0f, 1.2f, 1.0f, 1.0f, 1.0f, 1.0f };
+  c = IceHalo::Crystal::CreateIrregularHexPrism(dist2, 1.2f);
+  EXPECT_EQ(c->GetRotationalSymmetry(), 1);
+  int mirror_num = 0;
+  for (int k = 0; k < 12; k++) {
+    mirror_num += c->HasMirrorPlane(k * kPi / 12);
+  }
+  EXPECT_EQ(mirror_num, 1);
+}
+
+
+TEST_F(CrystalTest, SameGeometry) {
+  auto c = IceHalo::Crystal::CreateHexPrism(1.2f);
+  EXPECT_TRUE(c->HasSameGeometry(*IceHalo::Crystal::CreateHexPrism(1.2f)));
+  EXPECT_FALSE(c->HasSameGeometry(*IceHalo::Crystal::CreateHexPrism(1.3f)));
+  EXPECT_FALSE(c->HasSameGeometry(*IceHalo::Crystal::CreateHexPyramid(0.3f, 1.0f, 0.3f)));
+}
+
 }  // namespace
@@ -1,9 +1,43 @@
 #include "gtest/gtest.h"
 
+#include <boost/filesystem.hpp>
+
+#include <cstdarg>
+#include <cstdio>
 #include <string>
+#include <vector>
 
 std::string config_file_name;
 
+namespace {
+std::vector<boost::filesystem::path> temp_directories;
+}
+
+
+// A new empty directory for files written by a test. All such directories are removed when tests finish.
+std::string CreateTempDirectory() {
+  auto dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("icehalo-test-%%%%-%%%%");
+  boost::filesystem::create_directories(dir);
+  temp_directories.emplace_back(dir);
+  return dir.string();
+}
+
+
+// Write a config into dir, formatted as printf does, and return its path.
+std::string WriteTempConfig(const std::string& dir, const char* format, ...) {
+  auto config_path = (boost::filesystem::path(dir) / "config.json").string();
+  FILE* fp = std::fopen(config_path.c_str(), "w");
+  if (fp) {
+    va_list args;
+    va_start(args, format);
+    std::vfprintf(fp, format, args);
+    va_end(args);
+    std::fclose(fp);
+  }
+  return config_path;
+}
+
+
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
 
@@ -13,5 +47,11 @@ int main(int argc, char **argv) {
     config_file_name = "";
   }
 
-  return RUN_ALL_TESTS();
-}
\ No newline at end of file
+  int ret = RUN_ALL_TESTS();
+
+  boost::system::error_code ec;
+  for (const auto& dir : temp_directories) {
+    boost::filesystem::remove_all(dir, ec);
+  }
+  return ret;
+}
@@ -1,6 +1,7 @@
 #include "optics.h"
 #include "crystal.h"
 #include "simulation.h"
+#include "simdmath.h"
 
 #include "gtest/gtest.h"
 
@@ -205,6 +206,51 @@ TEST_F(OpticsTest, RayFaceIntersection1) {
 }
 
 
+TEST_F(OpticsTest, RayFaceIntersection2) {
+  auto c = IceHalo::Crystal::CreateHexPrism(1.0f);
+  auto face_num = c->TotalFaces();
+  auto face_norm = c->GetFaceNorm();
+  auto face_base = c->GetFaceBaseVector();
+  auto face_point = c->GetFaceVertex();
+
+  constexpr int num = 3;
+  float dir_in[num * 3] = {
+    IceHalo::Math::kSqrt3 / 2, 0.5f, 0.0f,
+    0.5f, 0.0f, -IceHalo::Math::kSqrt3 / 2,
+    0.35693541f,	-0.18690710f,	-0.91523923f,
+  };
+  float p_in[num * 3] = {
+    -IceHalo::Math::kSqrt3 / 2, 0.0f, 0.0f,
+    0.0f, 0.0f, 0.0f,
+    -0.1f, 0.82679492f, 0.8f,
+  };
+  int id_in[num] = { 10, 1, 8 };
+
+  for (int i = 0; i < num; i++) {
+    float expect_pt[3] = { 0, 0, 0, };
+    int expect_id = -1;
+    IceHalo::Optics::IntersectLineWithTriangles(p_in + i * 3, dir_in + i * 3, id_in[i], face_num,
+                                                face_base, face_point, face_norm,
+                                                expect_pt, &expect_id);
+    ASSERT_GE(expect_id, 0);
+
+    for (int k = 0; k < face_num; k++) {
+      float test_pt[3] = { 0, 0, 0, };
+      bool hit = IceHalo::Optics::IntersectLineWithTriangle(p_in + i * 3, dir_in + i * 3,
+                                                            face_base + k * 6, face_point + k * 9, test_pt);
+      if (k == expect_id) {
+        EXPECT_TRUE(hit);
+        for (int j = 0; j < 3; j++) {
+          EXPECT_NEAR(test_pt[j], expect_pt[j], IceHalo::Math::kFloatEps);
+        }
+      } else if (k != id_in[i]) {
+        EXPECT_FALSE(hit);
+      }
+    }
+  }
+}
+
+
 TEST_F(OpticsTest, RayTracing) {
   context->PrintCrystalInfo();
   auto wls = context->GetWavelengths();
@@ -214,4 +260,178 @@ TEST_F(OpticsTest, RayTracing) {
   simulator.PrintRayInfo();
 }
 
+
+TEST(RotationTest, QuatMatchesAngles) {
+  auto rng = IceHalo::Math::RandomNumberGenerator::GetInstance();
+  constexpr size_t kNum = 19;     // Not a multiple of SIMD width
+  float quat[kNum * 4];
+  float angles[kNum * 3];
+  float vec[kNum * 3];
+  float out[kNum * 3];
+  float back[kNum * 3];
+  for (size_t i = 0; i < kNum; i++) {
+    angles[i * 3 + 0] = (rng->GetUniform() * 2 - 1) * IceHalo::Math::kPi;
+    angles[i * 3 + 1] = (rng->GetUniform() - 0.5f) * IceHalo::Math::kPi;
+    angles[i * 3 + 2] = rng->GetUniform() * 2 * IceHalo::Math::kPi;
+    IceHalo::Math::RotateZQuat(angles + i * 3, quat + i * 4);
+    for (int k = 0; k < 3; k++) {
+      vec[i * 3 + k] = rng->GetUniform() * 2 - 1;
+    }
+  }
+
+  IceHalo::Math::RotateByQuat(quat, vec, out, kNum);
+  IceHalo::Math::RotateByQuat(quat, out, back, kNum, true);
+  for (size_t i = 0; i < kNum; i++) {
+    float expect[3];
+    IceHalo::Math::RotateZ(angles + i * 3, vec + i * 3, expect);
+    for (int k = 0; k < 3; k++) {
+      EXPECT_NEAR(out[i * 3 + k], expect[k], 1e-5);
+      EXPECT_NEAR(back[i * 3 + k], vec[i * 3 + k], 1e-5);
+    }
+  }
+}
+
+
+TEST(RotationTest, BatchedMathMatchesStd) {
+  constexpr size_t kNum = 1003;   // Not a multiple of SIMD width
+  float x[kNum], u[kNum], s[kNum], c[kNum], y[kNum], a[kNum], r[kNum];
+  for (size_t i = 0; i < kNum; i++) {
+    x[i] = (i / (kNum - 1.0f) * 2 - 1) * 2 * IceHalo::Math::kPi;
+    u[i] = i / (kNum - 1.0f) * 2 - 1;
+  }
+  IceHalo::Math::SinCosFast(x, s, c, kNum);
+  IceHalo::Math::AsinFast(u, y, kNum);
+  IceHalo::Math::Atan2Fast(u, x, a, kNum);
+  IceHalo::Math::RsqrtFast(c, r, kNum);   // Includes negative inputs, which must give NaN
+  for (size_t i = 0; i < kNum; i++) {
+    EXPECT_NEAR(s[i], std::sin(static_cast<double>(x[i])), 1e-7);
+    EXPECT_NEAR(c[i], std::cos(static_cast<double>(x[i])), 1e-7);
+    EXPECT_NEAR(y[i], std::asin(static_cast<double>(u[i])), 1e-6);
+    EXPECT_NEAR(a[i], std::atan2(static_cast<double>(u[i]), static_cast<double>(x[i])), 1e-6);
+    if (c[i] > 0) {
+      EXPECT_NEAR(r[i] * std::sqrt(static_cast<double>(c[i])), 1.0, 1e-6);
+    } else if (c[i] < 0) {
+      EXPECT_TRUE(std::isnan(r[i]));
+    }
+  }
+}
+
+
+TEST(RandomTest, BulkMatchesScalar) {
+  auto rng = IceHalo::Math::RandomNumberGenerator::GetInstance();
+  constexpr size_t kNum = 1001;   // Not a multiple of lanes or buffer size
+  std::vector<float> bulk(kNum * 2);
+  std::vector<float> scalar(kNum * 2);
+
+  rng->Reseed(7);
+  rng->GetUniform();    // Start in the middle of a round
+  rng->GetUniform(bulk.data(), kNum);
+  rng->GetGaussian(bulk.data() + kNum, kNum);
+  rng->Reseed(7);
+  rng->GetUniform();
+  for (size_t i = 0; i < kNum; i++) {
+    scalar[i] = rng->GetUniform();
+  }
+  for (size_t i = 0; i < kNum; i++) {
+    scalar[kNum + i] = rng->GetGaussian();
+  }
+  for (size_t i = 0; i < kNum * 2; i++) {
+    EXPECT_FLOAT_EQ(bulk[i], scalar[i]);
+  }
+
+  double sum = 0;
+  double sum2 = 0;
+  for (size_t i = 0; i < kNum; i++) {
+    EXPECT_GE(bulk[i], 0.0f);
+    EXPECT_LT(bulk[i], 1.0f);
+    sum += bulk[kNum + i];
+    sum2 += bulk[kNum + i] * bulk[kNum + i];
+  }
+  EXPECT_NEAR(sum / kNum, 0.0, 0.1);
+  EXPECT_NEAR(sum2 / kNum, 1.0, 0.1);
+}
+
+
+TEST(RandomTest, SobolStratified) {
+  IceHalo::Math::SobolSampler sobol(3);
+  constexpr size_t kNum = 256;
+  float data[kNum];
+  for (int d = 0; d < IceHalo::Math::SobolSampler::kMaxDim; d++) {
+    sobol.Get(0, d, data, kNum);
+    int count[kNum] = { 0 };
+    for (size_t i = 0; i < kNum; i++) {
+      EXPECT_GT(data[i], 0.0f);
+      EXPECT_LT(data[i], 1.0f);
+      EXPECT_FLOAT_EQ(data[i], sobol.Get(static_cast<uint32_t>(i), d));
+      count[static_cast<int>(data[i] * kNum)]++;
+    }
+    for (auto c : count) {
+      EXPECT_EQ(c, 1);    // Exactly one point in each stratum
+    }
+  }
+}
+
+
+TEST_F(OpticsTest, TransferTableLookup) {
+  IceHalo::TransferTable table(crystal, 1.31f, 8, 5.0f, 2);
+  auto num = table.GetEntryRayNum();
+  std::vector<float> entry_dir(num * 3);
+  IceHalo::Math::RandomNumberGenerator table_rng(table.GetSeed());
+  table.SampleEntryDirections(&table_rng, entry_dir.data());
+  table.SetExitRays(std::vector<uint32_t>(), std::vector<float>(), std::vector<float>());
+
+  auto rng = IceHalo::Math::RandomNumberGenerator::GetInstance();
+  for (int i = 0; i < 100; i++) {
+    float dir[3] = { rng->GetGaussian(), rng->GetGaussian(), rng->GetGaussian() };
+    IceHalo::Math::Normalize3(dir);
+    float rot[9];
+    auto entry = table.Lookup(dir, rng->GetUniform(), rot);
+    ASSERT_LT(entry, num);
+    EXPECT_EQ(table.GetExitOffset()[entry], table.GetExitOffset()[entry + 1]);
+
+    // A rotation that turns the entry ray to dir
+    const float* e = entry_dir.data() + entry * 3;
+    for (int j = 0; j < 3; j++) {
+      EXPECT_NEAR(rot[j * 3 + 0] * e[0] + rot[j * 3 + 1] * e[1] + rot[j * 3 + 2] * e[2], dir[j], 1e-4);
+      for (int k = 0; k < 3; k++) {
+        float dot = rot[j * 3 + 0] * rot[k * 3 + 0] + rot[j * 3 + 1] * rot[k * 3 + 1] + rot[j * 3 + 2] * rot[k * 3 + 2];
+        EXPECT_NEAR(dot, j == k ? 1.0f : 0.0f, 1e-4);
+      }
+    }
+  }
+}
+
+
+TEST_F(OpticsTest, RaySegmentPoolCount) {
+  IceHalo::RaySegmentPool pool;
+  float pt[3] = { 0, 0, 0 };
+  float dir[3] = { 0, 0, 1 };
+  for (int i = 0; i < 10; i++) {
+    pool.GetRaySegment(pt, dir, 1.0f, 0);
+  }
+  EXPECT_EQ(pool.GetSegmentNum(), 10u);
+  pool.Clear();
+  EXPECT_EQ(pool.GetSegmentNum(), 0u);
+}
+
+
+TEST_F(OpticsTest, SimulationCost) {
+  auto simulator = IceHalo::Simulator(context);
+  simulator.SetRayNumber(1000);
+  simulator.Start();
+
+  IceHalo::SimulationCost total;
+  const auto& costs = simulator.GetCrystalCosts();
+  for (const auto& c : costs) {
+    EXPECT_GE(c.ray_segment_num, c.entry_ray_num);
+    total += c;
+  }
+  EXPECT_GT(total.entry_ray_num, 0u);
+  EXPECT_GT(total.exit_ray_num, 0u);
+
+  auto m1 = IceHalo::Simulator::EstimateMemory(context, total, 1000, 1000);
+  auto m2 = IceHalo::Simulator::EstimateMemory(context, total, 1000, 100000);
+  EXPECT_LT(m1, m2);
+}
+
 }  // namespace
@@ -0,0 +1,134 @@
+#include "render.h"
+#include "context.h"
+#include "files.h"
+
+#include "gtest/gtest.h"
+
+#include <boost/filesystem.hpp>
+
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+std::string CreateTempDirectory();
+std::string WriteTempConfig(const std::string& dir, const char* format, ...);
+
+namespace {
+
+class RenderTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    dir = CreateTempDirectory();
+  }
+
+  // A camera looking at the sun azimuth, so that the vertical plane of the sun splits the image at its middle
+  // column. Rays are accumulated as XYZ.
+  IceHalo::RenderContextPtr CreateContext(const char* mirror_fold) {
+    auto config_path = WriteTempConfig(dir, "{\n"
+                                       "  \"ray\": { \"number\": 1 },\n"
+                                       "  \"data_folder\": \"%s\",\n"
+                                       "  \"camera\": { \"azimuth\": 0, \"elevation\": 20, \"rotation\": 0, \"fov\": 40,\n"
+                                       "              \"width\": %d, \"height\": %d, \"lens\": \"linear\" },\n"
+                                       "  \"render\": { \"visible_semi_sphere\": \"full\", \"accumulation\": \"xyz\",\n"
+                                       "              \"mirror_fold\": \"%s\" }\n"
+                                       "}\n", dir.c_str(), kImageSize, kImageSize, mirror_fold);
+    return IceHalo::RenderContext::CreateViewsFromFile(config_path.c_str())[0];
+  }
+
+  // A data file of rays at a single wavelength, 4 floats per ray.
+  void WriteData(const char* filename, const std::vector<float>& rays) {
+    IceHalo::File file(dir.c_str(), filename);
+    ASSERT_TRUE(file.Open(IceHalo::OpenMode::kWrite | IceHalo::OpenMode::kBinary));
+    file.Write(kWavelength);
+    file.Write(rays.data(), rays.size());
+    file.Close();
+  }
+
+  std::vector<float> Render(const char* mirror_fold) {
+    auto context = CreateContext(mirror_fold);
+    IceHalo::SpectrumRenderer renderer(context);
+    renderer.LoadData();
+    std::vector<float> xyz(kImageSize * kImageSize * 3);
+    renderer.RenderToXyz(xyz.data());
+    return xyz;
+  }
+
+  static std::vector<size_t> LitPixels(const std::vector<float>& xyz) {
+    std::vector<size_t> pixels;
+    for (size_t i = 0; i < xyz.size() / 3; i++) {
+      if (xyz[i * 3 + 1] > 0) {
+        pixels.emplace_back(i);
+      }
+    }
+    return pixels;
+  }
+
+  static double Sum(const std::vector<float>& xyz) {
+    double sum = 0;
+    for (auto v : xyz) {
+      sum += v;
+    }
+    return sum;
+  }
+
+  static constexpr int kImageSize = 64;
+  static constexpr float kWavelength = 550.0f;
+  static constexpr float kRay[4] = { 0.36f, -0.8f, -0.48f, 1.0f };   // dx, dy, dz, w
+
+  std::string dir;
+};
+
+constexpr int RenderTest::kImageSize;
+constexpr float RenderTest::kWavelength;
+constexpr float RenderTest::kRay[];
+
+
+TEST_F(RenderTest, MirrorDataTag) {
+  EXPECT_TRUE(IceHalo::IsMirrorData(IceHalo::File("/tmp", "directions_550.0_123_mirror.bin")));
+  EXPECT_FALSE(IceHalo::IsMirrorData(IceHalo::File("/tmp", "directions_550.0_123.bin")));
+  EXPECT_FALSE(IceHalo::IsMirrorData(IceHalo::File("/tmp", "directions_550.0_mirror_123.bin")));
+  EXPECT_FALSE(IceHalo::IsMirrorData(IceHalo::File("/tmp", "mirror")));
+}
+
+
+TEST_F(RenderTest, MirrorFoldModes) {
+  WriteData("directions_mirror.bin", std::vector<float>(kRay, kRay + 4));
+  auto never = Render("never");
+  auto folded = Render("auto");
+  EXPECT_EQ(Render("always"), folded);
+
+  auto never_pixels = LitPixels(never);
+  auto folded_pixels = LitPixels(folded);
+  ASSERT_EQ(never_pixels.size(), 1u);
+  ASSERT_EQ(folded_pixels.size(), 2u);
+
+  // The folded ray lands on its pixel and on the mirrored one, with half weight on each.
+  auto p = never_pixels[0];
+  ASSERT_TRUE(folded_pixels[0] == p || folded_pixels[1] == p);
+  auto q = folded_pixels[0] == p ? folded_pixels[1] : folded_pixels[0];
+  EXPECT_EQ(p / kImageSize, q / kImageSize);
+  EXPECT_LE(std::abs(static_cast<int>(p % kImageSize + q % kImageSize) - kImageSize), 1);
+  EXPECT_NE(p % kImageSize, q % kImageSize);
+  for (int c = 0; c < 3; c++) {
+    EXPECT_FLOAT_EQ(folded[p * 3 + c], never[p * 3 + c] * 0.5f);
+    EXPECT_FLOAT_EQ(folded[q * 3 + c], never[p * 3 + c] * 0.5f);
+  }
+  EXPECT_NEAR(Sum(folded), Sum(never), Sum(never) * 1e-6);
+
+  // Folding a ray is the same as tracing it and its mirror image with half weight each.
+  boost::filesystem::remove(boost::filesystem::path(dir) / "directions_mirror.bin");
+  WriteData("directions.bin", { kRay[0], kRay[1], kRay[2], kRay[3] * 0.5f,
+                                -kRay[0], kRay[1], kRay[2], kRay[3] * 0.5f });
+  EXPECT_EQ(Render("never"), folded);
+}
+
+
+TEST_F(RenderTest, MirrorFoldAutoNeedsTag) {
+  WriteData("directions.bin", std::vector<float>(kRay, kRay + 4));
+  auto never = Render("never");
+  EXPECT_EQ(Render("auto"), never);
+  EXPECT_EQ(LitPixels(never).size(), 1u);
+  EXPECT_EQ(LitPixels(Render("always")).size(), 2u);
+}
+
+}  // namespace